@@ -3,128 +3,288 @@
  * @authors Luis Damiano
  * @version 0.1
  * @details R wrapper for the (awesome) Particle Filter.
+ *
+ * Called with `.Call`: the measurements are read from the R columns in
+ * place and the filter writes its output straight into R vectors allocated
+ * here in their final shape, so nothing big is copied on either side. The
+ * filter runs on the workspace given by R, or on one made for this call.
  */
 
 #include "main.h"
 
-void Rfilter(double *Ry1, double *Ry2, int *RT,
-		double *LOCATION_1_X, double *LOCATION_1_Y,
-		double *LOCATION_2_X, double *LOCATION_2_Y,
-		double *DT,
-		double *MEASUREMENT_ERROR_1,
-		double *STATE_DIFFUSION_1, double *STATE_DIFFUSION_2,
-		double *STATEPRIOR_MU_X, double *STATEPRIOR_MU_Y,
-		double *STATEPRIOR_L_00, double *STATEPRIOR_L_11,
-		double *STATEPRIOR_L_22, double *STATEPRIOR_L_33,
-		double *IMPORTANCE_L_00, double *IMPORTANCE_L_11,
-		double *IMPORTANCE_L_22, double *IMPORTANCE_L_33,
-		int* NPARTICLES,
-		double *noiselessOut,
-		double *RxMeanOut, double *RwOut, double *RessOut);
-
-void Rfilter(double *Ry1, double *Ry2, int *RT,
-		double *LOCATION_1_X, double *LOCATION_1_Y,
-		double *LOCATION_2_X, double *LOCATION_2_Y,
-		double *DT,
-		double *MEASUREMENT_ERROR_1,
-		double *STATE_DIFFUSION_1, double *STATE_DIFFUSION_2,
-		double *STATEPRIOR_MU_X, double *STATEPRIOR_MU_Y,
-		double *STATEPRIOR_L_00, double *STATEPRIOR_L_11,
-		double *STATEPRIOR_L_22, double *STATEPRIOR_L_33,
-		double *IMPORTANCE_L_00, double *IMPORTANCE_L_11,
-		double *IMPORTANCE_L_22, double *IMPORTANCE_L_33,
-		int* NPARTICLES,
-		double *RnoiselessOut,
-		double *RxMeanOut, double *RwOut, double *RessOut) {
-
-	/* Read data from R*/
-	gsl_matrix *y = gsl_matrix_alloc(*RT, MEASUREMENT_DIM);
-	int T = *RT;
-
-	/* RECALL: R is col-major order while GSL is row-major order. */
-	for (int i = 0; i < T; i++) {
-		gsl_matrix_set(y, i, 0, Ry1[i]);
-		gsl_matrix_set(y, i, 1, Ry2[i]);
-	}
+#define NAMED_OUT_MAX 10 /* int, elements of the returned list */
+#define NSTATS_COUNTERS 8 /* int, keep in sync with STATS_COUNTERS in R/ */
+
+SEXP Rfilter(SEXP RY, SEXP RSENSORS,
+		SEXP DT,
+		SEXP MEASUREMENT_ERROR_1,
+		SEXP STATE_DIFFUSION_1, SEXP STATE_DIFFUSION_2,
+		SEXP STATEPRIOR_MU_X, SEXP STATEPRIOR_MU_Y,
+		SEXP STATEPRIOR_L_00, SEXP STATEPRIOR_L_11,
+		SEXP STATEPRIOR_L_22, SEXP STATEPRIOR_L_33,
+		SEXP IMPORTANCE_L_00, SEXP IMPORTANCE_L_11,
+		SEXP IMPORTANCE_L_22, SEXP IMPORTANCE_L_33,
+		SEXP NPARTICLES, SEXP SEED, SEXP NTHREADS,
+		SEXP RESAMPLE_SCHEME, SEXP ESS_THRESHOLD,
+		SEXP OUTPUT_LEVEL, SEXP QUANTILE_PROBS,
+		SEXP SMOOTHER, SEXP LAG, SEXP NTRAJECTORIES, SEXP PROPOSAL,
+		SEXP RAO_BLACKWELL, SEXP BEARING_TOL, SEXP STATS,
+		SEXP TRACE_FILE, SEXP TRACE_EVERY, SEXP TRACE_INDICES,
+		SEXP WORKSPACE);
+void Rworkspace_finalize(SEXP ptr); /* Rworkspace.c */
 
-	gsl_vector* location1 = gsl_vector_alloc(MEASUREMENT_DIM);
-	gsl_vector* location2 = gsl_vector_alloc(MEASUREMENT_DIM);
+/**
+ * Free the result behind an external pointer (finalizer).
+ *
+ * @param ptr The external pointer.
+ */
+static void result_finalize(SEXP ptr) {
+	filter_result *res = (filter_result *)R_ExternalPtrAddr(ptr);
 
-	gsl_vector_set(location1, 0, *LOCATION_1_X);
-	gsl_vector_set(location1, 1, *LOCATION_1_Y);
-	gsl_vector_set(location2, 0, *LOCATION_2_X);
-	gsl_vector_set(location2, 1, *LOCATION_2_Y);
+	if (res == NULL)
+		return;
 
-	gsl_matrix *baseline = gsl_matrix_alloc(T, MEASUREMENT_DIM);
-	noiseless(y, location1, location2, baseline);
+	filter_result_free(res);
+	R_ClearExternalPtr(ptr);
+}
 
-	/* Initialize model */
+/**
+ * Run the filter for R.
+ *
+ * @param RY The measurements, one column per sensor: a list of double
+ * vectors (e.g. a data frame) or a double matrix.
+ * @param RSENSORS A double matrix with the sensor locations (x, y), one row
+ * per sensor.
+ * @param WORKSPACE An external pointer to a workspace (see Rworkspace.c), or
+ * NULL.
+ * @return A named list with the output (see R/particle_filter.R). Entries
+ * not needed by the output level, the smoother or the statistics are left
+ * out.
+ */
+SEXP Rfilter(SEXP RY, SEXP RSENSORS,
+		SEXP DT,
+		SEXP MEASUREMENT_ERROR_1,
+		SEXP STATE_DIFFUSION_1, SEXP STATE_DIFFUSION_2,
+		SEXP STATEPRIOR_MU_X, SEXP STATEPRIOR_MU_Y,
+		SEXP STATEPRIOR_L_00, SEXP STATEPRIOR_L_11,
+		SEXP STATEPRIOR_L_22, SEXP STATEPRIOR_L_33,
+		SEXP IMPORTANCE_L_00, SEXP IMPORTANCE_L_11,
+		SEXP IMPORTANCE_L_22, SEXP IMPORTANCE_L_33,
+		SEXP NPARTICLES, SEXP SEED, SEXP NTHREADS,
+		SEXP RESAMPLE_SCHEME, SEXP ESS_THRESHOLD,
+		SEXP OUTPUT_LEVEL, SEXP QUANTILE_PROBS,
+		SEXP SMOOTHER, SEXP LAG, SEXP NTRAJECTORIES, SEXP PROPOSAL,
+		SEXP RAO_BLACKWELL, SEXP BEARING_TOL, SEXP STATS,
+		SEXP TRACE_FILE, SEXP TRACE_EVERY, SEXP TRACE_INDICES,
+		SEXP WORKSPACE) {
+
+	const int byList = Rf_isNewList(RY);
+	const int nSensors = Rf_nrows(RSENSORS);
+	const int T = byList ? Rf_length(VECTOR_ELT(RY, 0)) : Rf_nrows(RY);
+	const int nParticles = Rf_asInteger(NPARTICLES);
+	const int nThreads = Rf_asInteger(NTHREADS);
+	const int nQuantiles = Rf_length(QUANTILE_PROBS);
+	const double *sensorsIn = REAL(RSENSORS);
+	const double *y[nSensors];
+
+	/* Read data from R: one column per sensor */
+	for (int j = 0; j < nSensors; j++)
+		y[j] = byList ? REAL(VECTOR_ELT(RY, j)) :
+					REAL(RY) + (size_t)j * T;
+
+	/* Model parameters, set up by the workspace */
 	model_param param;
-	param.baseline = baseline;
-	param.dt = *DT;
-	param.l1x = *LOCATION_1_X;
-	param.l1y = *LOCATION_1_Y;
-	param.l2x = *LOCATION_2_X;
-	param.l2y = *LOCATION_2_Y;
-	param.sr = *MEASUREMENT_ERROR_1;
-
-	param.q1 = *STATE_DIFFUSION_1;
-	param.q2 = *STATE_DIFFUSION_2;
-
-	param.statepriorMuX = *STATEPRIOR_MU_X;
-	param.statepriorMuY = *STATEPRIOR_MU_Y;
-	param.statepriorL00 = *STATEPRIOR_L_00;
-	param.statepriorL11 = *STATEPRIOR_L_11;
-	param.statepriorL22 = *STATEPRIOR_L_22;
-	param.statepriorL33 = *STATEPRIOR_L_33;
-
-	param.importanceL00 = *IMPORTANCE_L_00;
-	param.importanceL11 = *IMPORTANCE_L_11;
-	param.importanceL22 = *IMPORTANCE_L_22;
-	param.importanceL33 = *IMPORTANCE_L_33;
-
-	importance_init(&param);
-	state_init(&param);
-	measurement_init(&param);
-
-	/* Run particle filter */
-	gsl_matrix *xMeanOut = gsl_matrix_alloc(T + 1, STATE_DIM);
-	gsl_matrix *wOut = gsl_matrix_alloc(T + 1, *NPARTICLES);
-	gsl_vector* essOut = gsl_vector_alloc(T + 1);
-
-	filter(y, *NPARTICLES, &param, &xMeanOut, &wOut, &essOut);
-
-	/* Write results to R */
+	param.dt = Rf_asReal(DT);
+	param.sr = Rf_asReal(MEASUREMENT_ERROR_1);
+
+	param.q1 = Rf_asReal(STATE_DIFFUSION_1);
+	param.q2 = Rf_asReal(STATE_DIFFUSION_2);
+
+	param.statepriorMuX = Rf_asReal(STATEPRIOR_MU_X);
+	param.statepriorMuY = Rf_asReal(STATEPRIOR_MU_Y);
+	param.statepriorL00 = Rf_asReal(STATEPRIOR_L_00);
+	param.statepriorL11 = Rf_asReal(STATEPRIOR_L_11);
+	param.statepriorL22 = Rf_asReal(STATEPRIOR_L_22);
+	param.statepriorL33 = Rf_asReal(STATEPRIOR_L_33);
+
+	param.importanceL00 = Rf_asReal(IMPORTANCE_L_00);
+	param.importanceL11 = Rf_asReal(IMPORTANCE_L_11);
+	param.importanceL22 = Rf_asReal(IMPORTANCE_L_22);
+	param.importanceL33 = Rf_asReal(IMPORTANCE_L_33);
+
+	/* Filter settings */
+	filter_opt opts;
+	opts.seed = (unsigned long)Rf_asInteger(SEED);
+	opts.nThreads = nThreads;
+	opts.resampleScheme = (resample_scheme)Rf_asInteger(RESAMPLE_SCHEME);
+	opts.essThreshold = Rf_asReal(ESS_THRESHOLD);
+	opts.output = (output_level)Rf_asInteger(OUTPUT_LEVEL);
+	opts.nQuantiles = opts.output >= OUTPUT_QUANTILES ? nQuantiles : 0;
+	opts.quantileProbs = REAL(QUANTILE_PROBS);
+	opts.smoother = (smoother_type)Rf_asInteger(SMOOTHER);
+	opts.lag = Rf_asInteger(LAG);
+	opts.nTrajectories = Rf_asInteger(NTRAJECTORIES);
+	opts.proposal = (proposal_type)Rf_asInteger(PROPOSAL);
+	opts.raoBlackwell = Rf_asLogical(RAO_BLACKWELL) == TRUE;
+	opts.bearingTol = Rf_asReal(BEARING_TOL);
+	opts.stats = Rf_asLogical(STATS) == TRUE;
+
+	/* No tracing unless R gives a file */
+	trace_opt traceOpts;
+	traceOpts.filename = CHAR(STRING_ELT(TRACE_FILE, 0));
+	traceOpts.every = Rf_asInteger(TRACE_EVERY);
+	traceOpts.nIndices = Rf_length(TRACE_INDICES);
+	traceOpts.indices = INTEGER(TRACE_INDICES);
+	opts.trace = traceOpts.filename[0] != '\0' ? &traceOpts : NULL;
+
+	/* Allocate the output in R, in its final shape */
+	const char *names[NAMED_OUT_MAX];
+	SEXP values[NAMED_OUT_MAX];
+	int nOut = 0;
+	filter_buffer buf = {NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL};
+
+	SEXP noiselessOut = PROTECT(Rf_allocMatrix(REALSXP, T, POSITION_DIM));
+	SEXP parallelOut = PROTECT(Rf_allocVector(LGLSXP, T));
+	Rf_setAttrib(noiselessOut, Rf_install("parallel"), parallelOut);
+	names[nOut] = "noiseless";
+	values[nOut++] = noiselessOut;
+
+	SEXP xMeanOut = PROTECT(Rf_allocMatrix(REALSXP, T, STATE_DIM));
+	buf.xMean = REAL(xMeanOut);
+	names[nOut] = "stateMean";
+	values[nOut++] = xMeanOut;
+
+	SEXP xCovOut = PROTECT(Rf_alloc3DArray(REALSXP, T, STATE_DIM,
+						STATE_DIM));
+	buf.xCov = REAL(xCovOut);
+	names[nOut] = "stateCov";
+	values[nOut++] = xCovOut;
+
+	SEXP essOut = PROTECT(Rf_allocVector(REALSXP, T));
+	buf.ess = REAL(essOut);
+	names[nOut] = "ess";
+	values[nOut++] = essOut;
+
+	SEXP logLikOut = PROTECT(Rf_allocVector(REALSXP, T));
+	buf.logLik = REAL(logLikOut);
+	names[nOut] = "logLik";
+	values[nOut++] = logLikOut;
+
+	if (opts.nQuantiles > 0) {
+		SEXP xQuantileOut = PROTECT(Rf_alloc3DArray(REALSXP, T,
+						opts.nQuantiles, POSITION_DIM));
+		buf.xQuantile = REAL(xQuantileOut);
+		names[nOut] = "positionQuantiles";
+		values[nOut++] = xQuantileOut;
+	}
+
+	if (opts.output >= OUTPUT_WEIGHTS) {
+		SEXP wOut = PROTECT(Rf_allocMatrix(REALSXP, T, nParticles));
+		buf.w = REAL(wOut);
+		names[nOut] = "weights";
+		values[nOut++] = wOut;
+	}
+
+	if (opts.smoother != SMOOTHER_NONE) {
+		SEXP xSmoothOut = PROTECT(Rf_allocMatrix(REALSXP, T,
+							STATE_DIM));
+		buf.xSmooth = REAL(xSmoothOut);
+		names[nOut] = "smoothedMean";
+		values[nOut++] = xSmoothOut;
+	}
+
+	/* Trajectory m in columns 4m, ..., 4m + 3: a T x 4 x M array */
+	if (opts.smoother == SMOOTHER_FFBSI) {
+		SEXP trajectoriesOut = PROTECT(Rf_alloc3DArray(REALSXP, T,
+					STATE_DIM, opts.nTrajectories));
+		buf.trajectories = REAL(trajectoriesOut);
+		names[nOut] = "trajectories";
+		values[nOut++] = trajectoriesOut;
+	}
+
+	/* Statistics: the timers, then the counters (see R/) */
+	SEXP statsOut = R_NilValue;
+	if (opts.stats) {
+		statsOut = PROTECT(Rf_allocVector(REALSXP,
+				FILTER_N_TIMERS + NSTATS_COUNTERS));
+		names[nOut] = "stats";
+		values[nOut++] = statsOut;
+	}
+
+	/* Run particle filter. What is made here sits behind an external
+	 * pointer with a finalizer before anything can fail, so an error (a
+	 * longjmp out of here) leaves it to the garbage collector. */
+	SEXP wsPtr = WORKSPACE;
+	if (WORKSPACE == R_NilValue) {
+		wsPtr = R_MakeExternalPtr(NULL, R_NilValue, R_NilValue);
+		PROTECT(wsPtr);
+		R_RegisterCFinalizerEx(wsPtr, Rworkspace_finalize, TRUE);
+		R_SetExternalPtrAddr(wsPtr, pf_workspace_create(nParticles, T,
+							nSensors, &opts));
+	} else {
+		PROTECT(wsPtr);
+	}
+
+	pf_workspace *ws = (pf_workspace *)R_ExternalPtrAddr(wsPtr);
+	if (ws == NULL)
+		fatal("the workspace is gone (e.g. after reloading the "
+					"session), make a new one");
+	if (ws->nParticles != nParticles || ws->nSensors != nSensors)
+		fatal("the workspace was made for another number of "
+					"particles or sensors");
+
+	pf_workspace_data(ws, T, y, sensorsIn, sensorsIn + nSensors);
+
+	SEXP resPtr = PROTECT(R_MakeExternalPtr(NULL, R_NilValue, R_NilValue));
+	R_RegisterCFinalizerEx(resPtr, result_finalize, TRUE);
+	R_SetExternalPtrAddr(resPtr, filter_result_wrap(T, nParticles, &opts,
+								&buf));
+
+	filter_result *res = (filter_result *)R_ExternalPtrAddr(resPtr);
+	pf_workspace_run(ws, &param, &opts, res);
+
+	/* Write the rest to R */
 	for (int i = 0; i < T; i++)
-		for (int j = 0; j < MEASUREMENT_DIM; j++)
-			RnoiselessOut[i + j * T] =
-					gsl_matrix_get(baseline, i, j);
+		for (int j = 0; j < POSITION_DIM; j++)
+			REAL(noiselessOut)[i + j * T] =
+					gsl_matrix_get(&ws->baseline, i, j);
 
-	for (int i = 0; i < T + 1; i++)
-		for (int j = 0; j < STATE_DIM; j++)
-			RxMeanOut[i + j * (T + 1)] =
-					gsl_matrix_get(xMeanOut, i, j);
+	for (int i = 0; i < T; i++)
+		LOGICAL(parallelOut)[i] =
+				gsl_vector_get(&ws->parallel, i) != 0;
 
-	for (int i = 0; i < T + 1; i++)
-		for (int j = 0; j < *NPARTICLES; j++)
-			RwOut[i + j * (T + 1)] = gsl_matrix_get(wOut, i, j);
+	if (res->stats != NULL) {
+		const filter_stats *st = res->stats;
+		double *statsDst = REAL(statsOut);
+		int j = 0;
 
-	for (int i = 0; i < T + 1; i++)
-		RessOut[i] = gsl_vector_get(essOut, i);
+		for (; j < FILTER_N_TIMERS; j++)
+			statsDst[j] = st->time[j];
+		statsDst[j++] = st->expUnderflow;
+		statsDst[j++] = st->logOverflow;
+		statsDst[j++] = st->logInvalid;
+		statsDst[j++] = st->vanished;
+		statsDst[j++] = st->resampled;
+		statsDst[j++] = st->steps;
+		statsDst[j++] = st->essMin;
+		statsDst[j++] = st->essMinStep;
+	}
 
-	/* Clean up */
-	gsl_matrix_free(xMeanOut);
-	gsl_matrix_free(wOut);
-	gsl_vector_free(essOut);
+	SEXP out = PROTECT(Rf_allocVector(VECSXP, nOut));
+	SEXP outNames = PROTECT(Rf_allocVector(STRSXP, nOut));
+	for (int j = 0; j < nOut; j++) {
+		SET_VECTOR_ELT(out, j, values[j]);
+		SET_STRING_ELT(outNames, j, Rf_mkChar(names[j]));
+	}
+	Rf_setAttrib(out, R_NamesSymbol, outNames);
 
-	importance_free(&param);
-	state_free(&param);
-	measurement_free(&param);
+	/* Clean up now rather than at the next garbage collection */
+	result_finalize(resPtr);
+	if (WORKSPACE == R_NilValue)
+		Rworkspace_finalize(wsPtr);
 
-	gsl_vector_free(location2);
-	gsl_vector_free(location1);
-	gsl_matrix_free(baseline);
-	free(y);
+	UNPROTECT(nOut + 5);
 
 	// Say goodbye?
+	return out;
 }
@@ -0,0 +1,219 @@
+/**
+ * @file Rfleet.c
+ * @authors Luis Damiano
+ * @version 0.1
+ * @details R wrapper for the multi-target filter.
+ *
+ * As in Rsweep.c, what the wrapper allocates sits behind an external pointer
+ * with a finalizer, which frees it if an error jumps back to R.
+ */
+
+#include "main.h"
+
+void Rfleet(double *Ry, int *RT, int *NTARGETS,
+		double *RSENSORS, int *NSENSORS,
+		double *DT,
+		double *MEASUREMENT_ERROR_1,
+		double *STATE_DIFFUSION_1, double *STATE_DIFFUSION_2,
+		double *STATEPRIOR_MU, double *STATEPRIOR_L,
+		double *IMPORTANCE_L,
+		int* NPARTICLES, int *SEED, int *NTHREADS,
+		int *RESAMPLE_SCHEME, double *ESS_THRESHOLD,
+		int *PROPOSAL, int *RAO_BLACKWELL, double *BEARING_TOL,
+		double *RxMeanOut, double *RxCovOut, double *RessOut,
+		double *RlogLikOut);
+
+/**
+ * Memory owned by the wrapper, zeroed (NULL) until allocated.
+ */
+typedef struct rfleet_memories {
+	int nTargets; /**< Size of the per-target arrays */
+	gsl_matrix **y, **baseline, *sensors;
+	model_param *param; /**< Models, with the factors of *_init */
+	const model_param **paramPtr;
+	int *offset;
+	fleet_result *res;
+} rfleet_memory;
+
+/**
+ * Free the memory behind an external pointer (finalizer).
+ *
+ * @param ptr The external pointer.
+ */
+static void rfleet_finalize(SEXP ptr) {
+	rfleet_memory *mem = (rfleet_memory *)R_ExternalPtrAddr(ptr);
+
+	if (mem == NULL)
+		return;
+
+	if (mem->res != NULL)
+		fleet_result_free(mem->res);
+
+	for (int t = 0; t < mem->nTargets; t++) {
+		if (mem->param != NULL) {
+			importance_free(mem->param + t);
+			state_free(mem->param + t);
+			measurement_free(mem->param + t);
+		}
+		if (mem->baseline != NULL)
+			gsl_matrix_free(mem->baseline[t]);
+		if (mem->y != NULL)
+			gsl_matrix_free(mem->y[t]);
+	}
+
+	gsl_matrix_free(mem->sensors);
+	free(mem->offset);
+	free(mem->paramPtr);
+	free(mem->param);
+	free(mem->baseline);
+	free(mem->y);
+	free(mem);
+	R_ClearExternalPtr(ptr);
+}
+
+void Rfleet(double *Ry, int *RT, int *NTARGETS,
+		double *RSENSORS, int *NSENSORS,
+		double *DT,
+		double *MEASUREMENT_ERROR_1,
+		double *STATE_DIFFUSION_1, double *STATE_DIFFUSION_2,
+		double *STATEPRIOR_MU, double *STATEPRIOR_L,
+		double *IMPORTANCE_L,
+		int* NPARTICLES, int *SEED, int *NTHREADS,
+		int *RESAMPLE_SCHEME, double *ESS_THRESHOLD,
+		int *PROPOSAL, int *RAO_BLACKWELL, double *BEARING_TOL,
+		double *RxMeanOut, double *RxCovOut, double *RessOut,
+		double *RlogLikOut) {
+
+	/* Read data from R. Series are stacked: target t takes rows
+	 * offset[t], ..., offset[t] + RT[t] - 1 of a sum(RT) x nSensors
+	 * matrix. Per-target parameters come in vectors of size nTargets, or
+	 * nTargets x 2 and nTargets x 4 matrices. */
+	int nTargets = *NTARGETS, nSensors = *NSENSORS, nRows = 0;
+	SEXP memPtr = PROTECT(R_MakeExternalPtr(NULL, R_NilValue, R_NilValue));
+	rfleet_memory *mem = (rfleet_memory *)calloc(1, sizeof(rfleet_memory));
+
+	R_RegisterCFinalizerEx(memPtr, rfleet_finalize, TRUE);
+	if (mem == NULL)
+		fatal("couldn't allocate the fleet inputs");
+	R_SetExternalPtrAddr(memPtr, mem);
+
+	/* Zeroed, so the finalizer can free targets not read yet */
+	gsl_matrix **y = mem->y = (gsl_matrix **)calloc(nTargets,
+							sizeof(gsl_matrix *));
+	gsl_matrix **baseline = mem->baseline = (gsl_matrix **)calloc(
+					nTargets, sizeof(gsl_matrix *));
+	model_param *param = mem->param = (model_param *)calloc(nTargets,
+							sizeof(model_param));
+	const model_param **paramPtr = mem->paramPtr = (const model_param **)
+			malloc(nTargets * sizeof(const model_param *));
+	int *offset = mem->offset = (int *)malloc(nTargets * sizeof(int));
+
+	mem->nTargets = nTargets;
+	if (y == NULL || baseline == NULL || param == NULL ||
+			paramPtr == NULL || offset == NULL)
+		fatal("couldn't allocate the fleet inputs");
+
+	gsl_matrix *sensors = mem->sensors = gsl_matrix_alloc(nSensors,
+								POSITION_DIM);
+
+	for (int s = 0; s < nSensors; s++)
+		for (int j = 0; j < POSITION_DIM; j++)
+			gsl_matrix_set(sensors, s, j,
+					RSENSORS[s + j * nSensors]);
+
+	for (int t = 0; t < nTargets; t++)
+		nRows += RT[t];
+
+	for (int t = 0, o = 0; t < nTargets; o += RT[t++]) {
+		int T = RT[t];
+		model_param *p = param + t;
+
+		/* RECALL: R is col-major order while GSL is row-major order. */
+		offset[t] = o;
+		y[t] = gsl_matrix_alloc(T, nSensors);
+		for (int i = 0; i < T; i++)
+			for (int j = 0; j < nSensors; j++)
+				gsl_matrix_set(y[t], i, j,
+						Ry[o + i + j * nRows]);
+
+		baseline[t] = gsl_matrix_alloc(T, POSITION_DIM);
+		noiseless(y[t], sensors, *NTHREADS, baseline[t], NULL);
+
+		/* Initialize model */
+		p->baseline = baseline[t];
+		p->dt = *DT;
+		p->sensors = sensors;
+		p->sr = MEASUREMENT_ERROR_1[t];
+
+		p->q1 = STATE_DIFFUSION_1[t];
+		p->q2 = STATE_DIFFUSION_2[t];
+
+		p->statepriorMuX = STATEPRIOR_MU[t];
+		p->statepriorMuY = STATEPRIOR_MU[t + nTargets];
+		p->statepriorL00 = STATEPRIOR_L[t];
+		p->statepriorL11 = STATEPRIOR_L[t + nTargets];
+		p->statepriorL22 = STATEPRIOR_L[t + 2 * nTargets];
+		p->statepriorL33 = STATEPRIOR_L[t + 3 * nTargets];
+
+		p->importanceL00 = IMPORTANCE_L[t];
+		p->importanceL11 = IMPORTANCE_L[t + nTargets];
+		p->importanceL22 = IMPORTANCE_L[t + 2 * nTargets];
+		p->importanceL33 = IMPORTANCE_L[t + 3 * nTargets];
+
+		importance_init(p);
+		state_init(p);
+		measurement_init(p);
+
+		paramPtr[t] = p;
+	}
+
+	/* Run particle filters */
+	filter_opt opts;
+	opts.seed = (unsigned long)*SEED;
+	opts.nThreads = *NTHREADS;
+	opts.resampleScheme = (resample_scheme)*RESAMPLE_SCHEME;
+	opts.essThreshold = *ESS_THRESHOLD;
+	opts.output = OUTPUT_SUMMARY;
+	opts.nQuantiles = 0;
+	opts.quantileProbs = NULL;
+	opts.smoother = SMOOTHER_NONE;
+	opts.lag = 0;
+	opts.nTrajectories = 0;
+	opts.proposal = (proposal_type)*PROPOSAL;
+	opts.raoBlackwell = *RAO_BLACKWELL;
+	opts.bearingTol = *BEARING_TOL;
+	opts.stats = 0;
+	opts.trace = NULL;
+
+	fleet_result *res = mem->res = fleet_result_alloc(nTargets, RT,
+							*NPARTICLES, &opts);
+	fleet(nTargets, (const gsl_matrix *const *)y, *NPARTICLES, paramPtr,
+							&opts, res);
+
+	/* Write results to R: the block of each target is a T x 4 (T x 16)
+	 * matrix in col-major order */
+	for (int t = 0; t < nTargets; t++) {
+		const filter_result *r = res->target[t];
+		int T = RT[t], o = offset[t];
+
+		for (int i = 0; i < T; i++)
+			for (int j = 0; j < STATE_DIM; j++)
+				RxMeanOut[STATE_DIM * o + i + j * T] =
+					gsl_matrix_get(r->xMean, i, j);
+
+		for (int i = 0; i < T; i++)
+			for (int j = 0; j < STATE_DIM * STATE_DIM; j++)
+				RxCovOut[STATE_DIM * STATE_DIM * o +
+							i + j * T] =
+					gsl_matrix_get(r->xCov, i, j);
+
+		for (int i = 0; i < T; i++) {
+			RessOut[o + i] = gsl_vector_get(r->ess, i);
+			RlogLikOut[o + i] = gsl_vector_get(r->logLik, i);
+		}
+	}
+
+	/* Clean up now rather than at the next garbage collection */
+	rfleet_finalize(memPtr);
+	UNPROTECT(1);
+}
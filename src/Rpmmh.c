@@ -0,0 +1,167 @@
+/**
+ * @file Rpmmh.c
+ * @authors Luis Damiano
+ * @version 0.1
+ * @details R wrapper for the PMMH sampler.
+ *
+ * As in Rsweep.c, what the wrapper allocates sits behind an external pointer
+ * with a finalizer, which frees it if an error jumps back to R.
+ */
+
+#include "main.h"
+
+void Rpmmh(double *Ry, int *RT,
+		double *RSENSORS, int *NSENSORS,
+		double *DT,
+		double *MEASUREMENT_ERROR_1,
+		double *STATE_DIFFUSION_1, double *STATE_DIFFUSION_2,
+		double *STATEPRIOR_MU_X, double *STATEPRIOR_MU_Y,
+		double *STATEPRIOR_L_00, double *STATEPRIOR_L_11,
+		double *STATEPRIOR_L_22, double *STATEPRIOR_L_33,
+		double *IMPORTANCE_L_00, double *IMPORTANCE_L_11,
+		double *IMPORTANCE_L_22, double *IMPORTANCE_L_33,
+		int* NPARTICLES, int *SEED, int *NTHREADS,
+		int *RESAMPLE_SCHEME, double *ESS_THRESHOLD,
+		int *PROPOSAL, int *RAO_BLACKWELL, double *BEARING_TOL,
+		int *NITER, double *STEP_SD, double *PRIOR_MEAN,
+		double *PRIOR_SD,
+		double *RchainOut, double *RlogLikOut, int *RacceptedOut);
+
+/**
+ * Memory owned by the wrapper, NULL until allocated.
+ */
+typedef struct rpmmh_memories {
+	gsl_matrix *y, *sensors, *baseline;
+	pmmh_result *res;
+} rpmmh_memory;
+
+/**
+ * Free the memory behind an external pointer (finalizer).
+ *
+ * @param ptr The external pointer.
+ */
+static void rpmmh_finalize(SEXP ptr) {
+	rpmmh_memory *mem = (rpmmh_memory *)R_ExternalPtrAddr(ptr);
+
+	if (mem == NULL)
+		return;
+
+	if (mem->res != NULL)
+		pmmh_result_free(mem->res);
+	gsl_matrix_free(mem->baseline);
+	gsl_matrix_free(mem->sensors);
+	gsl_matrix_free(mem->y);
+	free(mem);
+	R_ClearExternalPtr(ptr);
+}
+
+void Rpmmh(double *Ry, int *RT,
+		double *RSENSORS, int *NSENSORS,
+		double *DT,
+		double *MEASUREMENT_ERROR_1,
+		double *STATE_DIFFUSION_1, double *STATE_DIFFUSION_2,
+		double *STATEPRIOR_MU_X, double *STATEPRIOR_MU_Y,
+		double *STATEPRIOR_L_00, double *STATEPRIOR_L_11,
+		double *STATEPRIOR_L_22, double *STATEPRIOR_L_33,
+		double *IMPORTANCE_L_00, double *IMPORTANCE_L_11,
+		double *IMPORTANCE_L_22, double *IMPORTANCE_L_33,
+		int* NPARTICLES, int *SEED, int *NTHREADS,
+		int *RESAMPLE_SCHEME, double *ESS_THRESHOLD,
+		int *PROPOSAL, int *RAO_BLACKWELL, double *BEARING_TOL,
+		int *NITER, double *STEP_SD, double *PRIOR_MEAN,
+		double *PRIOR_SD,
+		double *RchainOut, double *RlogLikOut, int *RacceptedOut) {
+
+	SEXP memPtr = PROTECT(R_MakeExternalPtr(NULL, R_NilValue, R_NilValue));
+	rpmmh_memory *mem = (rpmmh_memory *)calloc(1, sizeof(rpmmh_memory));
+
+	R_RegisterCFinalizerEx(memPtr, rpmmh_finalize, TRUE);
+	if (mem == NULL)
+		fatal("couldn't allocate the PMMH inputs");
+	R_SetExternalPtrAddr(memPtr, mem);
+
+	/* Read data from R*/
+	gsl_matrix *y = mem->y = gsl_matrix_alloc(*RT, *NSENSORS);
+	gsl_matrix *sensors = mem->sensors = gsl_matrix_alloc(*NSENSORS,
+								POSITION_DIM);
+	int T = *RT, nIter = *NITER;
+
+	/* RECALL: R is col-major order while GSL is row-major order. */
+	for (int i = 0; i < T; i++)
+		for (int j = 0; j < *NSENSORS; j++)
+			gsl_matrix_set(y, i, j, Ry[i + j * T]);
+
+	for (int s = 0; s < *NSENSORS; s++)
+		for (int j = 0; j < POSITION_DIM; j++)
+			gsl_matrix_set(sensors, s, j,
+					RSENSORS[s + j * *NSENSORS]);
+
+	/* The baseline doesn't depend on the sampled parameters */
+	gsl_matrix *baseline = mem->baseline = gsl_matrix_alloc(T,
+								POSITION_DIM);
+	noiseless(y, sensors, *NTHREADS, baseline, NULL);
+
+	/* Initialize model (the sampler keeps its own factors) */
+	model_param param;
+	param.baseline = baseline;
+	param.dt = *DT;
+	param.sensors = sensors;
+	param.sr = *MEASUREMENT_ERROR_1;
+
+	param.q1 = *STATE_DIFFUSION_1;
+	param.q2 = *STATE_DIFFUSION_2;
+
+	param.statepriorMuX = *STATEPRIOR_MU_X;
+	param.statepriorMuY = *STATEPRIOR_MU_Y;
+	param.statepriorL00 = *STATEPRIOR_L_00;
+	param.statepriorL11 = *STATEPRIOR_L_11;
+	param.statepriorL22 = *STATEPRIOR_L_22;
+	param.statepriorL33 = *STATEPRIOR_L_33;
+
+	param.importanceL00 = *IMPORTANCE_L_00;
+	param.importanceL11 = *IMPORTANCE_L_11;
+	param.importanceL22 = *IMPORTANCE_L_22;
+	param.importanceL33 = *IMPORTANCE_L_33;
+
+	/* Run sampler */
+	filter_opt opts;
+	opts.seed = (unsigned long)*SEED;
+	opts.nThreads = *NTHREADS;
+	opts.resampleScheme = (resample_scheme)*RESAMPLE_SCHEME;
+	opts.essThreshold = *ESS_THRESHOLD;
+	opts.output = OUTPUT_SUMMARY;
+	opts.nQuantiles = 0;
+	opts.quantileProbs = NULL;
+	opts.smoother = SMOOTHER_NONE;
+	opts.lag = 0;
+	opts.nTrajectories = 0;
+	opts.proposal = (proposal_type)*PROPOSAL;
+	opts.raoBlackwell = *RAO_BLACKWELL;
+	opts.bearingTol = *BEARING_TOL;
+	opts.stats = 0;
+	opts.trace = NULL;
+
+	pmmh_opt mopts;
+	mopts.nIter = nIter;
+	for (int j = 0; j < PMMH_NPARAM; j++) {
+		mopts.stepSd[j] = STEP_SD[j];
+		mopts.priorMean[j] = PRIOR_MEAN[j];
+		mopts.priorSd[j] = PRIOR_SD[j];
+	}
+
+	pmmh_result *res = mem->res = pmmh_result_alloc(nIter);
+	pmmh(y, *NPARTICLES, &param, &opts, &mopts, res);
+
+	/* Write results to R */
+	for (int i = 0; i < nIter; i++) {
+		for (int j = 0; j < PMMH_NPARAM; j++)
+			RchainOut[i + j * nIter] =
+					gsl_matrix_get(res->chain, i, j);
+		RlogLikOut[i] = gsl_vector_get(res->logLik, i);
+		RacceptedOut[i] = (int)gsl_vector_get(res->accepted, i);
+	}
+
+	/* Clean up now rather than at the next garbage collection */
+	rpmmh_finalize(memPtr);
+	UNPROTECT(1);
+}
@@ -0,0 +1,172 @@
+/**
+ * @file Rsweep.c
+ * @authors Luis Damiano
+ * @version 0.1
+ * @details R wrapper for the parameter sweep.
+ *
+ * What the wrapper allocates sits behind an external pointer with a
+ * finalizer (as in Rfilter.c), so an error, which jumps back to R past the
+ * clean up, leaves it to the garbage collector.
+ */
+
+#include "main.h"
+
+void Rsweep(double *Ry, int *RT,
+		double *RSENSORS, int *NSENSORS,
+		double *DT,
+		double *STATEPRIOR_MU_X, double *STATEPRIOR_MU_Y,
+		double *STATEPRIOR_L_00, double *STATEPRIOR_L_11,
+		double *STATEPRIOR_L_22, double *STATEPRIOR_L_33,
+		double *RSETS, int *NSETS,
+		int* NPARTICLES, int *SEED, int *NTHREADS,
+		int *RESAMPLE_SCHEME, double *ESS_THRESHOLD,
+		int *PROPOSAL, int *RAO_BLACKWELL, double *BEARING_TOL,
+		int *COMMON_RANDOM, int *KEEP_MEAN,
+		double *RlogLikOut, double *RlogLikIncOut, double *RessOut,
+		double *RxMeanOut);
+
+/**
+ * Memory owned by the wrapper, NULL until allocated.
+ */
+typedef struct rsweep_memories {
+	gsl_matrix *y, *sensors, *sets, *baseline;
+	sweep_result *res;
+} rsweep_memory;
+
+/**
+ * Free the memory behind an external pointer (finalizer).
+ *
+ * @param ptr The external pointer.
+ */
+static void rsweep_finalize(SEXP ptr) {
+	rsweep_memory *mem = (rsweep_memory *)R_ExternalPtrAddr(ptr);
+
+	if (mem == NULL)
+		return;
+
+	if (mem->res != NULL)
+		sweep_result_free(mem->res);
+	gsl_matrix_free(mem->baseline);
+	gsl_matrix_free(mem->sets);
+	gsl_matrix_free(mem->sensors);
+	gsl_matrix_free(mem->y);
+	free(mem);
+	R_ClearExternalPtr(ptr);
+}
+
+void Rsweep(double *Ry, int *RT,
+		double *RSENSORS, int *NSENSORS,
+		double *DT,
+		double *STATEPRIOR_MU_X, double *STATEPRIOR_MU_Y,
+		double *STATEPRIOR_L_00, double *STATEPRIOR_L_11,
+		double *STATEPRIOR_L_22, double *STATEPRIOR_L_33,
+		double *RSETS, int *NSETS,
+		int* NPARTICLES, int *SEED, int *NTHREADS,
+		int *RESAMPLE_SCHEME, double *ESS_THRESHOLD,
+		int *PROPOSAL, int *RAO_BLACKWELL, double *BEARING_TOL,
+		int *COMMON_RANDOM, int *KEEP_MEAN,
+		double *RlogLikOut, double *RlogLikIncOut, double *RessOut,
+		double *RxMeanOut) {
+
+	SEXP memPtr = PROTECT(R_MakeExternalPtr(NULL, R_NilValue, R_NilValue));
+	rsweep_memory *mem = (rsweep_memory *)calloc(1, sizeof(rsweep_memory));
+
+	R_RegisterCFinalizerEx(memPtr, rsweep_finalize, TRUE);
+	if (mem == NULL)
+		fatal("couldn't allocate the sweep inputs");
+	R_SetExternalPtrAddr(memPtr, mem);
+
+	/* Read data from R*/
+	gsl_matrix *y = mem->y = gsl_matrix_alloc(*RT, *NSENSORS);
+	gsl_matrix *sensors = mem->sensors = gsl_matrix_alloc(*NSENSORS,
+								POSITION_DIM);
+	gsl_matrix *sets = mem->sets = gsl_matrix_alloc(*NSETS, SWEEP_NCOLS);
+	int T = *RT, nSets = *NSETS;
+
+	/* RECALL: R is col-major order while GSL is row-major order. */
+	for (int i = 0; i < T; i++)
+		for (int j = 0; j < *NSENSORS; j++)
+			gsl_matrix_set(y, i, j, Ry[i + j * T]);
+
+	for (int s = 0; s < *NSENSORS; s++)
+		for (int j = 0; j < POSITION_DIM; j++)
+			gsl_matrix_set(sensors, s, j,
+					RSENSORS[s + j * *NSENSORS]);
+
+	for (int s = 0; s < nSets; s++)
+		for (int j = 0; j < SWEEP_NCOLS; j++)
+			gsl_matrix_set(sets, s, j, RSETS[s + j * nSets]);
+
+	/* The baseline is shared by all parameter sets */
+	gsl_matrix *baseline = mem->baseline = gsl_matrix_alloc(T,
+								POSITION_DIM);
+	noiseless(y, sensors, *NTHREADS, baseline, NULL);
+
+	/* Initialize the shared part of the model. The swept parameters are
+	 * filled in by each worker. */
+	model_param param;
+	param.baseline = baseline;
+	param.dt = *DT;
+	param.sensors = sensors;
+
+	param.sr = gsl_matrix_get(sets, 0, SWEEP_SR);
+	param.q1 = gsl_matrix_get(sets, 0, SWEEP_Q1);
+	param.q2 = gsl_matrix_get(sets, 0, SWEEP_Q2);
+
+	param.statepriorMuX = *STATEPRIOR_MU_X;
+	param.statepriorMuY = *STATEPRIOR_MU_Y;
+	param.statepriorL00 = *STATEPRIOR_L_00;
+	param.statepriorL11 = *STATEPRIOR_L_11;
+	param.statepriorL22 = *STATEPRIOR_L_22;
+	param.statepriorL33 = *STATEPRIOR_L_33;
+
+	param.importanceL00 = gsl_matrix_get(sets, 0, SWEEP_IMPORTANCE_L00);
+	param.importanceL11 = gsl_matrix_get(sets, 0, SWEEP_IMPORTANCE_L11);
+	param.importanceL22 = gsl_matrix_get(sets, 0, SWEEP_IMPORTANCE_L22);
+	param.importanceL33 = gsl_matrix_get(sets, 0, SWEEP_IMPORTANCE_L33);
+
+	/* Run particle filters */
+	filter_opt opts;
+	opts.seed = (unsigned long)*SEED;
+	opts.nThreads = *NTHREADS;
+	opts.resampleScheme = (resample_scheme)*RESAMPLE_SCHEME;
+	opts.essThreshold = *ESS_THRESHOLD;
+	opts.output = OUTPUT_SUMMARY;
+	opts.nQuantiles = 0;
+	opts.quantileProbs = NULL;
+	opts.smoother = SMOOTHER_NONE;
+	opts.lag = 0;
+	opts.nTrajectories = 0;
+	opts.proposal = (proposal_type)*PROPOSAL;
+	opts.raoBlackwell = *RAO_BLACKWELL;
+	opts.bearingTol = *BEARING_TOL;
+	opts.stats = 0;
+	opts.trace = NULL;
+
+	sweep_result *res = mem->res = sweep_result_alloc(nSets, T,
+								*KEEP_MEAN);
+	sweep(y, sets, *NPARTICLES, &param, &opts, *COMMON_RANDOM, res);
+
+	/* Write results to R: T x nSets matrices, T x 4 x nSets array */
+	for (int s = 0; s < nSets; s++) {
+		RlogLikOut[s] = gsl_vector_get(res->logLik, s);
+
+		for (int k = 0; k < T; k++) {
+			RlogLikIncOut[k + s * T] =
+				gsl_vector_get(res->logLikInc, s * T + k);
+			RessOut[k + s * T] = gsl_vector_get(res->ess, s * T + k);
+		}
+	}
+
+	if (res->xMean != NULL)
+		for (int s = 0; s < nSets; s++)
+			for (int j = 0; j < STATE_DIM; j++)
+				for (int k = 0; k < T; k++)
+					RxMeanOut[k + j * T + s * T * STATE_DIM] =
+						gsl_matrix_get(res->xMean,
+								s * T + k, j);
+
+	/* Clean up now rather than at the next garbage collection */
+	rsweep_finalize(memPtr);
+	UNPROTECT(1);
+}
@@ -0,0 +1,70 @@
+/**
+ * @file Rworkspace.c
+ * @authors Luis Damiano
+ * @version 0.1
+ * @details R wrapper for the filter workspace.
+ *
+ * The workspace goes to R as an external pointer, freed by the garbage
+ * collector (or when R exits). Rfilter runs on it when given one.
+ */
+
+#include "main.h"
+
+SEXP Rworkspace(SEXP NPARTICLES, SEXP MAXT, SEXP NSENSORS, SEXP NTHREADS,
+		SEXP OUTPUT_LEVEL, SEXP NQUANTILES, SEXP STATS);
+void Rworkspace_finalize(SEXP ptr);
+
+/**
+ * Free the workspace behind an external pointer (finalizer). Rfilter also
+ * calls it to free the workspace it made for a single run.
+ *
+ * @param ptr The external pointer.
+ */
+void Rworkspace_finalize(SEXP ptr) {
+	pf_workspace *ws = (pf_workspace *)R_ExternalPtrAddr(ptr);
+
+	if (ws == NULL)
+		return;
+
+	pf_workspace_destroy(ws);
+	R_ClearExternalPtr(ptr);
+}
+
+/**
+ * Create a workspace for R.
+ *
+ * @return An external pointer to the workspace.
+ */
+SEXP Rworkspace(SEXP NPARTICLES, SEXP MAXT, SEXP NSENSORS, SEXP NTHREADS,
+		SEXP OUTPUT_LEVEL, SEXP NQUANTILES, SEXP STATS) {
+	filter_opt opts;
+	pf_workspace *ws;
+	SEXP ptr;
+
+	/* Only the settings that size the workspace matter here, the rest
+	 * comes with each run */
+	opts.seed = 0;
+	opts.nThreads = Rf_asInteger(NTHREADS);
+	opts.resampleScheme = RESAMPLE_NONE;
+	opts.essThreshold = 0;
+	opts.output = (output_level)Rf_asInteger(OUTPUT_LEVEL);
+	opts.nQuantiles = Rf_asInteger(NQUANTILES);
+	opts.quantileProbs = NULL;
+	opts.smoother = SMOOTHER_NONE;
+	opts.lag = 0;
+	opts.nTrajectories = 0;
+	opts.proposal = PROPOSAL_LEGACY;
+	opts.raoBlackwell = 0;
+	opts.bearingTol = 0;
+	opts.stats = Rf_asLogical(STATS) == TRUE;
+	opts.trace = NULL;
+
+	ws = pf_workspace_create(Rf_asInteger(NPARTICLES), Rf_asInteger(MAXT),
+			Rf_asInteger(NSENSORS), &opts);
+
+	ptr = PROTECT(R_MakeExternalPtr(ws, R_NilValue, R_NilValue));
+	R_RegisterCFinalizerEx(ptr, Rworkspace_finalize, TRUE);
+	UNPROTECT(1);
+
+	return ptr;
+}
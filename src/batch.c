@@ -0,0 +1,459 @@
+/**
+ * @file batch.c
+ * @authors Luis Damiano
+ * @version 0.1
+ * @details
+ *
+ * Kernels of the tracking model (see tracking.c for its setup). Each call
+ * processes a whole generation of particles stored as structure-of-arrays, so
+ * that the inner loops run over contiguous arrays with no per-particle
+ * function call. The loops are written to be auto-vectorized by the compiler
+ * (restrict-qualified pointers, no branches, no aliasing between inputs and
+ * outputs).
+ *
+ *   KERNEL			DENSITY
+ *   batch_stateprior_r		State prior
+ *   batch_importance_r		Importance density, around the noiseless
+ *				solution
+ *   batch_measurement_lpdf	Measurement model (the bearings)
+ *   batch_state_lpdf		State model around a fixed location (legacy
+ *				proposal, see proposal.c)
+ *   batch_importance_lpdf	Importance density around x_{k-1}
+ *   batch_transition_r		State model x_k = F x_{k-1} + q_k
+ *   batch_transition_lpdf	Its density
+ *
+ * The random generation kernels take standard normals drawn beforehand by
+ * `rng_normals` (see rng.c), so the draws for a particle depend only on the
+ * seed, the step and the particle index.
+ *
+ * They read the constants precomputed by the `*_init` functions (inverse
+ * factors, normalizing constants) and never touch the gsl_matrix factors.
+ *
+ * The expected bearings may come from a polynomial atan2 instead of libm's
+ * (see `batch_atan2`): a minimax odd polynomial for atan on [0, 1], plus
+ * octant reduction by selects, which the compiler can vectorize. The caller
+ * gives the largest error it accepts and gets the cheapest polynomial within
+ * it. With the default bearing noise (sd 0.1 rad) an error of 1e-7 rad moves
+ * the log-density by about 1e-6 per sensor at 1 sd.
+ */
+
+#include "main.h"
+
+/* Coefficients c_j of atan(a) ~ a * sum_j c_j a^(2j), 0 <= a <= 1, fitted by
+ * the Remez exchange for the least absolute error */
+static const double ATAN_C4[4] = {
+	0.99921381257268305, -0.32117496933244999, 0.14626446364667128,
+	-0.038986514195918018
+};
+static const double ATAN_C6[6] = {
+	0.99997721907992476, -0.33262282784094233, 0.19354037577413483,
+	-0.1164264811875555, 0.052647350618968893, -0.011719135407144133
+};
+static const double ATAN_C8[8] = {
+	0.99999933557833964, -0.33329860784330961, 0.19946565651288178,
+	-0.13908629549917964, 0.096421973279069095, -0.055912326767826884,
+	0.021862957874066249, -0.0040545672131833931
+};
+static const double ATAN_C10[10] = {
+	0.99999998056031658, -0.33333180376876204, 0.19996436812324844,
+	-0.14247222672629817, 0.10878009908311914, -0.082137616532617891,
+	0.055028100464937411, -0.028490775637216203, 0.0095673400755470865,
+	-0.0015093031387864006
+};
+
+/* Largest error of each polynomial (radians), rounded up, cheapest first */
+#define ATAN_N_KERNELS 4
+static const double ATAN_BOUND[ATAN_N_KERNELS] = {1e-4, 2e-6, 4e-8, 1e-9};
+
+/**
+ * Select the cheapest atan2 kernel within an error bound.
+ *
+ * @param tol The largest error accepted, in radians.
+ * @return The number of coefficients of the polynomial, or 0 for libm.
+ */
+static int atan_kernel(double tol) {
+	static const int N_COEFS[ATAN_N_KERNELS] = {4, 6, 8, 10};
+
+	for (int j = 0; j < ATAN_N_KERNELS; j++)
+		if (ATAN_BOUND[j] <= tol)
+			return N_COEFS[j];
+
+	return 0;
+}
+
+/**
+ * Polynomial atan2 with nc coefficients (a constant where it is inlined).
+ *
+ * The ratio of the smaller to the larger magnitude lies in [0, 1], then the
+ * octant and the quadrant are restored by selects. The result lies in
+ * [-pi, pi] and has the sign of y, as libm's (atan2(0, 0) is 0).
+ */
+static inline double poly_atan2(double y, double x, const double *c,
+		const int nc) {
+	const double ax = fabs(x), ay = fabs(y);
+	const double mx = ax > ay ? ax : ay, mn = ax > ay ? ay : ax;
+	const double a = mx > 0 ? mn / mx : 0, s = a * a;
+	double r = c[nc - 1];
+
+	for (int j = nc - 2; j >= 0; j--)
+		r = r * s + c[j];
+	r *= a;
+	r = ay > ax ? M_PI_2 - r : r;
+	r = x < 0 ? M_PI - r : r;
+
+	return copysign(r, y);
+}
+
+/**
+ * Compute mu + sd * z for a whole generation (diagonal covariance).
+ */
+static void diagonal_draw(const double *sd, double mu0, double mu1,
+		double mu2, double mu3, const double *z, particle_gen *xOut) {
+	const int n = xOut->n;
+	const double s0 = sd[0], s1 = sd[1], s2 = sd[2], s3 = sd[3];
+	const double *restrict z0 = z;
+	const double *restrict z1 = z + n;
+	const double *restrict z2 = z + 2 * n;
+	const double *restrict z3 = z + 3 * n;
+	double *restrict px = xOut->px;
+	double *restrict py = xOut->py;
+	double *restrict vx = xOut->vx;
+	double *restrict vy = xOut->vy;
+
+	for (int i = 0; i < n; i++) {
+		px[i] = mu0 + s0 * z0[i];
+		py[i] = mu1 + s1 * z1[i];
+		vx[i] = mu2 + s2 * z2[i];
+		vy[i] = mu3 + s3 * z3[i];
+	}
+}
+
+/** FIRST PART: MEMORY MANAGEMENT ------------------------------------------ */
+
+/**
+ * Allocate a generation of n particles.
+ *
+ * @param n The number of particles.
+ * @return Pointer to the new generation. Free with `particle_gen_free`.
+ */
+particle_gen *particle_gen_alloc(int n) {
+	particle_gen *x = (particle_gen *)malloc(sizeof(particle_gen));
+	if (x == NULL)
+		fatal("couldn't allocate particle generation");
+
+	/* One contiguous block, one array per state component */
+	double *block = (double *)malloc(STATE_DIM * n * sizeof(double));
+	if (block == NULL)
+		fatal("couldn't allocate particle generation");
+
+	x->n = n;
+	x->px = block;
+	x->py = block + n;
+	x->vx = block + 2 * n;
+	x->vy = block + 3 * n;
+
+	return x;
+}
+
+void particle_gen_free(particle_gen *x) {
+	free(x->px);
+	free(x);
+}
+
+/** SECOND PART: RANDOM GENERATION ----------------------------------------- */
+
+/**
+ * Draw a whole generation from the state prior.
+ *
+ * @param z Array of size STATE_DIM * n with standard normals (see
+ * `rng_normals`).
+ * @param param The model parameters.
+ * @param xOut Generation where the draws will be stored.
+ */
+void batch_stateprior_r(const double *z, const model_param *param,
+		particle_gen *xOut) {
+	diagonal_draw(param->statepriorSd,
+		gsl_vector_get(param->statepriorMu, 0),
+		gsl_vector_get(param->statepriorMu, 1),
+		gsl_vector_get(param->statepriorMu, 2),
+		gsl_vector_get(param->statepriorMu, 3),
+		z, xOut);
+}
+
+/**
+ * Draw a whole generation from the importance distribution.
+ *
+ * @param z Array of size STATE_DIM * n with standard normals (see
+ * `rng_normals`).
+ * @param baselinek Two-element array with the noiseless solution for the
+ * current time step (center of the importance distribution).
+ * @param param The model parameters.
+ * @param xOut Generation where the draws will be stored.
+ */
+void batch_importance_r(const double *z, const double *baselinek,
+		const model_param *param, particle_gen *xOut) {
+	diagonal_draw(param->importanceSd, baselinek[0], baselinek[1], 0, 0,
+								z, xOut);
+}
+
+/**
+ * Draw a whole generation from the state model given the previous one,
+ * x_k = F x_{k-1} + L z with L the Cholesky factor of the state covariance.
+ *
+ * @param z Array of size STATE_DIM * n with standard normals (see
+ * `rng_normals`).
+ * @param xkm1 The previous generation.
+ * @param param The model parameters.
+ * @param xOut Generation where the draws will be stored.
+ */
+void batch_transition_r(const double *z, const particle_gen *xkm1,
+		const model_param *param, particle_gen *xOut) {
+	const int n = xOut->n;
+	const double *l = param->stateLFactor;
+	const double dt = param->dt;
+	const double *restrict z0 = z;
+	const double *restrict z1 = z + n;
+	const double *restrict z2 = z + 2 * n;
+	const double *restrict z3 = z + 3 * n;
+	const double *restrict cx = xkm1->px;
+	const double *restrict cy = xkm1->py;
+	const double *restrict cvx = xkm1->vx;
+	const double *restrict cvy = xkm1->vy;
+	double *restrict px = xOut->px;
+	double *restrict py = xOut->py;
+	double *restrict vx = xOut->vx;
+	double *restrict vy = xOut->vy;
+
+	/* Lower triangle stored by rows */
+	for (int i = 0; i < n; i++) {
+		px[i] = cx[i] + dt * cvx[i] + l[0] * z0[i];
+		py[i] = cy[i] + dt * cvy[i] + l[1] * z0[i] + l[2] * z1[i];
+		vx[i] = cvx[i] + l[3] * z0[i] + l[4] * z1[i] + l[5] * z2[i];
+		vy[i] = cvy[i] + l[6] * z0[i] + l[7] * z1[i] + l[8] * z2[i] +
+								l[9] * z3[i];
+	}
+}
+
+/** THIRD PART: MEASUREMENT MODEL ------------------------------------------ */
+
+/**
+ * Add the squared scaled bearing errors of one sensor to out (one pass over
+ * the generation). nc is the number of coefficients of the atan2 kernel, 0
+ * for libm, and a constant at each call so the kernel is inlined.
+ */
+static inline void bearing_pass(const particle_gen *xk, double lx, double ly,
+		double ys, double is, const double *c, const int nc,
+		double *restrict out) {
+	const int n = xk->n;
+	const double *restrict px = xk->px;
+	const double *restrict py = xk->py;
+
+	for (int i = 0; i < n; i++) {
+		double u = ys - (nc == 0 ? atan2(py[i] - ly, px[i] - lx) :
+				poly_atan2(py[i] - ly, px[i] - lx, c, nc));
+		u = WRAP_ANGLE(u) * is;
+		out[i] += u * u;
+	}
+}
+
+/**
+ * Compute atan2(y, x) element-wise within an error bound.
+ *
+ * @param y Array of size n with the ordinates.
+ * @param x Array of size n with the abscissae.
+ * @param n The size of the arrays.
+ * @param tol The largest error accepted, in radians. Bounds under 1e-9
+ * (e.g. 0) give libm's atan2.
+ * @param out Array of size n where the angles will be stored.
+ * @return The largest error of the kernel used, 0 for libm.
+ */
+double batch_atan2(const double *y, const double *x, int n, double tol,
+		double *out) {
+	const int nc = atan_kernel(tol);
+	const double *restrict yy = y;
+	const double *restrict xx = x;
+	double *restrict r = out;
+
+	switch (nc) {
+	case 4:
+		for (int i = 0; i < n; i++)
+			r[i] = poly_atan2(yy[i], xx[i], ATAN_C4, 4);
+		return ATAN_BOUND[0];
+	case 6:
+		for (int i = 0; i < n; i++)
+			r[i] = poly_atan2(yy[i], xx[i], ATAN_C6, 6);
+		return ATAN_BOUND[1];
+	case 8:
+		for (int i = 0; i < n; i++)
+			r[i] = poly_atan2(yy[i], xx[i], ATAN_C8, 8);
+		return ATAN_BOUND[2];
+	case 10:
+		for (int i = 0; i < n; i++)
+			r[i] = poly_atan2(yy[i], xx[i], ATAN_C10, 10);
+		return ATAN_BOUND[3];
+	default:
+		for (int i = 0; i < n; i++)
+			r[i] = atan2(yy[i], xx[i]);
+		return 0;
+	}
+}
+
+/**
+ * Evaluate the measurement log-density for a whole generation.
+ *
+ * The expected bearings are computed on the fly and never stored: for each
+ * sensor, one pass over the particles adds the squared, wrapped and scaled
+ * bearing error to lpdf. The inner loop runs over contiguous particles, so
+ * the cost grows linearly with the number of sensors and there is no
+ * per-sensor call.
+ *
+ * The bearing error is wrapped after the subtraction, so an expected bearing
+ * off by less than `bearingTol` moves the wrapped error by as much, even
+ * across +-pi.
+ *
+ * @param yk Array of size nSensors with the current measurement.
+ * @param xk The current generation.
+ * @param param The model parameters.
+ * @param bearingTol The largest error accepted in the expected bearings, in
+ * radians, 0 for libm's atan2 (see `batch_atan2`).
+ * @param lpdf Array of size n where the log-densities will be stored.
+ */
+void batch_measurement_lpdf(const double *yk, const particle_gen *xk,
+		const model_param *param, double bearingTol, double *lpdf) {
+	const int n = xk->n, nc = atan_kernel(bearingTol);
+	const double c = param->measurementLogNorm;
+	double *restrict out = lpdf;
+
+	for (int i = 0; i < n; i++)
+		out[i] = 0;
+
+	for (int s = 0; s < param->nSensors; s++) {
+		const double lx = param->sensorX[s], ly = param->sensorY[s];
+		const double ys = yk[s], is = param->measurementInvSd[s];
+
+		switch (nc) {
+		case 4:
+			bearing_pass(xk, lx, ly, ys, is, ATAN_C4, 4, out);
+			break;
+		case 6:
+			bearing_pass(xk, lx, ly, ys, is, ATAN_C6, 6, out);
+			break;
+		case 8:
+			bearing_pass(xk, lx, ly, ys, is, ATAN_C8, 8, out);
+			break;
+		case 10:
+			bearing_pass(xk, lx, ly, ys, is, ATAN_C10, 10, out);
+			break;
+		default:
+			bearing_pass(xk, lx, ly, ys, is, NULL, 0, out);
+		}
+	}
+
+	for (int i = 0; i < n; i++)
+		out[i] = c - 0.5 * out[i];
+}
+
+/** FOURTH PART: STATE MODEL & IMPORTANCE DISTRIBUTION --------------------- */
+
+/**
+ * Evaluate the state model log-density for a whole generation.
+ *
+ * @param xk The current generation.
+ * @param mu Array of size STATE_DIM with the location of the state model.
+ * @param param The model parameters.
+ * @param lpdf Array of size n where the log-densities will be stored.
+ */
+void batch_state_lpdf(const particle_gen *xk, const double *mu,
+		const model_param *param, double *lpdf) {
+	const int n = xk->n;
+	const double *m = param->stateLInv;
+	const double c = param->stateLogNorm;
+	const double m0 = mu[0], m1 = mu[1], m2 = mu[2], m3 = mu[3];
+	const double *restrict px = xk->px;
+	const double *restrict py = xk->py;
+	const double *restrict vx = xk->vx;
+	const double *restrict vy = xk->vy;
+	double *restrict out = lpdf;
+
+	/* u = L^-1 (x - mu), lower triangle stored by rows */
+	for (int i = 0; i < n; i++) {
+		double d0 = px[i] - m0, d1 = py[i] - m1;
+		double d2 = vx[i] - m2, d3 = vy[i] - m3;
+		double u0 = m[0] * d0;
+		double u1 = m[1] * d0 + m[2] * d1;
+		double u2 = m[3] * d0 + m[4] * d1 + m[5] * d2;
+		double u3 = m[6] * d0 + m[7] * d1 + m[8] * d2 + m[9] * d3;
+		out[i] = c - 0.5 * (u0 * u0 + u1 * u1 + u2 * u2 + u3 * u3);
+	}
+}
+
+/**
+ * Evaluate the state model log-density for a whole generation given the
+ * previous one, centered at F x_{k-1} (see `batch_transition_r`).
+ *
+ * @param xk The current generation.
+ * @param xkm1 The previous generation.
+ * @param param The model parameters.
+ * @param lpdf Array of size n where the log-densities will be stored.
+ */
+void batch_transition_lpdf(const particle_gen *xk, const particle_gen *xkm1,
+		const model_param *param, double *lpdf) {
+	const int n = xk->n;
+	const double *m = param->stateLInv;
+	const double c = param->stateLogNorm;
+	const double dt = param->dt;
+	const double *restrict px = xk->px;
+	const double *restrict py = xk->py;
+	const double *restrict vx = xk->vx;
+	const double *restrict vy = xk->vy;
+	const double *restrict cx = xkm1->px;
+	const double *restrict cy = xkm1->py;
+	const double *restrict cvx = xkm1->vx;
+	const double *restrict cvy = xkm1->vy;
+	double *restrict out = lpdf;
+
+	/* u = L^-1 (x - F xkm1), lower triangle stored by rows */
+	for (int i = 0; i < n; i++) {
+		double d0 = px[i] - (cx[i] + dt * cvx[i]);
+		double d1 = py[i] - (cy[i] + dt * cvy[i]);
+		double d2 = vx[i] - cvx[i], d3 = vy[i] - cvy[i];
+		double u0 = m[0] * d0;
+		double u1 = m[1] * d0 + m[2] * d1;
+		double u2 = m[3] * d0 + m[4] * d1 + m[5] * d2;
+		double u3 = m[6] * d0 + m[7] * d1 + m[8] * d2 + m[9] * d3;
+		out[i] = c - 0.5 * (u0 * u0 + u1 * u1 + u2 * u2 + u3 * u3);
+	}
+}
+
+/**
+ * Evaluate the importance log-density for a whole generation.
+ *
+ * @param xk The current generation.
+ * @param xkm1 The previous generation.
+ * @param param The model parameters.
+ * @param lpdf Array of size n where the log-densities will be stored.
+ */
+void batch_importance_lpdf(const particle_gen *xk, const particle_gen *xkm1,
+		const model_param *param, double *lpdf) {
+	const int n = xk->n;
+	const double *s = param->importanceInvSd;
+	const double s0 = s[0], s1 = s[1], s2 = s[2], s3 = s[3];
+	const double c = param->importanceLogNorm;
+	const double *restrict px = xk->px;
+	const double *restrict py = xk->py;
+	const double *restrict vx = xk->vx;
+	const double *restrict vy = xk->vy;
+	const double *restrict cx = xkm1->px;
+	const double *restrict cy = xkm1->py;
+	const double *restrict cvx = xkm1->vx;
+	const double *restrict cvy = xkm1->vy;
+	double *restrict out = lpdf;
+
+	for (int i = 0; i < n; i++) {
+		double u0 = (px[i] - cx[i]) * s0;
+		double u1 = (py[i] - cy[i]) * s1;
+		double u2 = (vx[i] - cvx[i]) * s2;
+		double u3 = (vy[i] - cvy[i]) * s3;
+		out[i] = c - 0.5 * (u0 * u0 + u1 * u1 + u2 * u2 + u3 * u3);
+	}
+}
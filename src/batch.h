@@ -0,0 +1,46 @@
+/**
+ * @file batch.h
+ * @authors Luis Damiano
+ * @version 0.1
+ * @details
+ *
+ * Structure-of-arrays particle storage and batch kernels that process a whole
+ * generation of particles per call.
+ */
+
+#ifndef C_BATCH_H_
+#define C_BATCH_H_
+
+/**
+ * One generation of particles stored as structure-of-arrays. Each array holds
+ * one state component for all `n` particles.
+ */
+typedef struct particle_generation {
+	int n; /**< Number of particles */
+	double *px; /**< x-coordinate (longitude) */
+	double *py; /**< y-coordinate (latitude) */
+	double *vx; /**< x-velocity */
+	double *vy; /**< y-velocity */
+} particle_gen;
+
+particle_gen *particle_gen_alloc(int n);
+void particle_gen_free(particle_gen *x);
+
+void batch_stateprior_r(const double *z, const model_param *param,
+		particle_gen *xOut);
+void batch_importance_r(const double *z, const double *baselinek,
+		const model_param *param, particle_gen *xOut);
+void batch_transition_r(const double *z, const particle_gen *xkm1,
+		const model_param *param, particle_gen *xOut);
+double batch_atan2(const double *y, const double *x, int n, double tol,
+		double *out);
+void batch_measurement_lpdf(const double *yk, const particle_gen *xk,
+		const model_param *param, double bearingTol, double *lpdf);
+void batch_state_lpdf(const particle_gen *xk, const double *mu,
+		const model_param *param, double *lpdf);
+void batch_transition_lpdf(const particle_gen *xk, const particle_gen *xkm1,
+		const model_param *param, double *lpdf);
+void batch_importance_lpdf(const particle_gen *xk, const particle_gen *xkm1,
+		const model_param *param, double *lpdf);
+
+#endif /* C_BATCH_H_ */
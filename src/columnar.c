@@ -0,0 +1,247 @@
+/**
+ * @file columnar.c
+ * @authors Luis Damiano
+ * @version 0.1
+ * @details
+ *
+ * Binary columnar output. A file holds one table of doubles:
+ *
+ *   OFFSET	SIZE	CONTENT
+ *   0		8	magic "TPCOLUMN"
+ *   8		4	uint32 format version (1)
+ *   12		4	uint32 dtype (1 = float64)
+ *   16		8	uint64 number of rows
+ *   24		4	uint32 number of columns
+ *   28		...	for each column: uint32 name length, name bytes
+ *   ...	...	the data, column after column
+ *
+ * Every number is little-endian regardless of the host. Columns are written
+ * through a large buffer, so a T x N weight matrix takes a handful of
+ * `fwrite` calls instead of one `fprintf` per element. Files can be read
+ * back from memory (see load.c) or from R (see `read_columnar` in R/).
+ */
+
+#include "main.h"
+
+/**
+ * Store an unsigned integer as little-endian bytes.
+ *
+ * @param v The value.
+ * @param size The number of bytes (4 or 8).
+ * @param out Array of size `size` where the bytes will be stored.
+ */
+static void put_le(uint64_t v, int size, unsigned char *out) {
+	for (int b = 0; b < size; b++)
+		out[b] = (unsigned char)(v >> (8 * b));
+}
+
+/**
+ * Read a little-endian unsigned integer.
+ *
+ * @param in Array of size `size` with the bytes.
+ * @param size The number of bytes (4 or 8).
+ * @return The value.
+ */
+static uint64_t get_le(const unsigned char *in, int size) {
+	uint64_t v = 0;
+	for (int b = size - 1; b >= 0; b--)
+		v = (v << 8) | in[b];
+	return v;
+}
+
+/** FIRST PART: READING -------------------------------------------------- */
+
+/**
+ * Check whether a buffer holds a columnar file.
+ *
+ * @param buf The buffer.
+ * @param size The size of the buffer in bytes.
+ * @return 1 if the buffer starts with the magic, 0 otherwise.
+ */
+int columnar_is(const void *buf, size_t size) {
+	return size >= 8 && memcmp(buf, COLUMNAR_MAGIC, 8) == 0;
+}
+
+/**
+ * Parse the header of a columnar file held in memory.
+ *
+ * @param buf The buffer with the whole file.
+ * @param size The size of the buffer in bytes.
+ * @param out Pointer where the header will be stored. It points into buf,
+ * which must outlive it.
+ */
+void columnar_parse_header(const void *buf, size_t size, columnar_head *out) {
+	const unsigned char *p = (const unsigned char *)buf;
+	const unsigned char *end = p + size;
+
+	if (size < 28 || !columnar_is(buf, size))
+		fatal("not a columnar file");
+	if (get_le(p + 8, 4) != COLUMNAR_VERSION)
+		fatal("unsupported columnar file version");
+	if (get_le(p + 12, 4) != COLUMNAR_FLOAT64)
+		fatal("unsupported columnar data type");
+
+	out->nRows = get_le(p + 16, 8);
+	out->nCols = (uint32_t)get_le(p + 24, 4);
+	out->names = p + 28;
+
+	/* Skip the names */
+	p += 28;
+	for (uint32_t j = 0; j < out->nCols; j++) {
+		if (end - p < 4 || (uint64_t)(end - p - 4) < get_le(p, 4))
+			fatal("columnar file header is truncated");
+		p += 4 + get_le(p, 4);
+	}
+
+	out->data = p;
+	if ((uint64_t)(end - p) / 8 / (out->nCols ? out->nCols : 1) <
+								out->nRows)
+		fatal("columnar file data is truncated");
+}
+
+/**
+ * Find a column by name.
+ *
+ * @param head The header.
+ * @param name The column name.
+ * @return The column index, or -1 if there's no such column.
+ */
+int columnar_column(const columnar_head *head, const char *name) {
+	const unsigned char *p = head->names;
+	size_t len = strlen(name);
+
+	for (uint32_t j = 0; j < head->nCols; j++) {
+		uint64_t l = get_le(p, 4);
+		if (l == len && memcmp(p + 4, name, len) == 0)
+			return (int)j;
+		p += 4 + l;
+	}
+
+	return -1;
+}
+
+/**
+ * Read one element of a columnar file held in memory.
+ *
+ * @param head The header.
+ * @param i The row.
+ * @param j The column.
+ * @return The element.
+ */
+double columnar_get(const columnar_head *head, size_t i, size_t j) {
+	uint64_t bits = get_le(head->data + 8 * (j * head->nRows + i), 8);
+	double v;
+	memcpy(&v, &bits, 8);
+	return v;
+}
+
+/** SECOND PART: WRITING ------------------------------------------------- */
+
+/**
+ * Write bytes to a file or die trying.
+ */
+static void write_bytes(FILE *fp, const void *buf, size_t size) {
+	if (size > 0 && fwrite(buf, 1, size, fp) != size)
+		fatal("couldn't write to the output file");
+}
+
+/**
+ * Write a table of doubles in the columnar format.
+ *
+ * @param filename Path to the output file.
+ * @param x Pointer to the first element. Element (i, j) is at
+ * x[i * rowStride + j * colStride].
+ * @param nRows The number of rows.
+ * @param nCols The number of columns.
+ * @param rowStride The distance between rows.
+ * @param colStride The distance between columns.
+ * @param colNames Array of nCols column names, or NULL to name them V1, V2,
+ * and so on.
+ */
+static void write_table(const char *filename, const double *x, size_t nRows,
+		size_t nCols, size_t rowStride, size_t colStride,
+		const char *const *colNames) {
+	unsigned char head[28];
+	unsigned char *buf;
+	char nameTmp[32];
+	size_t used = 0;
+
+	FILE *fp = fopen(filename, "wb");
+	if (fp == NULL)
+		fatal("couldn't create the output file");
+
+	buf = (unsigned char *)malloc(COLUMNAR_BUFFER_SIZE);
+	if (buf == NULL)
+		fatal("couldn't allocate the output buffer");
+
+	/* Header */
+	memcpy(head, COLUMNAR_MAGIC, 8);
+	put_le(COLUMNAR_VERSION, 4, head + 8);
+	put_le(COLUMNAR_FLOAT64, 4, head + 12);
+	put_le(nRows, 8, head + 16);
+	put_le(nCols, 4, head + 24);
+	write_bytes(fp, head, sizeof(head));
+
+	for (size_t j = 0; j < nCols; j++) {
+		const char *name = nameTmp;
+		unsigned char len[4];
+
+		if (colNames != NULL)
+			name = colNames[j];
+		else
+			snprintf(nameTmp, sizeof(nameTmp), "V%zu", j + 1);
+
+		put_le(strlen(name), 4, len);
+		write_bytes(fp, len, 4);
+		write_bytes(fp, name, strlen(name));
+	}
+
+	/* Data, one column at a time */
+	for (size_t j = 0; j < nCols; j++) {
+		const double *col = x + j * colStride;
+
+		for (size_t i = 0; i < nRows; i++) {
+			uint64_t bits;
+			memcpy(&bits, col + i * rowStride, 8);
+			put_le(bits, 8, buf + used);
+			used += 8;
+
+			if (used == COLUMNAR_BUFFER_SIZE) {
+				write_bytes(fp, buf, used);
+				used = 0;
+			}
+		}
+	}
+
+	write_bytes(fp, buf, used);
+
+	free(buf);
+	if (fclose(fp) != 0)
+		fatal("couldn't close the output file");
+}
+
+/**
+ * Write a matrix in the columnar format.
+ *
+ * @param filename Path to the output file.
+ * @param x The matrix.
+ * @param colNames Array of x->size2 column names, or NULL.
+ */
+void columnar_write_matrix(const char *filename, const gsl_matrix *x,
+		const char *const *colNames) {
+	write_table(filename, x->data, x->size1, x->size2, x->tda, 1,
+								colNames);
+}
+
+/**
+ * Write a vector as a one-column table in the columnar format.
+ *
+ * @param filename Path to the output file.
+ * @param x The vector.
+ * @param colName The column name, or NULL.
+ */
+void columnar_write_vector(const char *filename, const gsl_vector *x,
+		const char *colName) {
+	write_table(filename, x->data, x->size, 1, x->stride, 0,
+				colName != NULL ? &colName : NULL);
+}
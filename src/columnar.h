@@ -0,0 +1,37 @@
+/**
+ * @file columnar.h
+ * @authors Luis Damiano
+ * @version 0.1
+ * @details
+ *
+ * Header for the binary columnar file format.
+ */
+
+#ifndef C_COLUMNAR_H_
+#define C_COLUMNAR_H_
+
+#define COLUMNAR_MAGIC "TPCOLUMN" /* 8 bytes, no terminator on disk */
+#define COLUMNAR_VERSION 1 /* uint32 */
+#define COLUMNAR_FLOAT64 1 /* uint32, dtype code */
+#define COLUMNAR_BUFFER_SIZE (1 << 20) /* bytes */
+
+/**
+ * A parsed header of a columnar file held in memory.
+ */
+typedef struct columnar_header {
+	uint64_t nRows; /**< Number of rows */
+	uint32_t nCols; /**< Number of columns */
+	const unsigned char *names; /**< First column name record */
+	const unsigned char *data; /**< First byte of the first column */
+} columnar_head;
+
+int columnar_is(const void *buf, size_t size);
+void columnar_parse_header(const void *buf, size_t size, columnar_head *out);
+int columnar_column(const columnar_head *head, const char *name);
+double columnar_get(const columnar_head *head, size_t i, size_t j);
+void columnar_write_matrix(const char *filename, const gsl_matrix *x,
+		const char *const *colNames);
+void columnar_write_vector(const char *filename, const gsl_vector *x,
+		const char *colName);
+
+#endif /* C_COLUMNAR_H_ */
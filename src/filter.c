@@ -5,219 +5,1268 @@
  * @details
  *
  * Sequential Importance Resampling, also known as Particle Filter.
+ *
+ * The filter is a stateful object: `pf_create` allocates everything (in one
+ * arena) and draws the initial generation, `pf_step` consumes one measurement
+ * and returns the estimates for that step, and `pf_destroy` releases the
+ * memory. `pf_step` doesn't allocate and its cost doesn't grow with the
+ * number of steps taken so far, so it can run on live data. `filter` runs a
+ * whole series through the same object, and `pf_reset` restarts it for
+ * another run without allocating (see workspace.c).
+ *
+ * Particles are processed in blocks of FILTER_BLOCK_SIZE. Each block owns its
+ * slice of the work arrays, and random numbers come from a counter-based
+ * generator keyed by (seed, step, particle) (see rng.c), so blocks can run on
+ * any thread in any order. Sums over particles are computed per block and
+ * then added up in block order. The result only depends on the seed, never on
+ * the number of threads.
+ *
+ * Notation and indexing rules
+ *
+ * NAME INDEXING   : DESCRIPTION			(EXAMPLE  )
+ * N i = 1, ..., N : number of particles (MC samples)	(N =  1000)
+ * T k = 1, ..., T : series length                      (T = 11027)
+ * m               : measurement model vector dimension (m =     2)
+ * y[k, m]         : measurement vector
+ * w[i, k]         : weights
+ * n               : system state vector dimension      (n =     4)
+ * x[i, k, n]      : state vector
+ * B b = 1, ..., B : particle blocks                    (B = N / 4096)
+ *
+ * NOTE: Each step only reads generations k - 1 and k, so we keep two
+ * N x n slices (xkm1Gen, xkGen) and swap them at the end of the step.
+ * Memory is O(N) regardless of T.
+ *
+ * With `opts->stats`, each phase times itself and counts numerical events
+ * into a filter_stats. Block phases write to a slot of their block, merged
+ * at the end of the step, so the counters need no locking. Otherwise the
+ * cost is one pointer test per phase and block.
  */
 
 #include "main.h"
 
+/* Per-block moments: squared weight sum, first and second moments of the
+ * state (lower triangle by rows) */
+#define FILTER_MOMENTS (1 + STATE_DIM + STATE_DIM * (STATE_DIM + 1) / 2)
+
+#define FILTER_ALIGN 64 /* size_t, bytes, alignment of the arena chunks */
+
+typedef struct weighted_value {
+	double x; /**< Value */
+	double w; /**< Weight */
+} weighted_value;
+
 /**
- * Compute the posterior mean of the latent matrix via a Particle Filter.
+ * View a contiguous range of particles of a generation.
  *
- * @param y The measurement vector.
- * @param nParticles The number of particles (MC samples) to use.
- * @param param The model parameters.
- * @param xMeanOut Pointer to the T x STATE_DIM matrix where the resulting
- * posterior mean matrix will be stored.
- * @param wOut Pointer to the T x nParticles matrix where the weights will be
+ * @param x The generation.
+ * @param i0 The index of the first particle in the range.
+ * @param n The number of particles in the range.
+ * @return A generation that shares memory with x.
+ */
+static particle_gen gen_view(const particle_gen *x, int i0, int n) {
+	particle_gen v;
+	v.n = n;
+	v.px = x->px + i0;
+	v.py = x->py + i0;
+	v.vx = x->vx + i0;
+	v.vy = x->vy + i0;
+	return v;
+}
+
+/**
+ * Locate a block of particles.
+ *
+ * @param pf The filter.
+ * @param b The block index.
+ * @param i0 Pointer where the index of the first particle will be stored.
+ * @return The number of particles in the block.
+ */
+static int block_range(const pf_state *pf, int b, int *i0) {
+	*i0 = b * FILTER_BLOCK_SIZE;
+	return pf->nParticles - *i0 < FILTER_BLOCK_SIZE ?
+				pf->nParticles - *i0 : FILTER_BLOCK_SIZE;
+}
+
+/**
+ * Read a monotonic clock.
+ *
+ * @return The time in seconds since an arbitrary origin.
+ */
+static double stats_clock(void) {
+#ifdef _WIN32
+	return (double)clock() / CLOCKS_PER_SEC;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+#endif
+}
+
+/**
+ * Time elapsed since a mark, moving the mark to now.
+ *
+ * @param t0 Pointer to the mark.
+ * @return The seconds since the mark.
+ */
+static double stats_lap(double *t0) {
+	double t1 = stats_clock(), dt = t1 - *t0;
+
+	*t0 = t1;
+	return dt;
+}
+
+/**
+ * Clear statistics.
+ *
+ * @param st The statistics.
+ */
+static void stats_clear(filter_stats *st) {
+	for (int j = 0; j < FILTER_N_TIMERS; j++)
+		st->time[j] = 0;
+	st->expUnderflow = 0;
+	st->logOverflow = 0;
+	st->logInvalid = 0;
+	st->vanished = 0;
+	st->resampled = 0;
+	st->steps = 0;
+	st->essMin = INFINITY;
+	st->essMinStep = 0;
+}
+
+/**
+ * Add the timers and event counters of a block to those of the run, and
+ * clear the block.
+ *
+ * @param to The statistics of the run.
+ * @param from The statistics of the block.
+ */
+static void stats_merge(filter_stats *to, filter_stats *from) {
+	for (int j = 0; j < FILTER_N_TIMERS; j++)
+		to->time[j] += from->time[j];
+	to->expUnderflow += from->expUnderflow;
+	to->logOverflow += from->logOverflow;
+	to->logInvalid += from->logInvalid;
+	stats_clear(from);
+}
+
+/**
+ * Write a trace record for each sampled particle of a block, right before
+ * its log-weight is updated.
+ *
+ * @param pf The filter.
+ * @param b The block.
+ * @param i0 The index of the first particle in the block.
+ * @param nb The number of particles in the block.
+ */
+static void trace_block(pf_state *pf, int b, int i0, int nb) {
+	const particle_gen *xk = pf->xkGen;
+	trace_record rec;
+	int j0, nt = trace_particles(pf->trace, i0, nb, &j0);
+
+	rec.tag = pf->traceTag;
+	rec.block = b;
+	rec.k = pf->k;
+
+	for (int j = 0; j < nt; j++) {
+		int i = j0 < 0 ? i0 + j : pf->trace->indices[j0 + j];
+
+		rec.i = i;
+		rec.x[0] = xk->px[i];
+		rec.x[1] = xk->py[i];
+		rec.x[2] = xk->vx[i];
+		rec.x[3] = xk->vy[i];
+		rec.lpdfMeasurement = pf->lpdf1s[i];
+		rec.lpdfState = pf->lpdf2s[i];
+		rec.lpdfImportance = pf->lpdf3s[i];
+		rec.lwPrev = pf->lw[i];
+		/* Same expression as the update in pf_phase_propagate */
+		rec.lw = pf->lw[i] + (pf->lpdf1s[i] + pf->lpdf2s[i] -
+							pf->lpdf3s[i]);
+		trace_write(pf->trace, pf->traceRing[b], &rec);
+	}
+}
+
+/**
+ * Order weighted values by value (for qsort).
+ */
+static int weighted_value_cmp(const void *a, const void *b) {
+	double xa = ((const weighted_value *)a)->x;
+	double xb = ((const weighted_value *)b)->x;
+	return (xa > xb) - (xa < xb);
+}
+
+/**
+ * Compute weighted quantiles: the smallest value whose cumulative weight
+ * reaches each probability.
+ *
+ * @param x The n values.
+ * @param w The n normalized weights.
+ * @param n The number of values.
+ * @param probs The probabilities, in increasing order.
+ * @param nProbs The number of probabilities.
+ * @param work Work array of size n.
+ * @param quantileOut Array of size nProbs where the quantiles will be
  * stored.
- * @param essOut Pointer to the T sized vector where the resulting effective
- * sample size will be stored.
- *
- * @note This function allocates several data structures. Don't forget to call
- * `filter_free`.
- */
-void filter(gsl_matrix *y, int nParticles, model_param *param,
-		gsl_matrix **xMeanOut, gsl_matrix **wOut,
-		gsl_vector **essOut) {
-	/* Notation and indexing rules
-	 *
-	 * NAME INDEXING   : DESCRIPTION			(EXAMPLE  )
-	 * N i = 1, ..., N : number of particles (MC samples)	(N =  1000)
-	 * T k = 1, ..., T : series length                      (T = 11027)
-	 * m               : measurement model vector dimension (m =     2)
-	 * y[k, m]         : measurement vector
-	 * w[i, k]         : weights
-	 * n               : system state vector dimension      (n =     4)
-	 * x[i, k, n]      : state vector
-	 */
+ */
+static void weighted_quantiles(const double *x, const double *w, int n,
+		const double *probs, int nProbs, weighted_value *work,
+		double *quantileOut) {
+	double c = 0;
+	int i = 0;
 
-	/* Allocate error handlers */
-	gsl_error_handler_t *oldHandler;
-	gsl_sf_result res;
-	int check;
+	for (int j = 0; j < n; j++) {
+		work[j].x = x[j];
+		work[j].w = w[j];
+	}
 
-	/* Initialize random number generator */
-	const gsl_rng_type *rType;
-	rType = gsl_rng_default;
+	qsort(work, n, sizeof(weighted_value), weighted_value_cmp);
 
-	gsl_rng *r;
-	gsl_rng_env_setup();
-	r = gsl_rng_alloc(rType);
+	for (int q = 0; q < nProbs; q++) {
+		/* NOTE: i < n - 1 guards against round-off in the cumulative
+		 * sum falling short of the last probability. */
+		while (i < n - 1 && c + work[i].w < probs[q])
+			c += work[i++].w;
+		quantileOut[q] = work[i].x;
+	}
+}
 
-	/* Preallocate and initialize filtering quantities */
-	int T = y->size1;
-	gsl_vector_view yk, xk, xkm1, wk;
-	gsl_matrix_view y1tok;
-	double xkMean1, xkMean2, xkMean3, xkMean4,
-		lpdf1, lpdf2, lpdf3, wkm1i, lwkm1i, wki, w0, wSum, wSumSq;
+/**
+ * Take the next chunk of an arena.
+ *
+ * @param arena The memory, or NULL to only measure.
+ * @param used Pointer to the number of bytes taken so far, updated.
+ * @param size The size of the chunk in bytes.
+ * @return Pointer to the chunk, aligned to FILTER_ALIGN if the arena is, or
+ * NULL when measuring.
+ */
+static void *arena_take(char *arena, size_t *used, size_t size) {
+	void *chunk = arena != NULL ? arena + *used : NULL;
+
+	*used += (size + FILTER_ALIGN - 1) / FILTER_ALIGN * FILTER_ALIGN;
+	return chunk;
+}
+
+/**
+ * Lay out every array of a filter in one arena.
+ *
+ * @param pf The filter, with the number of particles, the number of blocks
+ * and the settings already set.
+ * @param arena The memory, or NULL to only measure it.
+ * @return The size of the arena in bytes.
+ */
+static size_t pf_layout(pf_state *pf, char *arena) {
+	const int n = pf->nParticles;
+	const int quantiles = pf->opts.output >= OUTPUT_QUANTILES &&
+						pf->opts.nQuantiles > 0;
+	size_t used = 0;
+	double *gen;
+
+	/* Previous and current generations, one array per component */
+	pf->xkm1Gen = (particle_gen *)arena_take(arena, &used,
+						sizeof(particle_gen));
+	pf->xkGen = (particle_gen *)arena_take(arena, &used,
+						sizeof(particle_gen));
+	gen = (double *)arena_take(arena, &used,
+					2 * STATE_DIM * n * sizeof(double));
+
+	/* Unnormalized log-weights (carried over steps) and linear weights
+	 * (recomputed every step from the log-weights) */
+	pf->lw = (double *)arena_take(arena, &used, n * sizeof(double));
+	pf->w = (double *)arena_take(arena, &used, n * sizeof(double));
+
+	/* Per-step work arrays for the batch kernels */
+	pf->z = (double *)arena_take(arena, &used,
+					STATE_DIM * n * sizeof(double));
+	pf->lpdf1s = (double *)arena_take(arena, &used, n * sizeof(double));
+	pf->lpdf2s = (double *)arena_take(arena, &used, n * sizeof(double));
+	pf->lpdf3s = (double *)arena_take(arena, &used, n * sizeof(double));
+
+	/* Resampling buffers */
+	pf->ancestor = (int *)arena_take(arena, &used, n * sizeof(int));
+	pf->resampleWork = (double *)arena_take(arena, &used,
+				RESAMPLE_WORK_SIZE(n) * sizeof(double));
+
+	/* Per-block partials: log-weight max, weight sum, moments */
+	pf->blockSum = (double *)arena_take(arena, &used, pf->nBlocks *
+					(2 + FILTER_MOMENTS) * sizeof(double));
+
+	/* Quantiles are only kept from OUTPUT_QUANTILES up */
+	pf->xQuantile = NULL;
+	pf->sortWork = NULL;
+	if (quantiles) {
+		pf->xQuantile = (double *)arena_take(arena, &used,
+				2 * pf->opts.nQuantiles * sizeof(double));
+		pf->sortWork = arena_take(arena, &used,
+						n * sizeof(weighted_value));
+	}
+
+	/* Statistics are only collected on request */
+	pf->stats = NULL;
+	pf->blockStats = NULL;
+	if (pf->opts.stats) {
+		pf->stats = (filter_stats *)arena_take(arena, &used,
+						sizeof(filter_stats));
+		pf->blockStats = (filter_stats *)arena_take(arena, &used,
+					pf->nBlocks * sizeof(filter_stats));
+	}
+
+	if (arena != NULL)
+		for (int g = 0; g < 2; g++) {
+			particle_gen *x = g == 0 ? pf->xkm1Gen : pf->xkGen;
+			double *block = gen + g * STATE_DIM * n;
+
+			x->n = n;
+			x->px = block;
+			x->py = block + n;
+			x->vx = block + 2 * n;
+			x->vy = block + 3 * n;
+		}
+
+	return used;
+}
+
+/**
+ * Create a particle filter and draw the initial generation (k = 0).
+ *
+ * Every array lives in a single arena, allocated here once, so creating and
+ * destroying a filter costs two calls to malloc whatever its settings.
+ *
+ * @param nParticles The number of particles (MC samples) to use.
+ * @param param The model parameters. Read-only during the run, and must
+ * outlive the filter. If NULL, nothing is drawn: call `pf_reset` before the
+ * first step.
+ * @param opts The filter settings (seed, number of threads, resampling).
+ * @return Pointer to the new filter. Free with `pf_destroy`.
+ */
+pf_state *pf_create(int nParticles, const model_param *param,
+		const filter_opt *opts) {
+	pf_state *pf;
+
+	if (nParticles < 1)
+		fatal("the filter needs at least one particle");
 
-	gsl_matrix **x = (gsl_matrix **)malloc(nParticles *
-							sizeof(gsl_matrix *));
-	for (int i = 0; i < nParticles; i++)
-		x[i] = gsl_matrix_alloc(T + 1, STATE_DIM);
+	pf = (pf_state *)malloc(sizeof(pf_state));
+	if (pf == NULL)
+		fatal("couldn't allocate the particle filter");
+
+	pf->nParticles = nParticles;
+	pf->nBlocks = (nParticles + FILTER_BLOCK_SIZE - 1) / FILTER_BLOCK_SIZE;
+	pf->nThreads = opts->nThreads > 0 ? opts->nThreads : 1;
+	pf->opts = *opts;
+
+	/* Measure, then lay out over memory aligned by hand */
+	pf->arena = malloc(pf_layout(pf, NULL) + FILTER_ALIGN);
+	if (pf->arena == NULL)
+		fatal("couldn't allocate filter work arrays");
+	pf_layout(pf, (char *)(((uintptr_t)pf->arena + FILTER_ALIGN - 1) &
+					~(uintptr_t)(FILTER_ALIGN - 1)));
+
+	/* Tracing is set up by `pf_trace` */
+	pf->trace = NULL;
+	pf->traceRing = NULL;
+	pf->traceTag = 0;
+
+	pf->param = NULL;
+	if (param != NULL)
+		pf_reset(pf, param, opts->seed);
+
+	return pf;
+}
+
+/**
+ * Restart a filter from k = 0, reusing its memory.
+ *
+ * @param pf The filter.
+ * @param param The model parameters, may differ from those the filter was
+ * created with. Read-only during the run, and must outlive the filter.
+ * @param seed The seed for the new run.
+ */
+void pf_reset(pf_state *pf, const model_param *param, unsigned long seed) {
+	const int nParticles = pf->nParticles;
+
+	if (pf->opts.raoBlackwell && pf->opts.proposal == PROPOSAL_LEGACY)
+		fatal("the Rao-Blackwellized filter needs the bootstrap, "
+				"baseline or optimal proposal");
+	if (pf->opts.raoBlackwell && pf->opts.smoother == SMOOTHER_FFBSI)
+		fatal("the Rao-Blackwellized filter doesn't support FFBSi");
+
+	pf->param = param;
+	pf->opts.seed = seed;
+	pf->k = 0;
+	pf->resampled = 0;
+	pf->nVanished = 0;
+
+	if (pf->stats != NULL) {
+		stats_clear(pf->stats);
+		for (int b = 0; b < pf->nBlocks; b++)
+			stats_clear(pf->blockStats + b);
+	}
+
+	/* Until the bearings first intersect, fall back to the prior mean */
+	pf->baseline[0] = param->statepriorMuX;
+	pf->baseline[1] = param->statepriorMuY;
 
 	/* k = 0 (previous-to-first step) */
 	/* Draw initial state -- Sarkka Eq. 7.28 */
-	w0 = 1.0 / nParticles;
-	wk = gsl_matrix_row(*wOut, 0);
-	gsl_vector_set_all(&wk.vector, w0);
+	pf->lw0 = -log(nParticles);
 	for (int i = 0; i < nParticles; i++) {
-		xk = gsl_matrix_row(x[i], 0);
-		IOUT(0); IOUT(i)
-		stateprior_r(r, param, &xk.vector);
-		EOUT()
+		pf->lw[i] = pf->lw0;
+		pf->w[i] = exp(pf->lw0);
 	}
 
-	/* k = 1, 2, ..., T (each time step) */
-	for (int k = 1; k < T + 1; k++) {
-		yk = gsl_matrix_row(y, k - 1); /* Note: k - 1! */
-		y1tok = gsl_matrix_submatrix(y, 0, 0, k - 1, y->size2);
-
-		for (int i = 0; i < nParticles; i++) {
-			IOUT(k);IOUT(i)
-
-			/* Draw candidates -- Sarkka Step 1 Eq. 7.29 */
-			xk = gsl_matrix_row(x[i], k);
-			xkm1 = gsl_matrix_row(x[i], k - 1);
-
-			importance_r(r, &xkm1.vector, &y1tok.matrix, param,
-								&xk.vector);
-
-			//			state_update(&xk.vector, &xkm1.vector, param);
-			measurement_update(&yk.vector, &xk.vector, param);
-
-			/* Update weights -- Sarkka Step 2 Eq. 7.30 */
-			/* (1) Precompute quantities */
-			measurement_lpdf(&yk.vector, &xk.vector, param, &lpdf1);
-			state_lpdf(&xk.vector, &xkm1.vector, param, &lpdf2);
-			importance_lpdf(&xk.vector, &xkm1.vector,
-						&y1tok.matrix, param, &lpdf3);
-			wkm1i = gsl_matrix_get(*wOut, k - 1, i);
-			wki = 0;
-
-			/* (2) Calculate new weight */
-			oldHandler = gsl_set_error_handler_off();
-
-			/**
-			 * TODO Design a unified strategy to deal with
-			 * numerical errors.
-			 *
-			 * Small weights produce numerical errors with both log
-			 * (here) and exp (below). Currently, we deal with
-			 * them independently sometimes fixing it twice.
-			 */
-			check = gsl_sf_log_e(wkm1i, &res);
-			if (check) { /* numerical error */
-				 /* Assume underflow & replace with the
-				  * smallest representation of log(x) */
-				lwkm1i = GSL_LOG_DBL_MIN;
-#ifdef DEBUG
-				printf("Numerical error gsl_sf_log_e: k % 5i, t % 5i, code % 5i, wkm1i %8.2f, lpdf1 %8.2f, lpdf2 %8.2f, lpdf3 %8.2f\n", k, i, check, wkm1i, lpdf1, lpdf2, lpdf3);
-#endif
-			} else {
-				lwkm1i = res.val;
-			}
+#pragma omp parallel for num_threads(pf->nThreads) schedule(static)
+	for (int b = 0; b < pf->nBlocks; b++) {
+		int i0, nb = block_range(pf, b, &i0);
+		particle_gen xb = gen_view(pf->xkm1Gen, i0, nb);
 
-			check = gsl_sf_exp_e(lwkm1i + lpdf1 + lpdf2 - lpdf3,
-									&res);
-			if (check) { /* numerical error */
-				/**
-				 * TODO Implement a better strategy to deal
-				 * with under/overflows.
-				 */
-				if (check == GSL_EUNDRFLW) {
-					/* Replace with the representation of
-					 * the smallest positive number. */
-					wki = GSL_DBL_MIN;
-				} else { /* gsl_sf_exp_e only returns
-						underflows or overflows */
-					wki = GSL_DBL_MAX;
-				}
-#ifdef DEBUG
-				printf("Numerical error gsl_sf_exp_e: k % 5i, t % 5i, code % 5i, wkm1i %8.2f, lpdf1 %8.2f, lpdf2 %8.2f, lpdf3 %8.2f\n", k, i, check, wkm1i, lpdf1, lpdf2, lpdf3);
-#endif
-			} else {
-				wki = res.val;
+		double *zb = pf->z + STATE_DIM * i0;
+
+		rng_normals(seed, RNG_PROPOSAL, 0, i0, nb, zb);
+		batch_stateprior_r(zb, param, &xb);
+
+		/* The velocity is the mean of its Kalman filter instead */
+		if (pf->opts.raoBlackwell) {
+			const gsl_vector *mu = param->statepriorMu;
+			const double mux = gsl_vector_get(mu, 2);
+			const double muy = gsl_vector_get(mu, 3);
+
+			for (int i = 0; i < nb; i++) {
+				xb.vx[i] = mux;
+				xb.vy[i] = muy;
 			}
+		}
+	}
+
+	if (pf->opts.raoBlackwell)
+		rbpf_init(param, &pf->velocity);
+}
+
+/* A step is split into phases that either work on one block of particles
+ * (and can run in parallel over blocks) or on the whole filter (serial,
+ * cheap). `pf_step` runs them for one filter; `fleet_step` (see fleet.c)
+ * runs each block phase over the blocks of many filters at once. */
+
+/**
+ * Start a step: advance k, find the noiseless solution.
+ *
+ * @param pf The filter.
+ * @param yk Array of size nSensors with the measurement at this step.
+ */
+void pf_phase_begin(pf_state *pf, const double *yk) {
+	const model_param *param = pf->param;
+	int k = ++pf->k;
+	double t0 = pf->stats != NULL ? stats_clock() : 0;
+
+	/* Noiseless solution for this step, the center of the importance pdf.
+	 * The first one is also the center of the state model. It's read from
+	 * param when computed beforehand (see `noiseless`), otherwise solved
+	 * here. Near-parallel bearings keep the previous one. */
+	if (param->baseline != NULL && k <= (int)param->baseline->size1) {
+		pf->baseline[0] = gsl_matrix_get(param->baseline, k - 1, 0);
+		pf->baseline[1] = gsl_matrix_get(param->baseline, k - 1, 1);
+	} else {
+		noiseless_step(yk, param, pf->baseline);
+	}
+	if (k == 1) {
+		pf->stateMu[0] = pf->baseline[0];
+		pf->stateMu[1] = pf->baseline[1];
+		pf->stateMu[2] = 0;
+		pf->stateMu[3] = 0;
+	}
+	if (pf->opts.raoBlackwell)
+		rbpf_advance(param, &pf->velocity);
+
+	if (pf->stats != NULL)
+		pf->stats->time[TIMER_PROPOSAL] += stats_lap(&t0);
+}
+
+/**
+ * Draw and weight the particles of one block.
+ *
+ * @param pf The filter.
+ * @param yk Array of size nSensors with the measurement at this step.
+ * @param b The block.
+ */
+void pf_phase_propagate(pf_state *pf, const double *yk, int b) {
+	const model_param *param = pf->param;
+	const int k = pf->k;
+	int i0, nb = block_range(pf, b, &i0);
+	particle_gen xkb = gen_view(pf->xkGen, i0, nb);
+	particle_gen xkm1b = gen_view(pf->xkm1Gen, i0, nb);
+	double *lw = pf->lw;
+	double *lpdf1s = pf->lpdf1s, *lpdf2s = pf->lpdf2s;
+	double *lpdf3s = pf->lpdf3s;
+	double *zb = pf->z + STATE_DIM * i0;
+	double bMax = -INFINITY;
+	filter_stats *st = pf->stats != NULL ? pf->blockStats + b : NULL;
+	double t0 = st != NULL ? stats_clock() : 0;
+
+	/* Draw candidates -- Sarkka Step 1 Eq. 7.29 */
+	rng_normals(pf->opts.seed, RNG_PROPOSAL, k, i0, nb, zb);
+	if (pf->opts.raoBlackwell)
+		rbpf_r(pf->opts.proposal, &pf->velocity, zb, yk, pf->baseline,
+			&xkm1b, param, &xkb, lpdf2s + i0, lpdf3s + i0);
+	else
+		proposal_r(pf->opts.proposal, zb, yk, pf->baseline, &xkm1b,
+						param, &xkb, lpdf3s + i0);
+
+	if (st != NULL)
+		st->time[TIMER_PROPOSAL] += stats_lap(&t0);
+
+	/* Update weights -- Sarkka Step 2 Eq. 7.30 */
+	/* (1) Precompute quantities (the proposal density came with the
+	 * draws, and so did the state density when Rao-Blackwellized) */
+	batch_measurement_lpdf(yk, &xkb, param, pf->opts.bearingTol,
+							lpdf1s + i0);
+	if (pf->opts.proposal == PROPOSAL_LEGACY)
+		batch_state_lpdf(&xkb, pf->stateMu, param, lpdf2s + i0);
+	else if (!pf->opts.raoBlackwell)
+		batch_transition_lpdf(&xkb, &xkm1b, param, lpdf2s + i0);
+
+	/* Trace the sampled particles, before their log-weight changes */
+	if (pf->traceRing != NULL && pf->traceRing[b] != NULL &&
+			trace_step(pf->trace, k))
+		trace_block(pf, b, i0, nb);
 
-			gsl_set_error_handler(oldHandler);
-
-			/* (3) Update weight matrix */
-			gsl_matrix_set(*wOut, k, i, wki);
-
-			DOUT(lpdf1);DOUT(lpdf2);DOUT(lpdf3);
-			DOUT(wkm1i);DOUT(lwkm1i);
-			DOUT(lwkm1i + lpdf1 + lpdf2 - lpdf3);
-			DOUT(wki);
-			IOUT(check);
-			EOUT()
-		} /* for each particle i */
-
-		/* Normalize weights -- Sarkka Step 2 Eq. 7.30 */
-		/* NOTE: We keep k (time step) fixed and normalize
-		 * over i (particles).
-		 */
-		wk = gsl_matrix_row(*wOut, k);
-
-		wSum = 0;
-		for (int i = 0; i < nParticles; i++)
-			wSum += gsl_vector_get(&wk.vector, i);
-
-		gsl_vector_scale(&wk.vector, 1 / wSum);
-
-		/* Adaptive resampling -- Sarkka Step 3 */
-		/* (1) Compute effective sample size Sarkka Eq. 7.27 */
-
-		/* TODO Implement weight squaring as a dot product
-		 * for increased efficiency.
-		 * Reference: https://www.gnu.org/software/gsl/manual/html_node/Level-1-GSL-BLAS-Interface.html
-		 */
-		wSumSq = 0;
-		for (int i = 0; i < nParticles; i++)
-			wSumSq += gsl_matrix_get(*wOut, k, i) *
-					gsl_matrix_get(*wOut, k, i);
-
-		gsl_vector_set(*essOut, k, 1 / wSumSq);
-
-		/* (2) Resample */
-		/* TODO Implement adaptive resampling */
-
-		/* Compute posterior mean -- Sarkka Eq. 7.32 */
-		/* TODO Implement posterior mean approximation as a matrix
-		 * operation for increased efficiency. */
-		xkMean1 = 0; xkMean2 = 0; xkMean3 = 0; xkMean4 = 0;
-		for (int i = 0; i < nParticles; i++) {
-			wki = gsl_matrix_get(*wOut, k, i);
-			xk = gsl_matrix_row(x[i], k);
-			xkMean1 += gsl_vector_get(&xk.vector, 0) * wki;
-			xkMean2 += gsl_vector_get(&xk.vector, 1) * wki;
-			xkMean3 += gsl_vector_get(&xk.vector, 2) * wki;
-			xkMean4 += gsl_vector_get(&xk.vector, 3) * wki;
+	/* (2) Calculate new log-weight */
+	/* NOTE: A log-weight of +Inf (the proposal density underflowed) or
+	 * NaN can't be weighed against the others: the particle is invalid
+	 * and gets zero weight, as if its likelihood were zero. */
+	for (int i = i0; i < i0 + nb; i++) {
+		lw[i] += lpdf1s[i] + lpdf2s[i] - lpdf3s[i];
+		if (!(lw[i] < INFINITY))
+			lw[i] = -INFINITY;
+		if (lw[i] > bMax)
+			bMax = lw[i];
+	} /* for each particle i */
+
+	pf->blockSum[b] = bMax;
+
+	if (st != NULL) {
+		for (int i = i0; i < i0 + nb; i++) {
+			double lwi = lpdf1s[i] + lpdf2s[i] - lpdf3s[i];
+
+			if (lwi == INFINITY)
+				st->logOverflow++;
+			else if (lw[i] == -INFINITY)
+				st->logInvalid++;
 		}
+		st->time[TIMER_WEIGHTING] += stats_lap(&t0);
+	}
+}
+
+/**
+ * Find the largest log-weight over all blocks.
+ *
+ * @param pf The filter.
+ */
+void pf_phase_max(pf_state *pf) {
+	const double *blockMax = pf->blockSum;
+	double lwMax = -INFINITY;
+	double t0 = pf->stats != NULL ? stats_clock() : 0;
+
+	/* Normalize weights -- Sarkka Step 2 Eq. 7.30 */
+	/* NOTE: We keep k (time step) fixed and normalize over i
+	 * (particles) with a log-sum-exp shifted by the largest
+	 * log-weight, so the largest weight is exp(0) = 1 before
+	 * normalization and nothing overflows. Weights that underflow
+	 * are exactly zero relative to the largest one.
+	 */
+	for (int b = 0; b < pf->nBlocks; b++)
+		if (blockMax[b] > lwMax)
+			lwMax = blockMax[b];
+
+	/* NOTE: No warning here, this may run on any thread (see
+	 * `pf_warn_vanished`). */
+	pf->vanished = lwMax == -INFINITY;
+	if (pf->vanished) {
+		/* Every particle has zero likelihood or is invalid:
+		 * there's no information to keep, restart from
+		 * uniform. */
+		pf->nVanished++;
+		for (int i = 0; i < pf->nParticles; i++)
+			pf->lw[i] = pf->lw0;
+		lwMax = pf->lw0;
+	}
+
+	pf->lwMax = lwMax;
+
+	if (pf->stats != NULL) {
+		pf->stats->vanished += pf->vanished;
+		pf->stats->time[TIMER_WEIGHTING] += stats_lap(&t0);
+	}
+}
+
+/**
+ * Compute the unnormalized weights of one block.
+ *
+ * @param pf The filter.
+ * @param b The block.
+ */
+void pf_phase_weights(pf_state *pf, int b) {
+	int i0, nb = block_range(pf, b, &i0);
+	const double *lw = pf->lw;
+	const double lwMax = pf->lwMax;
+	double *w = pf->w;
+	double bSum = 0;
+	filter_stats *st = pf->stats != NULL ? pf->blockStats + b : NULL;
+	double t0 = st != NULL ? stats_clock() : 0;
+
+	for (int i = i0; i < i0 + nb; i++) {
+		w[i] = exp(lw[i] - lwMax);
+		bSum += w[i];
+	}
+
+	pf->blockSum[pf->nBlocks + b] = bSum;
 
-		gsl_matrix_set(*xMeanOut, k, 0, xkMean1);
-		gsl_matrix_set(*xMeanOut, k, 1, xkMean2);
-		gsl_matrix_set(*xMeanOut, k, 2, xkMean3);
-		gsl_matrix_set(*xMeanOut, k, 3, xkMean4);
+	if (st != NULL) {
+		for (int i = i0; i < i0 + nb; i++)
+			if (w[i] == 0 && isfinite(lw[i]))
+				st->expUnderflow++;
+		st->time[TIMER_NORMALIZATION] += stats_lap(&t0);
+	}
+}
+
+/**
+ * Sum the weights over all blocks and find the log-likelihood increment.
+ *
+ * @param pf The filter.
+ * @param out Pointer where the summaries of this step will be stored.
+ */
+void pf_phase_normalize(pf_state *pf, pf_summary *out) {
+	const double *blockWSum = pf->blockSum + pf->nBlocks;
+	double wSum = 0;
+	double t0 = pf->stats != NULL ? stats_clock() : 0;
+
+	for (int b = 0; b < pf->nBlocks; b++)
+		wSum += blockWSum[b];
+
+	/* Log normalizing constant: log sum_i exp(lw[i]) */
+	/* NOTE: The log-weights entering the step are normalized, so this is
+	 * also the log-likelihood increment log p(y_k | y_{1:k-1}). */
+	pf->wSum = wSum;
+	pf->lwNorm = pf->lwMax + log(wSum);
+	out->logLik = pf->vanished ? -INFINITY : pf->lwNorm;
+
+	if (pf->stats != NULL)
+		pf->stats->time[TIMER_NORMALIZATION] += stats_lap(&t0);
+}
+
+/**
+ * Normalize the weights of one block and accumulate its moments.
+ *
+ * @param pf The filter.
+ * @param b The block.
+ */
+void pf_phase_moments(pf_state *pf, int b) {
+	int i0, nb = block_range(pf, b, &i0);
+	const particle_gen *xk = pf->xkGen;
+	const double *baselinek = pf->baseline;
+	const double wSum = pf->wSum, lwNorm = pf->lwNorm;
+	double *lw = pf->lw, *w = pf->w;
+	double *s = pf->blockSum + 2 * pf->nBlocks + b * FILTER_MOMENTS;
+	double wki, d[STATE_DIM];
+	filter_stats *st = pf->stats != NULL ? pf->blockStats + b : NULL;
+	double t0 = st != NULL ? stats_clock() : 0;
+
+	/* Adaptive resampling -- Sarkka Step 3 */
+	/* (1) Compute effective sample size Sarkka Eq. 7.27 */
+	/* Compute posterior mean and covariance -- Sarkka Eq. 7.32 */
+	/* NOTE: All of them are accumulated in the same pass over the
+	 * normalized weights. The log-weights are normalized in the
+	 * same pass too, so they stay close to zero over long runs.
+	 * Positions are shifted by the noiseless solution before taking
+	 * moments: the spread is tiny compared to the coordinates, and
+	 * raw second moments would cancel catastrophically. */
+	for (int j = 0; j < FILTER_MOMENTS; j++)
+		s[j] = 0;
+
+	for (int i = i0; i < i0 + nb; i++) {
+		wki = w[i] / wSum;
+		w[i] = wki;
+		lw[i] -= lwNorm;
+
+		/* Zero weight adds nothing, and an invalid particle may not
+		 * even have a finite state */
+		if (wki == 0)
+			continue;
+
+		d[0] = xk->px[i] - baselinek[0];
+		d[1] = xk->py[i] - baselinek[1];
+		d[2] = xk->vx[i];
+		d[3] = xk->vy[i];
+
+		s[0] += wki * wki;
+		for (int r = 0, idx = 1 + STATE_DIM; r < STATE_DIM; r++) {
+			s[1 + r] += wki * d[r];
+			for (int c = 0; c <= r; c++)
+				s[idx++] += wki * d[r] * d[c];
+		}
+	}
+
+	if (st != NULL)
+		st->time[TIMER_MOMENTS] += stats_lap(&t0);
+}
+
+/**
+ * Reduce the moments over all blocks, fill in the summaries and decide
+ * whether to resample (drawing the ancestors if so).
+ *
+ * @param pf The filter.
+ * @param out Pointer where the summaries of this step will be stored.
+ */
+void pf_phase_summarize(pf_state *pf, pf_summary *out) {
+	const int nParticles = pf->nParticles;
+	const double *blockMom = pf->blockSum + 2 * pf->nBlocks;
+	const double *baselinek = pf->baseline;
+	double mom[FILTER_MOMENTS];
+	double ess;
+	double t0 = pf->stats != NULL ? stats_clock() : 0;
+
+	for (int j = 0; j < FILTER_MOMENTS; j++)
+		mom[j] = 0;
+
+	for (int b = 0; b < pf->nBlocks; b++)
+		for (int j = 0; j < FILTER_MOMENTS; j++)
+			mom[j] += blockMom[b * FILTER_MOMENTS + j];
+
+	ess = 1 / mom[0];
+	out->ess = ess;
+
+	out->xMean[0] = baselinek[0] + mom[1];
+	out->xMean[1] = baselinek[1] + mom[2];
+	out->xMean[2] = mom[3];
+	out->xMean[3] = mom[4];
+
+	for (int r = 0, idx = 1 + STATE_DIM; r < STATE_DIM; r++) {
+		for (int c = 0; c <= r; c++, idx++) {
+			double cov = mom[idx] - mom[1 + r] * mom[1 + c];
+			out->xCov[r * STATE_DIM + c] = cov;
+			out->xCov[c * STATE_DIM + r] = cov;
+		}
+	}
+
+	/* Rao-Blackwellized: add the variance of the velocity given the
+	 * positions to that of its means */
+	if (pf->opts.raoBlackwell) {
+		out->xCov[2 * STATE_DIM + 2] += pf->velocity.var[0];
+		out->xCov[3 * STATE_DIM + 3] += pf->velocity.var[1];
+	}
+
+	/* Weighted quantiles of the position */
+	if (pf->xQuantile != NULL && pf->opts.nQuantiles > 0) {
+		weighted_quantiles(pf->xkGen->px, pf->w, nParticles,
+				pf->opts.quantileProbs, pf->opts.nQuantiles,
+				(weighted_value *)pf->sortWork, pf->xQuantile);
+		weighted_quantiles(pf->xkGen->py, pf->w, nParticles,
+				pf->opts.quantileProbs, pf->opts.nQuantiles,
+				(weighted_value *)pf->sortWork,
+				pf->xQuantile + pf->opts.nQuantiles);
+	}
+
+	if (pf->stats != NULL) {
+		pf->stats->time[TIMER_MOMENTS] += stats_lap(&t0);
+		if (ess < pf->stats->essMin) {
+			pf->stats->essMin = ess;
+			pf->stats->essMinStep = pf->k;
+		}
+	}
+
+	/* (2) Resample */
+	/* NOTE: The estimates above use the weights before resampling,
+	 * which have lower variance. The resampled generation is
+	 * written into the spare buffer (xkm1Gen is no longer needed),
+	 * so no swap is needed afterwards. */
+	pf->resampled = pf->opts.resampleScheme != RESAMPLE_NONE &&
+			ess < pf->opts.essThreshold * nParticles;
+
+	if (pf->resampled) {
+		rng_uniforms(pf->opts.seed, RNG_RESAMPLE, pf->k, 0,
+				nParticles + 1, pf->resampleWork);
+		resample(pf->opts.resampleScheme, pf->w, nParticles,
+					pf->resampleWork, pf->ancestor);
+	}
+
+	if (pf->stats != NULL) {
+		pf->stats->resampled += pf->resampled;
+		pf->stats->time[TIMER_RESAMPLING] += stats_lap(&t0);
+	}
 
 #ifdef DEBUG
-		printf("k = % 5i, total wSum %0.8f, ESS: % 10.6f \t \t %0.8f\t%0.8f\t%0.8f\t%0.8f\n", k, wSum, 1 / wSumSq, xkMean1, xkMean2, xkMean3, xkMean4);
+	printf("k = % 5i, log wSum %0.8f, ESS: % 10.6f \t \t %0.8f\t%0.8f\t%0.8f\t%0.8f\n", pf->k, pf->lwNorm, ess, out->xMean[0], out->xMean[1], out->xMean[2], out->xMean[3]);
 #endif
-	} /* for each time step k */
-
-	/* Cleanup */
-	/* NOTE: Don't free xMean, w, ess -- pointers to these are returned. */
-	for (int i = 0; i < nParticles; i++)
-		gsl_matrix_free(x[i]);
-	free(x);
-	gsl_rng_free (r);
+}
+
+/**
+ * Gather the resampled particles of one block (only after resampling).
+ *
+ * @param pf The filter.
+ * @param b The block.
+ */
+void pf_phase_gather(pf_state *pf, int b) {
+	int i0, nb = block_range(pf, b, &i0);
+	particle_gen xb = gen_view(pf->xkm1Gen, i0, nb);
+	filter_stats *st = pf->stats != NULL ? pf->blockStats + b : NULL;
+	double t0 = st != NULL ? stats_clock() : 0;
+
+	resample_gen(pf->xkGen, pf->ancestor + i0, &xb);
+	for (int i = i0; i < i0 + nb; i++)
+		pf->lw[i] = pf->lw0;
+
+	if (st != NULL)
+		st->time[TIMER_RESAMPLING] += stats_lap(&t0);
+}
+
+/**
+ * Finish a step: generation k becomes k - 1 for the next one.
+ *
+ * @param pf The filter.
+ */
+void pf_phase_end(pf_state *pf) {
+	particle_gen *xSwap;
+
+	if (!pf->resampled) {
+		xSwap = pf->xkm1Gen;
+		pf->xkm1Gen = pf->xkGen;
+		pf->xkGen = xSwap;
+	}
+
+	/* Per-block statistics are merged in block order */
+	if (pf->stats != NULL) {
+		for (int b = 0; b < pf->nBlocks; b++)
+			stats_merge(pf->stats, pf->blockStats + b);
+		pf->stats->steps = pf->k;
+	}
+}
+
+/**
+ * Advance the filter by one time step.
+ *
+ * @param pf The filter.
+ * @param yk Array of size nSensors with the measurement at this step.
+ * @param out Pointer where the summaries of this step will be stored.
+ *
+ * @note After the call, `pf->w` holds the normalized weights of this step
+ * (before resampling) and, from OUTPUT_QUANTILES up, `pf->xQuantile` holds
+ * the quantiles of the position.
+ */
+void pf_step(pf_state *pf, const double *yk, pf_summary *out) {
+	const int nBlocks = pf->nBlocks;
+
+	pf_phase_begin(pf, yk);
+
+#pragma omp parallel for num_threads(pf->nThreads) schedule(static)
+	for (int b = 0; b < nBlocks; b++)
+		pf_phase_propagate(pf, yk, b);
+
+	pf_phase_max(pf);
+
+#pragma omp parallel for num_threads(pf->nThreads) schedule(static)
+	for (int b = 0; b < nBlocks; b++)
+		pf_phase_weights(pf, b);
+
+	pf_phase_normalize(pf, out);
+
+#pragma omp parallel for num_threads(pf->nThreads) schedule(static)
+	for (int b = 0; b < nBlocks; b++)
+		pf_phase_moments(pf, b);
+
+	pf_phase_summarize(pf, out);
+
+	if (pf->resampled) {
+#pragma omp parallel for num_threads(pf->nThreads) schedule(static)
+		for (int b = 0; b < nBlocks; b++)
+			pf_phase_gather(pf, b);
+	}
+
+	pf_phase_end(pf);
+}
+
+/**
+ * Get the weighted generation of the last step, before resampling. Its
+ * normalized weights are in `pf->w`. If the step resampled, particle i of
+ * the next step descends from particle `pf->ancestor[i]` of this one,
+ * otherwise from particle i.
+ *
+ * @param pf The filter, after at least one step.
+ * @return The generation. Valid until the next call to `pf_step`.
+ */
+const particle_gen *pf_generation(const pf_state *pf) {
+	/* Resampling writes into the spare buffer, without resampling the
+	 * buffers were swapped */
+	return pf->resampled ? pf->xkGen : pf->xkm1Gen;
+}
+
+/**
+ * Trace the particles of a filter (see trace.c). Each block with sampled
+ * particles gets its own ring.
+ *
+ * @param pf The filter.
+ * @param tr The trace. Must stay open until the filter stops stepping. NULL
+ * stops tracing, so the trace may be closed.
+ * @param tag The tag of the records of this filter.
+ */
+void pf_trace(pf_state *pf, trace_state *tr, int tag) {
+	free(pf->traceRing);
+	pf->trace = tr;
+	pf->traceTag = tag;
+	pf->traceRing = NULL;
+	if (tr == NULL)
+		return;
+
+	pf->traceRing = (trace_ring **)malloc(pf->nBlocks *
+						sizeof(trace_ring *));
+	if (pf->traceRing == NULL)
+		fatal("couldn't allocate the trace rings");
+
+	for (int b = 0; b < pf->nBlocks; b++) {
+		int i0, j0, nb = block_range(pf, b, &i0);
+
+		pf->traceRing[b] = trace_particles(tr, i0, nb, &j0) > 0 ?
+						trace_ring_open(tr) : NULL;
+	}
+}
+
+/**
+ * Free a particle filter.
+ *
+ * @param pf The filter.
+ */
+void pf_destroy(pf_state *pf) {
+	free(pf->traceRing);
+	free(pf->arena);
+	free(pf);
+}
+
+/**
+ * Allocate a matrix of a result, or wrap caller-owned memory stored by
+ * columns.
+ *
+ * @param data The memory, or NULL to allocate.
+ * @param T The number of time steps (rows).
+ * @param nCols The number of columns.
+ * @return Pointer to the matrix. Free with `gsl_matrix_free`, which leaves
+ * wrapped memory alone.
+ */
+static gsl_matrix *result_matrix(double *data, int T, int nCols) {
+	gsl_matrix *m;
+
+	if (data == NULL)
+		return gsl_matrix_alloc(T, nCols);
+
+	m = (gsl_matrix *)malloc(sizeof(gsl_matrix));
+	if (m == NULL)
+		fatal("couldn't allocate filter results");
+	*m = gsl_matrix_view_array(data, nCols, T).matrix;
+
+	return m;
+}
+
+/**
+ * Allocate a vector of a result, or wrap caller-owned memory.
+ *
+ * @param data The memory, or NULL to allocate.
+ * @param T The number of time steps.
+ * @return Pointer to the vector. Free with `gsl_vector_free`, which leaves
+ * wrapped memory alone.
+ */
+static gsl_vector *result_vector(double *data, int T) {
+	gsl_vector *v;
+
+	if (data == NULL)
+		return gsl_vector_alloc(T);
+
+	v = (gsl_vector *)malloc(sizeof(gsl_vector));
+	if (v == NULL)
+		fatal("couldn't allocate filter results");
+	*v = gsl_vector_view_array(data, T).vector;
+
+	return v;
+}
+
+/**
+ * Set up the output of a run, sized for the output level.
+ *
+ * @param T The number of time steps.
+ * @param nParticles The number of particles.
+ * @param opts The filter settings.
+ * @param buf The memory to write to, or NULL to allocate it.
+ * @return Pointer to the new result.
+ */
+static filter_result *result_create(int T, int nParticles,
+		const filter_opt *opts, const filter_buffer *buf) {
+	const filter_buffer none = {NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+									NULL};
+	filter_result *res = (filter_result *)malloc(sizeof(filter_result));
+	if (res == NULL)
+		fatal("couldn't allocate filter results");
+
+	res->level = opts->output;
+	res->byColumn = buf != NULL;
+	if (buf == NULL)
+		buf = &none;
+
+	res->xMean = result_matrix(buf->xMean, T, STATE_DIM);
+	res->xCov = result_matrix(buf->xCov, T, STATE_DIM * STATE_DIM);
+	res->ess = result_vector(buf->ess, T);
+	res->logLik = result_vector(buf->logLik, T);
+
+	res->xQuantile = NULL;
+	if (opts->output >= OUTPUT_QUANTILES && opts->nQuantiles > 0)
+		res->xQuantile = result_matrix(buf->xQuantile, T,
+						2 * opts->nQuantiles);
+
+	res->w = NULL;
+	if (opts->output >= OUTPUT_WEIGHTS)
+		res->w = result_matrix(buf->w, T, nParticles);
+
+	res->xSmooth = NULL;
+	if (opts->smoother != SMOOTHER_NONE)
+		res->xSmooth = result_matrix(buf->xSmooth, T, STATE_DIM);
+
+	res->trajectories = NULL;
+	if (opts->smoother == SMOOTHER_FFBSI)
+		res->trajectories = result_matrix(buf->trajectories, T,
+					STATE_DIM * opts->nTrajectories);
+
+	res->stats = NULL;
+	if (opts->stats) {
+		res->stats = (filter_stats *)malloc(sizeof(filter_stats));
+		if (res->stats == NULL)
+			fatal("couldn't allocate filter statistics");
+		stats_clear(res->stats);
+	}
+
+	return res;
+}
+
+/**
+ * Allocate the output of a run, sized for the output level.
+ *
+ * @param T The number of time steps.
+ * @param nParticles The number of particles.
+ * @param opts The filter settings (output level, number of quantiles).
+ * @return Pointer to the new result. Free with `filter_result_free`.
+ */
+filter_result *filter_result_alloc(int T, int nParticles,
+		const filter_opt *opts) {
+	return result_create(T, nParticles, opts, NULL);
+}
+
+/**
+ * Set up the output of a run over memory owned by the caller, so a run
+ * writes its output in place (e.g. straight into R vectors).
+ *
+ * @param T The number of time steps.
+ * @param nParticles The number of particles.
+ * @param opts The filter settings (output level, number of quantiles).
+ * @param buf The memory, each matrix stored by columns. It must outlive the
+ * result.
+ * @return Pointer to the new result. Free with `filter_result_free`, which
+ * leaves `buf` alone.
+ */
+filter_result *filter_result_wrap(int T, int nParticles,
+		const filter_opt *opts, const filter_buffer *buf) {
+	return result_create(T, nParticles, opts, buf);
+}
+
+/**
+ * Free the output of a run.
+ *
+ * @param res The result.
+ */
+void filter_result_free(filter_result *res) {
+	free(res->stats);
+	if (res->trajectories != NULL)
+		gsl_matrix_free(res->trajectories);
+	if (res->xSmooth != NULL)
+		gsl_matrix_free(res->xSmooth);
+	if (res->w != NULL)
+		gsl_matrix_free(res->w);
+	if (res->xQuantile != NULL)
+		gsl_matrix_free(res->xQuantile);
+	gsl_vector_free(res->logLik);
+	gsl_vector_free(res->ess);
+	gsl_matrix_free(res->xCov);
+	gsl_matrix_free(res->xMean);
+	free(res);
+}
+
+/**
+ * Set row k, column j of a matrix of a result, whatever its storage.
+ *
+ * @param res The result.
+ * @param m One of the matrices of `res`.
+ * @param k The row (time step k + 1).
+ * @param j The column.
+ * @param value The value.
+ */
+void filter_result_set(const filter_result *res, gsl_matrix *m, int k, int j,
+		double value) {
+	if (res->byColumn)
+		gsl_matrix_set(m, j, k, value);
+	else
+		gsl_matrix_set(m, k, j, value);
+}
+
+/**
+ * Store the output of the last step in row k - 1 of a result.
+ *
+ * @param pf The filter, right after a step.
+ * @param sk The summaries of that step.
+ * @param out The result (see `filter_result_alloc`).
+ */
+void pf_store(const pf_state *pf, const pf_summary *sk, filter_result *out) {
+	const int k = pf->k;
+
+	for (int j = 0; j < STATE_DIM; j++)
+		filter_result_set(out, out->xMean, k - 1, j, sk->xMean[j]);
+	for (int j = 0; j < STATE_DIM * STATE_DIM; j++)
+		filter_result_set(out, out->xCov, k - 1, j, sk->xCov[j]);
+	gsl_vector_set(out->ess, k - 1, sk->ess);
+	gsl_vector_set(out->logLik, k - 1, sk->logLik);
+
+	if (out->xQuantile != NULL)
+		for (int j = 0; j < 2 * pf->opts.nQuantiles; j++)
+			filter_result_set(out, out->xQuantile, k - 1, j,
+						pf->xQuantile[j]);
+
+	if (out->w != NULL)
+		for (int i = 0; i < pf->nParticles; i++)
+			filter_result_set(out, out->w, k - 1, i, pf->w[i]);
+}
+
+/**
+ * Copy the statistics of the run so far into a result.
+ *
+ * @param pf The filter.
+ * @param out The result. Nothing is copied unless both the filter and the
+ * result were set up with `opts->stats`.
+ */
+void pf_store_stats(const pf_state *pf, filter_result *out) {
+	if (pf->stats != NULL && out->stats != NULL)
+		*out->stats = *pf->stats;
+}
+
+/**
+ * Run a filter over all the measurements, leaving the warning about steps
+ * where every weight vanished to the caller (see `pf->nVanished`). For
+ * callers that run the filter many times and warn once (e.g. pmmh.c).
+ *
+ * @param pf The filter, at k = 0 (see `pf_create` and `pf_reset`).
+ * @param y The measurement vector.
+ * @param out The result where the output of each step will be stored (see
+ * `filter_result_alloc`), or NULL to only compute the log-likelihood. The
+ * smoother set in the filter options, if any, runs along.
+ * @return The estimate of the log marginal likelihood log p(y_{1:T}), the
+ * sum of the per-step increments.
+ */
+double pf_run_quiet(pf_state *pf, const gsl_matrix *y, filter_result *out) {
+	int T = y->size1;
+	const double *yk;
+	double logLik = 0;
+	pf_summary sk;
+	smoother_state *sm = NULL;
+
+	if ((int)y->size2 != pf->param->nSensors)
+		fatal("the measurements need one column per sensor");
+
+	if (out != NULL && out->xSmooth != NULL)
+		sm = smoother_create(pf, T);
+
+	/* k = 1, 2, ..., T (each time step) */
+	for (int k = 1; k < T + 1; k++) {
+		/* Note: k - 1! */
+		yk = y->data + (k - 1) * y->tda;
+
+		pf_step(pf, yk, &sk);
+		logLik += sk.logLik;
+
+		if (out == NULL)
+			continue;
+
+		pf_store(pf, &sk, out);
+
+		if (sm != NULL)
+			smoother_update(sm, pf, out);
+	}
+
+	if (sm != NULL) {
+		smoother_finish(sm, pf, out);
+		smoother_destroy(sm);
+	}
+
+	if (out != NULL) {
+		out->logLikTotal = logLik;
+		pf_store_stats(pf, out);
+	}
+
+	return logLik;
+}
+
+/**
+ * Run a filter over all the measurements, as `pf_run_quiet`, and warn if
+ * every weight vanished at some step.
+ *
+ * @param pf The filter, at k = 0 (see `pf_create` and `pf_reset`).
+ * @param y The measurement vector.
+ * @param out The result, or NULL (see `pf_run_quiet`).
+ * @return The estimate of the log marginal likelihood log p(y_{1:T}).
+ */
+double pf_run(pf_state *pf, const gsl_matrix *y, filter_result *out) {
+	double logLik = pf_run_quiet(pf, y, out);
+
+	pf_warn_vanished(pf->nVanished);
+
+	return logLik;
+}
+
+/**
+ * Warn that the weights vanished (and were reset to uniform) at some steps.
+ *
+ * NOTE: Under R, call it from the main thread only, after the parallel
+ * region that ran the filters (see `pf_phase_max`).
+ *
+ * @param nSteps The number of steps where every weight vanished, summed
+ * over the filters of interest. Nothing happens if it is zero.
+ */
+void pf_warn_vanished(int nSteps) {
+	char message[96];
+
+	if (nSteps == 0)
+		return;
+
+	snprintf(message, sizeof(message), "all particle weights vanished at "
+			"%i step(s), resetting them to uniform", nSteps);
+	warning(message);
+}
+
+/**
+ * Compute the posterior mean of the latent matrix via a Particle Filter.
+ *
+ * @param y The measurement vector.
+ * @param nParticles The number of particles (MC samples) to use.
+ * @param param The model parameters. Read-only during the run.
+ * @param opts The filter settings (seed, number of threads, resampling,
+ * output level, tracing).
+ * @param out The result where the output of each step will be stored (see
+ * `filter_result_alloc`).
+ */
+void filter(gsl_matrix *y, int nParticles, const model_param *param,
+		const filter_opt *opts, filter_result *out) {
+	pf_state *pf = pf_create(nParticles, param, opts);
+	trace_state *tr = NULL;
+
+	if (opts->trace != NULL) {
+		tr = trace_open(opts->trace);
+		pf_trace(pf, tr, 0);
+	}
+
+	pf_run(pf, y, out);
+	pf_destroy(pf);
+
+	if (tr != NULL)
+		trace_close(tr);
 }
@@ -10,9 +10,213 @@
 #ifndef C_FILTER_H_
 #define C_FILTER_H_
 
-void filter(gsl_matrix *y, int nParticles, model_param *param,
-		gsl_matrix **xMeanOut, gsl_matrix **wOut,
-		gsl_vector **essOut);
-void filter_free(gsl_matrix *xMeanOut, gsl_matrix *wOut, gsl_vector *essOut);
+/* Particles per block, the unit of work of a thread. Draws don't depend on
+ * it (see rng.c). */
+#define FILTER_BLOCK_SIZE 4096 /* int */
+
+/* NOTE: Levels are nested, each one stores everything the previous one does.
+ * Keep the order in sync with OUTPUT_LEVELS in R/. */
+typedef enum output_levels {
+	OUTPUT_SUMMARY = 0, /**< Mean, covariance, ESS and log-likelihood */
+	OUTPUT_QUANTILES, /**< Plus weighted quantiles of the position */
+	OUTPUT_WEIGHTS /**< Plus the normalized weights of every step */
+} output_level;
+
+/* NOTE: Keep the order in sync with SMOOTHERS in R/. */
+typedef enum smoother_types {
+	SMOOTHER_NONE = 0, /**< Filtering only */
+	SMOOTHER_FIXED_LAG, /**< Fixed-lag smoother over a window of steps */
+	SMOOTHER_FFBSI /**< Backward simulation of whole trajectories */
+} smoother_type;
+
+/* NOTE: Keep the order in sync with STATS_TIMERS in R/. */
+typedef enum filter_timers {
+	TIMER_PROPOSAL = 0, /**< Noiseless solution and draws */
+	TIMER_WEIGHTING, /**< Densities and log-weights */
+	TIMER_NORMALIZATION, /**< Shifted weights and their sum */
+	TIMER_MOMENTS, /**< ESS, mean and covariance (one pass), quantiles */
+	TIMER_RESAMPLING, /**< Ancestors and gathering */
+	FILTER_N_TIMERS
+} filter_timer;
+
+/**
+ * Counters and timers of a run (see `filter_opt.stats`). Times are wall
+ * seconds summed over the threads that worked on each phase.
+ */
+typedef struct filter_statistics {
+	double time[FILTER_N_TIMERS]; /**< Seconds spent in each phase */
+	long expUnderflow; /**< Finite log-weights whose weight underflowed to
+			zero relative to the largest one */
+	long logOverflow; /**< Log-weights equal to +Inf (the importance
+			density underflowed), given zero weight */
+	long logInvalid; /**< Log-weights equal to -Inf or NaN, the latter
+			given zero weight */
+	int vanished; /**< Steps where every weight vanished */
+	int resampled; /**< Steps that resampled */
+	int steps; /**< Steps taken */
+	double essMin; /**< Smallest ESS, before resampling */
+	int essMinStep; /**< Step k of the smallest ESS */
+} filter_stats;
+
+typedef struct filter_options {
+	unsigned long seed; /**< Key for the random number generator */
+	int nThreads; /**< Number of threads for the particle loop */
+	resample_scheme resampleScheme; /**< Resampling scheme */
+	double essThreshold; /**< Resample when ESS < essThreshold * N */
+	output_level output; /**< What to keep from each step */
+	int nQuantiles; /**< Number of quantiles of the position */
+	const double *quantileProbs; /**< Probabilities of those quantiles */
+	smoother_type smoother; /**< Smoother run along the filter */
+	int lag; /**< Lag of the fixed-lag smoother */
+	int nTrajectories; /**< Number of trajectories drawn by FFBSi */
+	proposal_type proposal; /**< Where the particles are drawn from */
+	int raoBlackwell; /**< Whether to marginalize the velocity (see
+			rbpf.c) */
+	double bearingTol; /**< Largest error of the expected bearings, in
+			radians, 0 for libm's atan2 (see `batch_atan2`) */
+	int stats; /**< Whether to collect a filter_stats (else no cost) */
+	const trace_opt *trace; /**< Particles to trace, NULL for none (used
+			by `filter` and `fleet`) */
+} filter_opt;
+
+/**
+ * Summaries of the filtering distribution at one time step.
+ */
+typedef struct pf_summaries {
+	double xMean[STATE_DIM]; /**< Posterior mean */
+	double xCov[STATE_DIM * STATE_DIM]; /**< Posterior covariance, by rows */
+	double ess; /**< Effective sample size, before resampling */
+	double logLik; /**< Log-likelihood increment log p(y_k | y_{1:k-1}) */
+} pf_summary;
+
+/**
+ * A running particle filter. Holds the last two generations, the weights
+ * and every work array, so `pf_step` never allocates.
+ */
+typedef struct pf_state {
+	int nParticles; /**< Number of particles */
+	int nBlocks; /**< Number of particle blocks */
+	int nThreads; /**< Number of threads for the particle loop */
+	int k; /**< Number of steps taken so far */
+	int resampled; /**< Whether the last step resampled */
+	const model_param *param; /**< Model parameters (not owned) */
+	filter_opt opts; /**< Filter settings */
+
+	particle_gen *xkm1Gen; /**< Previous generation */
+	particle_gen *xkGen; /**< Current generation */
+	double *lw; /**< Log-weights */
+	double *w; /**< Normalized weights of the last step */
+	double lw0; /**< Log-weight of a uniform generation */
+	double stateMu[STATE_DIM]; /**< Location for state model (legacy
+			proposal, see proposal.c) */
+	double baseline[POSITION_DIM]; /**< Noiseless solution of the last
+			step with non-parallel bearings */
+	rbpf_velocity velocity; /**< Shared part of the velocity filter
+			(opts.raoBlackwell) */
+	double *xQuantile; /**< Quantiles of the position of the last step,
+			px first, then py (OUTPUT_QUANTILES and above) */
+
+	/* Step in progress (see the pf_phase_* functions) */
+	double lwMax; /**< Largest log-weight */
+	double wSum; /**< Sum of the weights shifted by lwMax */
+	double lwNorm; /**< Log of the sum of the weights */
+	int vanished; /**< Whether every weight vanished */
+	int nVanished; /**< Steps where every weight vanished, since the last
+			`pf_reset` */
+
+	/* Tracing, NULL unless traced (see `pf_trace`) */
+	trace_state *trace; /**< Trace (not owned) */
+	trace_ring **traceRing; /**< Ring of each block, NULL for blocks
+			without sampled particles */
+	int traceTag; /**< Tag of the records of this filter */
+
+	/* Statistics, NULL unless opts.stats */
+	filter_stats *stats; /**< Statistics of the run so far */
+	filter_stats *blockStats; /**< Per-block part of the step in progress,
+			merged into stats at the end of the step */
+
+	/* Work arrays, all of them (and the generations, the weights and the
+	 * statistics) carved from the arena */
+	void *arena; /**< The memory of the filter, as allocated */
+	double *z, *lpdf1s, *lpdf2s, *lpdf3s;
+	int *ancestor;
+	double *resampleWork;
+	double *blockSum; /**< Per-block partial sums */
+	void *sortWork; /**< (value, weight) pairs for the quantiles */
+} pf_state;
+
+/**
+ * The output of a whole run. One row per time step k = 1, ..., T. Members
+ * not needed by `level` or by the smoother are NULL.
+ *
+ * NOTE: A result made by `filter_result_wrap` stores each matrix by columns,
+ * as R does, so the GSL matrices are their transposes (one row per column).
+ * Write to them with `filter_result_set`.
+ */
+typedef struct filter_results {
+	output_level level; /**< What was kept */
+	int byColumn; /**< Whether the matrices are stored by columns */
+	gsl_matrix *xMean; /**< T x STATE_DIM posterior means */
+	gsl_matrix *xCov; /**< T x STATE_DIM^2 posterior covariances, by rows */
+	gsl_vector *ess; /**< T effective sample sizes */
+	gsl_vector *logLik; /**< T log-likelihood increments */
+	double logLikTotal; /**< Log marginal likelihood log p(y_{1:T}) */
+	gsl_matrix *xQuantile; /**< T x 2 nQuantiles position quantiles */
+	gsl_matrix *w; /**< T x nParticles normalized weights */
+	gsl_matrix *xSmooth; /**< T x STATE_DIM smoothed means (any smoother) */
+	gsl_matrix *trajectories; /**< T x STATE_DIM nTrajectories smoothed
+			trajectories, trajectory m in columns 4m to 4m + 3
+			(SMOOTHER_FFBSI) */
+	filter_stats *stats; /**< Statistics of the run (opts->stats) */
+} filter_result;
+
+/**
+ * Memory owned by the caller where a result is written in place (see
+ * `filter_result_wrap`), one array per member of `filter_result`, each
+ * matrix stored by columns: element (k, j) at [k + j T]. Arrays not needed
+ * by the output level or the smoother are ignored.
+ */
+typedef struct filter_buffers {
+	double *xMean; /**< T x STATE_DIM */
+	double *xCov; /**< T x STATE_DIM^2 */
+	double *ess; /**< T */
+	double *logLik; /**< T */
+	double *xQuantile; /**< T x 2 nQuantiles */
+	double *w; /**< T x nParticles */
+	double *xSmooth; /**< T x STATE_DIM */
+	double *trajectories; /**< T x STATE_DIM nTrajectories */
+} filter_buffer;
+
+pf_state *pf_create(int nParticles, const model_param *param,
+		const filter_opt *opts);
+void pf_reset(pf_state *pf, const model_param *param, unsigned long seed);
+void pf_step(pf_state *pf, const double *yk, pf_summary *out);
+void pf_phase_begin(pf_state *pf, const double *yk);
+void pf_phase_propagate(pf_state *pf, const double *yk, int b);
+void pf_phase_max(pf_state *pf);
+void pf_phase_weights(pf_state *pf, int b);
+void pf_phase_normalize(pf_state *pf, pf_summary *out);
+void pf_phase_moments(pf_state *pf, int b);
+void pf_phase_summarize(pf_state *pf, pf_summary *out);
+void pf_phase_gather(pf_state *pf, int b);
+void pf_phase_end(pf_state *pf);
+void pf_store(const pf_state *pf, const pf_summary *sk, filter_result *out);
+void pf_store_stats(const pf_state *pf, filter_result *out);
+const particle_gen *pf_generation(const pf_state *pf);
+void pf_trace(pf_state *pf, trace_state *tr, int tag);
+void pf_destroy(pf_state *pf);
+double pf_run_quiet(pf_state *pf, const gsl_matrix *y, filter_result *out);
+double pf_run(pf_state *pf, const gsl_matrix *y, filter_result *out);
+void pf_warn_vanished(int nSteps);
+
+filter_result *filter_result_alloc(int T, int nParticles,
+		const filter_opt *opts);
+filter_result *filter_result_wrap(int T, int nParticles,
+		const filter_opt *opts, const filter_buffer *buf);
+void filter_result_free(filter_result *res);
+void filter_result_set(const filter_result *res, gsl_matrix *m, int k, int j,
+		double value);
+void filter(gsl_matrix *y, int nParticles, const model_param *param,
+		const filter_opt *opts, filter_result *out);
 
 #endif /* C_FILTER_H_ */
@@ -0,0 +1,237 @@
+/**
+ * @file fleet.c
+ * @authors Luis Damiano
+ * @version 0.1
+ * @details
+ *
+ * Track many vehicles in one call, each with its own measurement series.
+ *
+ * Every target gets its own filter, and all filters advance in lockstep: at
+ * step k, the blocks of particles of every target still running (k <= T of
+ * that target) are pooled into one list of (target, block) tasks, and each
+ * phase of the step (see the pf_phase_* functions in filter.c) runs as a
+ * single parallel loop over that list. A fleet of many small targets keeps
+ * all threads busy, where a single small filter would have one block to
+ * hand out. The per-target phases (finding the largest weight, reducing the
+ * moments, resampling) are cheap and run over targets.
+ *
+ * Target t uses seed `opts->seed + t`. Draws only depend on the seed, the
+ * step and the particle (see rng.c), so the output of each target is the
+ * same as running `filter` on it alone with that seed, and doesn't depend on
+ * the number of threads or on the other targets.
+ */
+
+#include "main.h"
+
+/**
+ * Allocate the output of a fleet run, sized for the output level.
+ *
+ * @param nTargets The number of targets.
+ * @param T Array of size nTargets with the number of time steps of each one.
+ * @param nParticles The number of particles per target.
+ * @param opts The filter settings (output level, number of quantiles,
+ * smoother).
+ * @return Pointer to the new result. Free with `fleet_result_free`.
+ */
+fleet_result *fleet_result_alloc(int nTargets, const int *T, int nParticles,
+		const filter_opt *opts) {
+	fleet_result *res = (fleet_result *)malloc(sizeof(fleet_result));
+	if (res == NULL)
+		fatal("couldn't allocate fleet results");
+
+	res->nTargets = nTargets;
+	res->target = (filter_result **)malloc(nTargets *
+						sizeof(filter_result *));
+	if (res->target == NULL)
+		fatal("couldn't allocate fleet results");
+
+	for (int t = 0; t < nTargets; t++)
+		res->target[t] = filter_result_alloc(T[t], nParticles, opts);
+
+	return res;
+}
+
+/**
+ * Free the output of a fleet run.
+ *
+ * @param res The result.
+ */
+void fleet_result_free(fleet_result *res) {
+	for (int t = 0; t < res->nTargets; t++)
+		filter_result_free(res->target[t]);
+	free(res->target);
+	free(res);
+}
+
+/**
+ * Run one particle filter per target, all of them in lockstep.
+ *
+ * @param nTargets The number of targets.
+ * @param y Array of size nTargets with the measurements of each target.
+ * Series may have different lengths.
+ * @param nParticles The number of particles (MC samples) per target.
+ * @param param Array of size nTargets with the model parameters of each
+ * target. Targets may share the same pointer. Read-only during the run.
+ * @param opts The filter settings, shared by all targets. `nThreads` threads
+ * work on the blocks of all targets, and target t uses seed
+ * `opts->seed + t`.
+ * @param out The result where the output of each target will be stored (see
+ * `fleet_result_alloc`).
+ */
+void fleet(int nTargets, const gsl_matrix *const *y, int nParticles,
+		const model_param *const *param, const filter_opt *opts,
+		fleet_result *out) {
+#ifdef _OPENMP
+	const int nThreads = opts->nThreads > 0 ? opts->nThreads : 1;
+#endif
+	filter_opt targetOpts = *opts;
+	pf_state **pf;
+	smoother_state **sm;
+	pf_summary *sk;
+	const double **yk;
+	int *active, *taskTarget, *taskBlock;
+	int maxT = 0, maxTasks = 0, nVanished = 0;
+	trace_state *tr = NULL;
+
+	if (out->nTargets != nTargets)
+		fatal("the fleet result has the wrong number of targets");
+
+	pf = (pf_state **)malloc(nTargets * sizeof(pf_state *));
+	sm = (smoother_state **)malloc(nTargets * sizeof(smoother_state *));
+	sk = (pf_summary *)malloc(nTargets * sizeof(pf_summary));
+	yk = (const double **)malloc(nTargets * sizeof(const double *));
+	active = (int *)malloc(nTargets * sizeof(int));
+	if (pf == NULL || sm == NULL || sk == NULL || yk == NULL ||
+			active == NULL)
+		fatal("couldn't allocate the fleet");
+
+	/* All targets share one trace, records are tagged with the target */
+	if (opts->trace != NULL)
+		tr = trace_open(opts->trace);
+
+	/* One single-threaded filter per target: threads are spread over the
+	 * blocks of all targets instead */
+	targetOpts.nThreads = 1;
+	for (int t = 0; t < nTargets; t++) {
+		int T = y[t]->size1;
+
+		if ((int)y[t]->size2 != param[t]->nSensors)
+			fatal("the measurements need one column per sensor");
+
+		targetOpts.seed = opts->seed + t;
+		pf[t] = pf_create(nParticles, param[t], &targetOpts);
+		if (tr != NULL)
+			pf_trace(pf[t], tr, t);
+		out->target[t]->logLikTotal = 0;
+
+		sm[t] = NULL;
+		if (out->target[t]->xSmooth != NULL)
+			sm[t] = smoother_create(pf[t], T);
+
+		maxTasks += pf[t]->nBlocks;
+		if (T > maxT)
+			maxT = T;
+	}
+
+	taskTarget = (int *)malloc(maxTasks * sizeof(int));
+	taskBlock = (int *)malloc(maxTasks * sizeof(int));
+	if (taskTarget == NULL || taskBlock == NULL)
+		fatal("couldn't allocate the fleet");
+
+	/* k = 1, 2, ..., max T (each time step) */
+	for (int k = 1; k < maxT + 1; k++) {
+		int nActive = 0, nTasks = 0;
+
+		/* Pool the blocks of the targets still running */
+		for (int t = 0; t < nTargets; t++) {
+			if (k > (int)y[t]->size1)
+				continue;
+
+			active[nActive++] = t;
+			for (int b = 0; b < pf[t]->nBlocks; b++) {
+				taskTarget[nTasks] = t;
+				taskBlock[nTasks++] = b;
+			}
+
+			/* Note: k - 1! */
+			yk[t] = y[t]->data + (k - 1) * y[t]->tda;
+			pf_phase_begin(pf[t], yk[t]);
+		}
+
+#pragma omp parallel num_threads(nThreads)
+		{
+#pragma omp for schedule(static)
+			for (int j = 0; j < nTasks; j++)
+				pf_phase_propagate(pf[taskTarget[j]],
+					yk[taskTarget[j]], taskBlock[j]);
+
+#pragma omp for schedule(static)
+			for (int a = 0; a < nActive; a++)
+				pf_phase_max(pf[active[a]]);
+
+#pragma omp for schedule(static)
+			for (int j = 0; j < nTasks; j++)
+				pf_phase_weights(pf[taskTarget[j]],
+							taskBlock[j]);
+
+#pragma omp for schedule(static)
+			for (int a = 0; a < nActive; a++)
+				pf_phase_normalize(pf[active[a]],
+							&sk[active[a]]);
+
+#pragma omp for schedule(static)
+			for (int j = 0; j < nTasks; j++)
+				pf_phase_moments(pf[taskTarget[j]],
+							taskBlock[j]);
+
+			/* NOTE: Quantiles and resampling are O(N) per target,
+			 * so targets are handed out dynamically. */
+#pragma omp for schedule(dynamic)
+			for (int a = 0; a < nActive; a++)
+				pf_phase_summarize(pf[active[a]],
+							&sk[active[a]]);
+
+#pragma omp for schedule(static)
+			for (int j = 0; j < nTasks; j++)
+				if (pf[taskTarget[j]]->resampled)
+					pf_phase_gather(pf[taskTarget[j]],
+								taskBlock[j]);
+
+#pragma omp for schedule(dynamic)
+			for (int a = 0; a < nActive; a++) {
+				int t = active[a];
+				filter_result *res = out->target[t];
+
+				pf_phase_end(pf[t]);
+				pf_store(pf[t], &sk[t], res);
+				res->logLikTotal += sk[t].logLik;
+
+				if (sm[t] != NULL)
+					smoother_update(sm[t], pf[t], res);
+			}
+		}
+	}
+
+	/* Clean up, warning once for all targets (on this thread) */
+	for (int t = 0; t < nTargets; t++) {
+		nVanished += pf[t]->nVanished;
+		if (sm[t] != NULL) {
+			smoother_finish(sm[t], pf[t], out->target[t]);
+			smoother_destroy(sm[t]);
+		}
+		pf_store_stats(pf[t], out->target[t]);
+		pf_destroy(pf[t]);
+	}
+
+	if (tr != NULL)
+		trace_close(tr);
+	pf_warn_vanished(nVanished);
+
+	free(taskBlock);
+	free(taskTarget);
+	free(active);
+	free(yk);
+	free(sk);
+	free(sm);
+	free(pf);
+}
@@ -0,0 +1,29 @@
+/**
+ * @file fleet.h
+ * @authors Luis Damiano
+ * @version 0.1
+ * @details
+ *
+ * Header for the multi-target filter.
+ */
+
+#ifndef C_FLEET_H_
+#define C_FLEET_H_
+
+/**
+ * The output of a fleet run: one filter result per target, each sized for
+ * the length of that target's series.
+ */
+typedef struct fleet_results {
+	int nTargets; /**< Number of targets */
+	filter_result **target; /**< Output of each target */
+} fleet_result;
+
+fleet_result *fleet_result_alloc(int nTargets, const int *T, int nParticles,
+		const filter_opt *opts);
+void fleet_result_free(fleet_result *res);
+void fleet(int nTargets, const gsl_matrix *const *y, int nParticles,
+		const model_param *const *param, const filter_opt *opts,
+		fleet_result *out);
+
+#endif /* C_FLEET_H_ */
@@ -5,21 +5,32 @@
  * @details
  *
  * Printing functions.
+ *
+ * Built into the R package (USING_R), errors and warnings go through R:
+ * `fatal` returns to R with an error instead of exiting the session.
  */
 
 #include "main.h"
 
 /**
  * Print a fatal error message and exit with failure.
+ *
+ * NOTE: Under R, it jumps back to R and never returns, so call it from the
+ * main thread only. Memory allocated by the caller is not freed.
+ *
  * @param message Error message.
  */
 void fatal(char *message)
 {
+#ifdef USING_R
+	Rf_error("%s.", message);
+#else
 	fprintf(stderr, "FATAL: %s.\n", message);
 	fprintf(stderr,
 			"\nUsage:\n	./particle\n");
 
 	exit(EXIT_FAILURE);
+#endif
 }
 
 /**
@@ -28,7 +39,11 @@ void fatal(char *message)
  */
 void debug(char *message)
 {
+#ifdef USING_R
+	REprintf("DEBUG: %s.\n", message);
+#else
 	fprintf(stderr, "DEBUG: %s.\n", message);
+#endif
 }
 
 /**
@@ -37,5 +52,9 @@ void debug(char *message)
  */
 void warning(char *message)
 {
+#ifdef USING_R
+	Rf_warning("%s.", message);
+#else
 	fprintf(stderr, "WARNING: %s.\n", message);
+#endif
 }
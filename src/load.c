@@ -5,44 +5,330 @@
  * @details
  *
  * Data reading functions.
+ *
+ * Measurements come either as text, one row per time step with one bearing
+ * per sensor separated by blanks or commas, or as a columnar file (see
+ * columnar.c) with one angle column per sensor and an optional timestamp
+ * column named "t". The number of sensors is that of the first row. The file
+ * is
+ * memory-mapped and read in a single pass: text rows are parsed straight
+ * from the mapping into a growable buffer, and columnar files need no parsing
+ * at all.
  */
 
 #include "main.h"
 
+#define LOAD_INITIAL_ROWS 4096 /* int */
+#define LOAD_MAX_TOKEN 64 /* int, longest number handed to strtod */
+
+/* Exact powers of ten as doubles (Clinger's fast path) */
+static const double POW10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
 /**
- * Read measurements from file.
+ * Map a whole file into memory (read it on platforms without mmap).
  *
- * @param filename Path to the file with measurements.
- * @param y Pointer where the measurement matrix will be stored.
+ * @param filename Path to the file.
+ * @param sizeOut Pointer where the size of the file will be stored.
+ * @return Pointer to the contents. Release with `unmap_file`.
  */
-void load_data(char *filename, gsl_matrix **y)
-{
-	/* Read file */
-	FILE *pFile = fopen(filename, "r");
+static const char *map_file(const char *filename, size_t *sizeOut) {
+#ifdef _WIN32
+	FILE *fp = fopen(filename, "rb");
+	char *buf;
+	long size;
 
-	if (pFile == NULL)
+	if (fp == NULL)
 		fatal("cannot open file, is it accessible?");
 
-	/* Determine length */
-	int nrow = 0;
-	char c;
+	fseek(fp, 0L, SEEK_END);
+	size = ftell(fp);
+	fseek(fp, 0L, SEEK_SET);
+
+	buf = (char *)malloc(size > 0 ? size : 1);
+	if (buf == NULL)
+		fatal("couldn't allocate memory for the input file");
+	if (fread(buf, 1, size, fp) != (size_t)size)
+		fatal("couldn't read the input file");
+
+	fclose(fp);
+	*sizeOut = size;
+	return buf;
+#else
+	struct stat st;
+	void *buf;
+	int fd = open(filename, O_RDONLY);
+
+	if (fd < 0)
+		fatal("cannot open file, is it accessible?");
+	if (fstat(fd, &st) != 0)
+		fatal("cannot read the size of the input file");
+
+	*sizeOut = st.st_size;
+	if (st.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+
+	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (buf == MAP_FAILED)
+		fatal("couldn't map the input file into memory");
+
+	madvise(buf, st.st_size, MADV_SEQUENTIAL);
+	return (const char *)buf;
+#endif
+}
+
+/**
+ * Release a file mapped by `map_file`.
+ */
+static void unmap_file(const char *buf, size_t size) {
+#ifdef _WIN32
+	free((char *)buf);
+#else
+	if (buf != NULL)
+		munmap((void *)buf, size);
+#endif
+}
+
+/**
+ * Parse a decimal number.
+ *
+ * Numbers with at most 19 significant digits, a mantissa below 2^53 and a
+ * decimal exponent within +-22 are converted exactly with one multiplication
+ * or division (Clinger 1990). Anything else (long mantissas, large
+ * exponents, inf, nan) is handed to strtod.
+ *
+ * @param p Pointer to the first character of the number.
+ * @param end Pointer past the end of the buffer.
+ * @param out Pointer where the number will be stored.
+ * @return Pointer past the number, or NULL if there's no number at p.
+ */
+static const char *parse_double(const char *p, const char *end, double *out) {
+	const char *start = p;
+	uint64_t m = 0;
+	int neg = 0, nDigits = 0, exp10 = 0, any = 0, exact = 1;
+
+	if (p < end && (*p == '-' || *p == '+'))
+		neg = *p++ == '-';
 
-	for (c = getc(pFile); c != EOF; c = getc(pFile))
-		if (c == '\n')
-			nrow++;
+	/* Integer part */
+	for (; p < end && *p >= '0' && *p <= '9'; p++, any = 1) {
+		if (nDigits < 19) {
+			m = 10 * m + (*p - '0');
+			nDigits += m > 0;
+		} else {
+			exp10++;
+			exact &= *p == '0';
+		}
+	}
 
-	/* Allocate rows */
-	*y = gsl_matrix_alloc(nrow, MEASUREMENT_DIM);
+	/* Fractional part */
+	if (p < end && *p == '.') {
+		for (p++; p < end && *p >= '0' && *p <= '9'; p++, any = 1) {
+			if (nDigits < 19) {
+				m = 10 * m + (*p - '0');
+				nDigits += m > 0;
+				exp10--;
+			} else {
+				exact &= *p == '0';
+			}
+		}
+	}
 
-	/* Populate rows */
-	fseek(pFile, 0L, SEEK_SET);
+	/* Exponent */
+	if (any && p < end && (*p == 'e' || *p == 'E')) {
+		const char *q = p + 1;
+		int eNeg = 0, e = 0, eAny = 0;
 
-	double xTmp, yTmp;
-	for (int row = 0; row < nrow; row++) {
-			int res = fscanf(pFile, "%lf %lf\n", &xTmp, &yTmp);
-			gsl_matrix_set(*y, row, 0, xTmp);
-			gsl_matrix_set(*y, row, 1, yTmp);
+		if (q < end && (*q == '-' || *q == '+'))
+			eNeg = *q++ == '-';
+		for (; q < end && *q >= '0' && *q <= '9'; q++, eAny = 1)
+			if (e < 100000)
+				e = 10 * e + (*q - '0');
+
+		if (eAny) {
+			exp10 += eNeg ? -e : e;
+			p = q;
+		}
 	}
 
-	fclose(pFile);
+	if (any && exact && m <= (1ULL << 53) && exp10 >= -22 && exp10 <= 22) {
+		double v = (double)m;
+		v = exp10 < 0 ? v / POW10[-exp10] : v * POW10[exp10];
+		*out = neg ? -v : v;
+		return p;
+	}
+
+	/* Slow path: strtod on a NUL-terminated copy of the token */
+	char token[LOAD_MAX_TOKEN];
+	char *tokenEnd;
+	size_t len;
+
+	if (!any)
+		for (p = start; p < end && *p != ' ' && *p != '\t' &&
+			*p != ',' && *p != '\r' && *p != '\n'; p++);
+
+	len = p - start;
+	if (len == 0 || len >= LOAD_MAX_TOKEN)
+		return NULL;
+
+	memcpy(token, start, len);
+	token[len] = '\0';
+	*out = strtod(token, &tokenEnd);
+	return tokenEnd == token + len ? p : NULL;
+}
+
+/**
+ * Report a malformed line and exit.
+ */
+static void fatal_line(const char *filename, long line, const char *what) {
+	char message[256];
+	snprintf(message, sizeof(message), "%s:%ld: %s", filename, line, what);
+	fatal(message);
+}
+
+/**
+ * Parse text measurements in one pass.
+ *
+ * @param filename Path to the file (for error messages).
+ * @param p The contents of the file.
+ * @param end Pointer past the end of the contents.
+ * @param y Pointer where the measurement matrix will be stored.
+ */
+static void parse_text(const char *filename, const char *p, const char *end,
+		gsl_matrix **y) {
+	size_t nValues = 0, capacity = LOAD_INITIAL_ROWS;
+	double *values = (double *)malloc(capacity * sizeof(double));
+	long line = 1;
+	int nCols = 0;
+
+	if (values == NULL)
+		fatal("couldn't allocate memory for the measurements");
+
+	while (p < end) {
+		int nRead = 0;
+
+		/* Skip blank lines */
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+			p++;
+		if (p < end && *p == '\n') {
+			p++;
+			line++;
+			continue;
+		}
+		if (p == end)
+			break;
+
+		/* Numbers up to the end of the line */
+		while (p < end && *p != '\n') {
+			if (nValues == capacity) {
+				capacity *= 2;
+				values = (double *)realloc(values, capacity *
+							sizeof(double));
+				if (values == NULL)
+					fatal("couldn't allocate memory for "
+							"the measurements");
+			}
+
+			p = parse_double(p, end, values + nValues);
+			if (p == NULL)
+				fatal_line(filename, line,
+						"expected a number");
+			nValues++;
+			nRead++;
+
+			while (p < end && (*p == ' ' || *p == '\t' ||
+						*p == '\r' || *p == ','))
+				p++;
+		}
+
+		/* The first row sets the number of sensors */
+		if (nCols == 0)
+			nCols = nRead;
+		if (nRead != nCols || nCols < 2)
+			fatal_line(filename, line, nCols < 2 ?
+				"expected at least two bearings per line" :
+				"expected as many bearings as the first line");
+	}
+
+	if (nValues == 0)
+		fatal("the measurement file has no rows");
+
+	*y = gsl_matrix_alloc(nValues / nCols, nCols);
+	memcpy((*y)->data, values, nValues * sizeof(double));
+	free(values);
+}
+
+/**
+ * Read measurements from a columnar file.
+ *
+ * @param buf The contents of the file.
+ * @param size The size of the contents in bytes.
+ * @param y Pointer where the measurement matrix will be stored.
+ * @param timestampsOut Pointer where the timestamps will be stored, or NULL
+ * if they aren't needed.
+ */
+static void read_columnar(const char *buf, size_t size, gsl_matrix **y,
+		gsl_vector **timestampsOut) {
+	columnar_head head;
+	int tCol, nSensors;
+
+	columnar_parse_header(buf, size, &head);
+
+	/* Angles are the columns other than "t", in order */
+	tCol = columnar_column(&head, "t");
+	nSensors = head.nCols - (tCol >= 0);
+	if (nSensors < 2)
+		fatal("a columnar measurement file needs at least two angle "
+					"columns and an optional \"t\" column");
+	if (head.nRows == 0)
+		fatal("the measurement file has no rows");
+
+	int angleCol[nSensors];
+	for (int j = 0, c = 0; c < (int)head.nCols; c++)
+		if (c != tCol)
+			angleCol[j++] = c;
+
+	*y = gsl_matrix_alloc(head.nRows, nSensors);
+	for (size_t i = 0; i < head.nRows; i++)
+		for (int j = 0; j < nSensors; j++)
+			gsl_matrix_set(*y, i, j,
+					columnar_get(&head, i, angleCol[j]));
+
+	if (timestampsOut != NULL && tCol >= 0) {
+		*timestampsOut = gsl_vector_alloc(head.nRows);
+		for (size_t i = 0; i < head.nRows; i++)
+			gsl_vector_set(*timestampsOut, i,
+					columnar_get(&head, i, tCol));
+	}
+}
+
+/**
+ * Read measurements from file.
+ *
+ * @param filename Path to the file with measurements, text or columnar.
+ * @param y Pointer where the measurement matrix, one column per sensor, will
+ * be stored.
+ * @param timestampsOut Pointer where the timestamps will be stored, or NULL
+ * if they aren't needed. It's set to NULL if the file has no timestamps
+ * (text files never do).
+ */
+void load_data(char *filename, gsl_matrix **y, gsl_vector **timestampsOut)
+{
+	size_t size;
+	const char *buf = map_file(filename, &size);
+
+	if (timestampsOut != NULL)
+		*timestampsOut = NULL;
+
+	if (columnar_is(buf, size))
+		read_columnar(buf, size, y, timestampsOut);
+	else
+		parse_text(filename, buf, buf + size, y);
+
+	unmap_file(buf, size);
 }
@@ -10,6 +10,6 @@
 #ifndef C_LOAD_H_
 #define C_LOAD_H_
 
-void load_data(char *filename, gsl_matrix **y);
+void load_data(char *filename, gsl_matrix **y, gsl_vector **timestampsOut);
 
-#endif /* C_INTERFACE_H_ */
+#endif /* C_LOAD_H_ */
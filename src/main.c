@@ -20,10 +20,27 @@
 
 /* Files */
 #define MEASUREMENT_FILE_IN "../R/data/measurements.txt"
-#define ESS_FILE_OUT "essOut.txt"
-#define WEIGHTS_FILE_OUT "wOut.txt"
-#define STATEMEAN_FILE_OUT "xMeanOut.txt"
-#define BASELINE_FILE_OUT "baselineOut.txt"
+
+#ifdef CSV_RESULTS
+#define RESULT_EXT ".txt"
+#define MAT_OUT(x, names, filename) GSL_MAT_TO_CSV(x, filename)
+#define VEC_OUT(x, name, filename) GSL_VEC_TO_CSV(x, filename)
+#else
+#define RESULT_EXT ".bin"
+#define MAT_OUT(x, names, filename) columnar_write_matrix(filename, x, names)
+#define VEC_OUT(x, name, filename) columnar_write_vector(filename, x, name)
+#endif
+
+#define ESS_FILE_OUT "essOut" RESULT_EXT
+#define WEIGHTS_FILE_OUT "wOut" RESULT_EXT
+#define STATEMEAN_FILE_OUT "xMeanOut" RESULT_EXT
+#define STATECOV_FILE_OUT "xCovOut" RESULT_EXT
+#define LOGLIK_FILE_OUT "logLikOut" RESULT_EXT
+#define QUANTILE_FILE_OUT "xQuantileOut" RESULT_EXT
+#define BASELINE_FILE_OUT "baselineOut" RESULT_EXT
+#define PARALLEL_FILE_OUT "parallelOut" RESULT_EXT
+#define SMOOTH_FILE_OUT "xSmoothOut" RESULT_EXT
+#define TRAJECTORY_FILE_OUT "trajectoriesOut" RESULT_EXT
 
 /* Measurement model constants */
 #define DT 1.0 /* Keep it double, will you? */
@@ -33,6 +50,12 @@
 #define LOCATION_2_Y  41.5576632356000f
 #define MEASUREMENT_ERROR_1 0.01;
 
+/* One row per sensor, in the order of the measurement columns */
+static const double SENSORS[][POSITION_DIM] = {
+	{LOCATION_1_X, LOCATION_1_Y},
+	{LOCATION_2_X, LOCATION_2_Y}
+};
+
 /* State model */
 #define STATE_DIFFUSION_1 0.0005
 #define STATE_DIFFUSION_2 0.0005
@@ -53,36 +76,98 @@
 
 /* Particle filter constants */
 #define NPARTICLES 100
+#define SEED 0
+#define NTHREADS 1
+#define RESAMPLE_SCHEME RESAMPLE_SYSTEMATIC
+#define ESS_THRESHOLD 0.5
+#define OUTPUT_LEVEL OUTPUT_SUMMARY
+#define SMOOTHER SMOOTHER_NONE
+#define LAG 20
+#define NTRAJECTORIES 10
+#define PROPOSAL PROPOSAL_LEGACY
+#define RAO_BLACKWELL 0 /* Marginalize the velocity, not with legacy */
+#define BEARING_TOL 0 /* radians, 0 for libm atan2, e.g. 1e-7 */
+#define COLLECT_STATS 0 /* Print timers and event counters to stderr */
+
+/* Tracing: set TRACE_FILE (e.g. "filter.trace") to write a record for each
+ * particle at every TRACE_EVERY-th step, decode with tools/tracedump */
+#define TRACE_FILE NULL
+#define TRACE_EVERY 1
+
+static const double QUANTILE_PROBS[] = {0.025, 0.5, 0.975};
+
+/* Column names of the results */
+static const char *const BASELINE_NAMES[] = {"x", "y"};
+static const char *const STATE_NAMES[] = {"px", "py", "vx", "vy"};
+static const char *const COV_NAMES[] = {
+	"px.px", "px.py", "px.vx", "px.vy", "py.px", "py.py", "py.vx", "py.vy",
+	"vx.px", "vx.py", "vx.vx", "vx.vy", "vy.px", "vy.py", "vy.vx", "vy.vy"
+};
+
+static const char *const TIMER_NAMES[] = {
+	"proposal", "weighting", "normalization", "moments", "resampling"
+};
+
+/**
+ * Print the statistics of a run.
+ *
+ * @param fp The output.
+ * @param st The statistics.
+ */
+static void print_stats(FILE *fp, const filter_stats *st) {
+	fprintf(fp, "Filter statistics (%i steps)\n", st->steps);
+	for (int j = 0; j < FILTER_N_TIMERS; j++)
+		fprintf(fp, "  %-14s % 12.6f s\n", TIMER_NAMES[j], st->time[j]);
+	fprintf(fp, "  weight underflows   % 10li\n", st->expUnderflow);
+	fprintf(fp, "  log-weight +Inf     % 10li\n", st->logOverflow);
+	fprintf(fp, "  log-weight -Inf/NaN % 10li\n", st->logInvalid);
+	fprintf(fp, "  vanished steps      % 10i\n", st->vanished);
+	fprintf(fp, "  resampling events   % 10i\n", st->resampled);
+	fprintf(fp, "  minimum ESS         % 10.2f (k = %i)\n", st->essMin,
+			st->essMinStep);
+}
 
 int main(int argc, char** argv)
 {
-	INITOUT()
-
 	/* Read data */
-	gsl_matrix* y = (gsl_matrix*)malloc(sizeof(gsl_matrix));
-	load_data(MEASUREMENT_FILE_IN, &y);
+	gsl_matrix *y;
+	gsl_vector *timestamps;
+	load_data(MEASUREMENT_FILE_IN, &y, &timestamps);
 	int T = y->size1;
 
+	/* The model assumes evenly spaced measurements */
+	if (timestamps != NULL)
+		for (int k = 1; k < T; k++) {
+			double dt = gsl_vector_get(timestamps, k) -
+					gsl_vector_get(timestamps, k - 1);
+			if (fabs(dt - DT) > 1e-6 * DT) {
+				warning("measurements are not evenly spaced by DT");
+				break;
+			}
+		}
+
 	/* Compute noiseless solution */
-	gsl_vector* location1 = gsl_vector_alloc(MEASUREMENT_DIM);
-	gsl_vector* location2 = gsl_vector_alloc(MEASUREMENT_DIM);
+	int nSensors = sizeof(SENSORS) / sizeof(SENSORS[0]);
+	gsl_matrix *sensors = gsl_matrix_alloc(nSensors, POSITION_DIM);
 
-	gsl_vector_set(location1, 0, LOCATION_1_X);
-	gsl_vector_set(location1, 1, LOCATION_1_Y);
-	gsl_vector_set(location2, 0, LOCATION_2_X);
-	gsl_vector_set(location2, 1, LOCATION_2_Y);
+	for (int s = 0; s < nSensors; s++) {
+		gsl_matrix_set(sensors, s, 0, SENSORS[s][0]);
+		gsl_matrix_set(sensors, s, 1, SENSORS[s][1]);
+	}
 
-	gsl_matrix *baseline = gsl_matrix_alloc(T, MEASUREMENT_DIM);
-	noiseless(y, location1, location2, baseline);
+	if ((int)y->size2 != nSensors)
+		fatal("the measurement file needs one column per sensor");
+
+	gsl_matrix *baseline = gsl_matrix_alloc(T, POSITION_DIM);
+	gsl_vector *parallel = gsl_vector_alloc(T);
+	if (noiseless(y, sensors, NTHREADS, baseline, parallel))
+		warning("some bearings are near-parallel, see " PARALLEL_FILE_OUT);
 
 	/* Initialize model */
 	model_param param;
 	param.baseline = baseline;
 	param.dt = DT;
-	param.l1x = LOCATION_1_X;
-	param.l1y = LOCATION_1_Y;
-	param.l2x = LOCATION_2_X;
-	param.l2y = LOCATION_2_Y;
+	param.sensors = sensors;
 	param.sr = MEASUREMENT_ERROR_1;
 
 	param.q1 = STATE_DIFFUSION_1;
@@ -105,33 +190,64 @@ int main(int argc, char** argv)
 	measurement_init(&param);
 
 	/* Run particle filter */
-	gsl_matrix *xMeanOut = gsl_matrix_alloc(T + 1, STATE_DIM);
-	gsl_matrix *wOut = gsl_matrix_alloc(T + 1, NPARTICLES);
-	gsl_vector* essOut = gsl_vector_alloc(T + 1);
-
-	filter(y, NPARTICLES, &param, &xMeanOut, &wOut, &essOut);
+	filter_opt opts;
+	opts.seed = SEED;
+	opts.nThreads = NTHREADS;
+	opts.resampleScheme = RESAMPLE_SCHEME;
+	opts.essThreshold = ESS_THRESHOLD;
+	opts.output = OUTPUT_LEVEL;
+	opts.nQuantiles = sizeof(QUANTILE_PROBS) / sizeof(QUANTILE_PROBS[0]);
+	opts.quantileProbs = QUANTILE_PROBS;
+	opts.smoother = SMOOTHER;
+	opts.lag = LAG;
+	opts.nTrajectories = NTRAJECTORIES;
+	opts.proposal = PROPOSAL;
+	opts.raoBlackwell = RAO_BLACKWELL;
+	opts.bearingTol = BEARING_TOL;
+	opts.stats = COLLECT_STATS;
+
+	trace_opt traceOpts;
+	traceOpts.filename = TRACE_FILE;
+	traceOpts.every = TRACE_EVERY;
+	traceOpts.nIndices = 0;
+	traceOpts.indices = NULL;
+	opts.trace = traceOpts.filename != NULL ? &traceOpts : NULL;
+
+	filter_result *res = filter_result_alloc(T, NPARTICLES, &opts);
+	filter(y, NPARTICLES, &param, &opts, res);
 
 	/* Write results to disk */
-	GSL_MAT_TO_CSV(baseline, BASELINE_FILE_OUT);
-	GSL_MAT_TO_CSV(xMeanOut, STATEMEAN_FILE_OUT);
-	GSL_MAT_TO_CSV(wOut, WEIGHTS_FILE_OUT);
-	GSL_VEC_TO_CSV(essOut, ESS_FILE_OUT);
+	MAT_OUT(baseline, BASELINE_NAMES, BASELINE_FILE_OUT);
+	VEC_OUT(parallel, "parallel", PARALLEL_FILE_OUT);
+	MAT_OUT(res->xMean, STATE_NAMES, STATEMEAN_FILE_OUT);
+	MAT_OUT(res->xCov, COV_NAMES, STATECOV_FILE_OUT);
+	VEC_OUT(res->ess, "ess", ESS_FILE_OUT);
+	VEC_OUT(res->logLik, "logLik", LOGLIK_FILE_OUT);
+	if (res->xQuantile != NULL)
+		MAT_OUT(res->xQuantile, NULL, QUANTILE_FILE_OUT);
+	if (res->w != NULL)
+		MAT_OUT(res->w, NULL, WEIGHTS_FILE_OUT);
+	if (res->xSmooth != NULL)
+		MAT_OUT(res->xSmooth, STATE_NAMES, SMOOTH_FILE_OUT);
+	if (res->trajectories != NULL)
+		MAT_OUT(res->trajectories, NULL, TRAJECTORY_FILE_OUT);
+	if (res->stats != NULL)
+		print_stats(stderr, res->stats);
 
 	/* Clean up */
-	gsl_matrix_free(xMeanOut);
-	gsl_matrix_free(wOut);
-	gsl_vector_free(essOut);
+	filter_result_free(res);
 
 	importance_free(&param);
 	state_free(&param);
 	measurement_free(&param);
 
-	gsl_vector_free(location2);
-	gsl_vector_free(location1);
+	gsl_matrix_free(sensors);
+	gsl_vector_free(parallel);
 	gsl_matrix_free(baseline);
-	free(y);
+	gsl_matrix_free(y);
+	if (timestamps != NULL)
+		gsl_vector_free(timestamps);
 
 	/* Say goodbye */
-	EXITOUT()
 	return EXIT_SUCCESS;
 }
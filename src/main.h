@@ -13,7 +13,7 @@
 
 /* particleawe settings */
 /* #define DEBUG */
-/* #define CSVOUT */
+/* #define CSV_RESULTS */ /* Write results as CSV instead of columnar */
 
 /* GLS Settings */
 #define GSL_RANGE_CHECK_OFF
@@ -42,56 +42,58 @@
 	fclose(fp);\
 } while(0)
 
-#ifdef CSVOUT
-
-FILE *outFile;
-#define HEADEROUT "k,i,importanceMu,importanceMu,importanceMu,importanceMu,importanceL,importanceL,importanceL,importanceL,importanceL,importanceL,importanceL,importanceL,importanceL,importanceL,importanceL,importanceL,importanceL,importanceL,importanceL,importanceL,importance_r,importance_r,importance_r,importance_r,yk,yk,measurementMu,measurementMu,measurementL,measurementL,measurementL,measurementL,measurement_lpdf,xk,xk,xk,xk,stateMu,stateMu,stateMu,stateMu,stateL,stateL,stateL,stateL,stateL,stateL,stateL,stateL,stateL,stateL,stateL,stateL,stateL,stateL,stateL,stateL,state_lpdf,xk,xk,xk,xk,xkm1,xkm1,xkm1,xkm1,importanceL,importanceL,importanceL,importanceL,importanceL,importanceL,importanceL,importanceL,importanceL,importanceL,importanceL,importanceL,importanceL,importanceL,importanceL,importanceL,importance_lpdf,lpdf1,lpdf2,lpdf3,wkm1i,logwkm1i,lognewweight,newweight,errno\n"
-#define INITOUT() outFile = fopen("filter.csv", "w");fprintf(outFile, HEADEROUT);
-#define EXITOUT() fclose(outFile);
-#define EOUT() fprintf(outFile, "\n"); // End of line
-#define SOUT(x) fprintf(outFile, "%s,", x);
-#define IOUT(x) fprintf(outFile, "%i,", x);
-#define DOUT(x) fprintf(outFile, "%.17g,", x); // https://stackoverflow.com/a/21162120/2860744
-#define VOUT(x) for(int tmpint = 0; tmpint < (x)->size; tmpint++) { DOUT(gsl_vector_get((x), tmpint)) }
-#define MOUT(x) for(int tmpint1 = 0; tmpint1 < (x)->size1; tmpint1++) { for(int tmpint2 = 0; tmpint2 < (x)->size2; tmpint2++) { DOUT(gsl_matrix_get((x), tmpint1, tmpint2)) } }
-
-#else
-
-#define EOUT() do {} while(0);
-#define INITOUT() do {} while(0);
-#define EXITOUT() do {} while(0);
-#define SOUT(x) do {} while(0);
-#define IOUT(x) do {} while(0);
-#define DOUT(x) do {} while(0);
-#define VOUT(x) do {} while(0);
-#define MOUT(x) do {} while(0);
-
-#endif
-
 /* Includes */
 
 #include <errno.h>
 #include <math.h>
+#include <pthread.h> /* pthread_create */
+#include <sched.h> /* sched_yield */
+#include <stdio.h> /* FILE, fwrite */
+#include <stdint.h> /* uint32_t, uint64_t */
 #include <stdlib.h> /* malloc, free */
 #include <string.h> /* strcpy */
+#include <time.h> /* clock_gettime */
 #include <unistd.h> /* getopt */
+#ifndef _WIN32
+#include <fcntl.h> /* open */
+#include <sys/mman.h> /* mmap, madvise */
+#include <sys/stat.h> /* fstat */
+#endif
+#ifdef _OPENMP
+#include <omp.h> /* omp_get_thread_num */
+#endif
+
+#ifdef USING_R
+#define R_NO_REMAP /* Keep our own fatal and warning */
+#include <R.h>
+#include <Rinternals.h> /* SEXP */
+#endif
 
 #include <gsl/gsl_blas.h>
 #include <gsl/gsl_blas_types.h>
+#include <gsl/gsl_errno.h> /* gsl_set_error_handler_off */
 #include <gsl/gsl_machine.h>
 #include <gsl/gsl_matrix.h>
 #include <gsl/gsl_linalg.h> /* gsl_linalg_cholesky_decomp */
-#include <gsl/gsl_rng.h>
-#include <gsl/gsl_randist.h>
-#include <gsl/gsl_sf_log.h>
-#include <gsl/gsl_sf_exp.h>
 #include <gsl/gsl_vector.h>
 
 #include "interface.h"
-#include "noiseless.h"
 #include "load.h"
+#include "columnar.h"
 #include "model.h"
 #include "tracking.h"
+#include "noiseless.h"
+#include "rng.h"
+#include "batch.h"
+#include "proposal.h"
+#include "rbpf.h"
+#include "resample.h"
+#include "trace.h"
 #include "filter.h"
+#include "smoother.h"
+#include "workspace.h"
+#include "fleet.h"
+#include "sweep.h"
+#include "pmmh.h"
 
 #endif /* C_MAIN_H_ */
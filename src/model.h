@@ -5,6 +5,10 @@
  * @details
  *
  * Struct holding the model parameters.
+ *
+ * NOTE: The struct is filled by the `*_init` functions and is read-only while
+ * the filter runs, so it can be shared by all threads. Scratch space lives
+ * with the caller.
  */
 
 #ifndef C_MODEL_H_
@@ -12,7 +16,10 @@
 
 typedef struct model_parameters {
 	/* Model constants */
-	double l1x, l1y, l2x, l2y, dt;
+	double dt;
+	const gsl_matrix *sensors; /**< nSensors x POSITION_DIM locations (x, y)
+						of the bearing sensors */
+	int nSensors; /**< Number of sensors, the measurement dimension */
 
 	/* State prior distributions */
 	gsl_vector *statepriorMu; /**< Location for initial state prior */
@@ -32,14 +39,26 @@ typedef struct model_parameters {
 	gsl_vector *stateMu; /**< Location for state model */
 	gsl_matrix *stateL; /**< Cholesky factor for state model */
 	gsl_matrix *stateTransition; /**< Transition matrix for state model */
-	gsl_vector *stateWork; /**< Work variable vector of size STATE_DIM */
 
 	/* Measurement model parameters */
 	double sr; /**< Standard deviation for measurement error */
-	gsl_vector *measurementMu; /**< Location for measurement model */
 	gsl_matrix *measurementL; /**< Cholesky factor for measurement model */
-	gsl_vector *measurementWork; /**< Work variable vector of size
-							MEASUREMENT_DIM */
+
+	/* Constants precomputed by the `*_init` functions. The kernels use
+	 * these instead of the factors above. Sizes are STATE_DIM (4) and
+	 * nSensors. */
+	double statepriorSd[4]; /**< Diagonal of statepriorL */
+	double importanceSd[4]; /**< Diagonal of importanceL */
+	double importanceInvSd[4]; /**< Inverse of the diagonal of importanceL */
+	double importanceLogNorm; /**< Log-normalizing constant, importance */
+	double stateLFactor[10]; /**< stateL, lower triangle by rows */
+	double stateLInv[10]; /**< Inverse of stateL, lower triangle by rows */
+	double stateLogNorm; /**< Log-normalizing constant, state model */
+	double *measurementInvSd; /**< Inverse of the diagonal of
+						measurementL */
+	double *sensorX, *sensorY; /**< Sensor locations, one array per
+						coordinate */
+	double measurementLogNorm; /**< Log-normalizing constant, measurement */
 } model_param;
 
 #endif /* C_MODEL_H_ */
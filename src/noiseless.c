@@ -6,67 +6,208 @@
  *
  * Implementation of the noiseless solution of the bearing-only tracking
  * problem.
+ *
+ * With two sensors, the noiseless solution is the intersection of the two
+ * bearing rays,
+ *
+ *   l1 + t1 * (cos a1, sin a1) = l2 + t2 * (cos a2, sin a2),
+ *
+ * a 2 x 2 linear system with determinant sin(a2 - a1), solved in closed form
+ * by Cramer's rule. With more sensors the bearing lines don't meet at one
+ * point, and the solution is the point closest to all of them in the least
+ * squares sense. Each bearing constrains the position p to the line through
+ * the sensor with normal n_s = (-sin a_s, cos a_s), i.e. n_s' (p - l_s) = 0,
+ * so p solves the 2 x 2 normal equations
+ *
+ *   (sum_s n_s n_s') p = sum_s n_s n_s' l_s,
+ *
+ * whose determinant is sum_{s < t} sin^2(a_t - a_s). For two sensors both are
+ * the same point. When all the bearings are (nearly) parallel the determinant
+ * vanishes and the solution is meaningless, so these steps are flagged and
+ * take a neighbouring solution instead.
  */
 
 #include "main.h"
+
+/**
+ * Intersect two bearing rays.
+ *
+ * @param a1 The bearing measured by the first sensor.
+ * @param a2 The bearing measured by the second sensor.
+ * @param l1x The x-coordinate of the first sensor.
+ * @param l1y The y-coordinate of the first sensor.
+ * @param dx The x-coordinate of the second sensor minus that of the first.
+ * @param dy The y-coordinate of the second sensor minus that of the first.
+ * @param x Pointer where the x-coordinate of the intersection will be stored.
+ * @param y Pointer where the y-coordinate of the intersection will be stored.
+ * @return 1 if the bearings are near-parallel (the intersection is then
+ * garbage), 0 otherwise.
+ */
+static inline int intersect(double a1, double a2, double l1x, double l1y,
+		double dx, double dy, double *x, double *y) {
+	double dx1 = cos(a1), dy1 = sin(a1);
+	double dx2 = cos(a2), dy2 = sin(a2);
+
+	/* det [dx1 -dx2; dy1 -dy2] = sin(a2 - a1) */
+	double det = dx1 * dy2 - dx2 * dy1;
+	double term = (dx * dy2 - dx2 * dy) / det;
+
+	*x = l1x + dx1 * term;
+	*y = l1y + dy1 * term;
+	return fabs(det) < NOISELESS_MIN_SIN;
+}
+
+/**
+ * Find the point closest to all bearing lines (three or more sensors).
+ *
+ * @param a The bearings, one per sensor.
+ * @param lx The x-coordinates of the sensors.
+ * @param ly The y-coordinates of the sensors.
+ * @param nSensors The number of sensors.
+ * @param x Pointer where the x-coordinate of the solution will be stored.
+ * @param y Pointer where the y-coordinate of the solution will be stored.
+ * @return 1 if all the bearings are near-parallel (the solution is then
+ * garbage), 0 otherwise.
+ */
+static inline int least_squares(const double *a, const double *lx,
+		const double *ly, int nSensors, double *x, double *y) {
+	double axx = 0, axy = 0, ayy = 0, bx = 0, by = 0;
+
+	/* NOTE: Coordinates are relative to the first sensor, the sensors
+	 * are much closer to each other than to the origin. */
+	for (int s = 0; s < nSensors; s++) {
+		double nx = -sin(a[s]), ny = cos(a[s]);
+		double c = nx * (lx[s] - lx[0]) + ny * (ly[s] - ly[0]);
+
+		axx += nx * nx;
+		axy += nx * ny;
+		ayy += ny * ny;
+		bx += nx * c;
+		by += ny * c;
+	}
+
+	double det = axx * ayy - axy * axy;
+
+	*x = lx[0] + (ayy * bx - axy * by) / det;
+	*y = ly[0] + (axx * by - axy * bx) / det;
+	return det < NOISELESS_MIN_SIN * NOISELESS_MIN_SIN;
+}
+
+/**
+ * Triangulate the position from the bearings of all sensors.
+ *
+ * @param a The bearings, one per sensor.
+ * @param lx The x-coordinates of the sensors.
+ * @param ly The y-coordinates of the sensors.
+ * @param nSensors The number of sensors, at least two.
+ * @param x Pointer where the x-coordinate of the solution will be stored.
+ * @param y Pointer where the y-coordinate of the solution will be stored.
+ * @return 1 if the bearings are near-parallel, 0 otherwise.
+ */
+static inline int triangulate(const double *a, const double *lx,
+		const double *ly, int nSensors, double *x, double *y) {
+	if (nSensors == 2)
+		return intersect(a[0], a[1], lx[0], ly[0], lx[1] - lx[0],
+						ly[1] - ly[0], x, y);
+	return least_squares(a, lx, ly, nSensors, x, y);
+}
+
 /**
  * Compute the noiseless solution of the bearing-only tracking problem.
  *
- * @param angles A 2-column matrix with the sensor measurements.
- * @param location1 A 2-element vector with the coordinates (x, y)
- * of the first sensor.
- * @param location2 A 2-element vector with the coordinates (x, y)
- * of the second sensor.
+ * Steps with near-parallel bearings are flagged and carry the previous
+ * solution forward (leading ones take the first valid solution).
+ *
+ * @param angles A matrix with the sensor measurements, one column per
+ * sensor.
+ * @param sensors A matrix with the coordinates (x, y) of one sensor per row.
+ * @param nThreads The number of threads (ignored without OpenMP).
  * @param solutionOut Pointer to the 2-column matrix where the solutions
  * will be stored.
+ * @param parallelOut Pointer to the vector where the flags (1 if the
+ * bearings are near-parallel, 0 otherwise) will be stored. May be NULL.
+ * @return The number of steps with near-parallel bearings.
  */
-void noiseless(gsl_matrix* angles, gsl_vector* location1,
-		gsl_vector* location2, gsl_matrix* solutionOut) {
-	/* Recover locations */
-	double l1x, l1y;
-	l1x = gsl_vector_get(location1, 0);
-	l1y = gsl_vector_get(location1, 1);
-
-	/* Allocate work matrices */
-	double a1, a2;
-	gsl_matrix* derivatives = gsl_matrix_alloc(MEASUREMENT_DIM,
-			MEASUREMENT_DIM);
-	gsl_vector* differences = gsl_vector_alloc(MEASUREMENT_DIM);
-	gsl_vector* tau = gsl_vector_alloc(MEASUREMENT_DIM); /**< QR factors */
-	gsl_vector* coefficients = gsl_vector_alloc(MEASUREMENT_DIM); /**< Solution x* of
-	linear system `derivatives * x = differences` */
-
-	/* Populate differences vector */
-	gsl_vector_set(differences, 0, gsl_vector_get(location2, 0) - l1x);
-	gsl_vector_set(differences, 1, gsl_vector_get(location2, 1) - l1y);
-
-	for (int k = 0; k < angles->size1; k++) { /* for each time step k */
-		/* Populate derivatives matrix
-		 * RECALL: gsl_matrix are stored in column order */
-		a1 = gsl_matrix_get(angles, k, 0);
-		a2 = gsl_matrix_get(angles, k, 1);
-		double dx1 = cos(a1);
-		double dy1 = sin(a1);
-
-		gsl_matrix_set(derivatives, 0, 0, dx1);
-		gsl_matrix_set(derivatives, 1, 0, dy1);
-		gsl_matrix_set(derivatives, 0, 1, cos(a2));
-		gsl_matrix_set(derivatives, 1, 1, sin(a2));
-
-		/* Solve linear system */
-		gsl_linalg_QR_decomp(derivatives, tau);
-		gsl_linalg_QR_solve(derivatives, tau, differences,
-								coefficients);
-
-		/* Write solutions */
-		double term = gsl_vector_get(coefficients, 0);
-		gsl_matrix_set(solutionOut, k, 0, l1x + dx1 * term);
-		gsl_matrix_set(solutionOut, k, 1, l1y + dy1 * term);
+int noiseless(const gsl_matrix *angles, const gsl_matrix *sensors,
+		int nThreads, gsl_matrix *solutionOut,
+		gsl_vector *parallelOut) {
+	const int T = angles->size1, nSensors = sensors->size1;
+	const size_t aStride = angles->tda, sStride = solutionOut->tda;
+	const double *a = angles->data;
+	double *s = solutionOut->data;
+	int nParallel = 0, first;
+
+	/* NOTE: Before the arrays below, sized by nSensors */
+	if (nSensors < 2 || (int)angles->size2 != nSensors)
+		fatal("the measurements need one column per sensor, and at "
+						"least two sensors");
+
+	double lx[nSensors], ly[nSensors];
+	unsigned char *flags = (unsigned char *)malloc(T > 0 ? T : 1);
+	if (flags == NULL)
+		fatal("couldn't allocate memory for the noiseless solution");
+
+	for (int j = 0; j < nSensors; j++) {
+		lx[j] = gsl_matrix_get(sensors, j, 0);
+		ly[j] = gsl_matrix_get(sensors, j, 1);
 	}
 
-	/* Clean up */
-	gsl_vector_free(coefficients);
-	gsl_vector_free(tau);
-	gsl_vector_free(differences);
-	gsl_matrix_free(derivatives);
+	/* Branch-free pass over all steps, chunked across threads */
+#pragma omp parallel for simd num_threads(nThreads) schedule(static) \
+	reduction(+:nParallel)
+	for (int k = 0; k < T; k++) {
+		flags[k] = triangulate(a + k * aStride, lx, ly, nSensors,
+				s + k * sStride, s + k * sStride + 1);
+		nParallel += flags[k];
+	}
+
+	/* Replace flagged steps with a neighbouring solution */
+	if (nParallel > 0) {
+		for (first = 0; first < T && flags[first]; first++);
+		if (first == T) {
+			free(flags);
+			fatal("all bearings are near-parallel, no noiseless "
+								"solution");
+		}
+
+		for (int k = 0; k < T; k++) {
+			int src = k < first ? first : k - 1;
+			if (flags[k]) {
+				s[k * sStride] = s[src * sStride];
+				s[k * sStride + 1] = s[src * sStride + 1];
+			}
+		}
+	}
+
+	if (parallelOut != NULL)
+		for (int k = 0; k < T; k++)
+			gsl_vector_set(parallelOut, k, flags[k]);
+
+	free(flags);
+	return nParallel;
+}
+
+/**
+ * Compute the noiseless solution for the bearings of a single step.
+ *
+ * Solves the same system as `noiseless`, with no allocations, so it can be
+ * called once per step on live data.
+ *
+ * @param ak Array of size nSensors with the bearings of this step.
+ * @param param The model parameters (sensor locations).
+ * @param solutionOut Array of size 2 where the solution (x, y) will be
+ * stored. Left untouched if the bearings are near-parallel.
+ * @return 1 if the bearings are near-parallel, 0 otherwise.
+ */
+int noiseless_step(const double *ak, const model_param *param,
+		double *solutionOut) {
+	double x, y;
+
+	if (triangulate(ak, param->sensorX, param->sensorY, param->nSensors,
+								&x, &y))
+		return 1;
+
+	solutionOut[0] = x;
+	solutionOut[1] = y;
+	return 0;
 }
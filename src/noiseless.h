@@ -10,7 +10,13 @@
 #ifndef C_NOISELESS_H_
 #define C_NOISELESS_H_
 
-void noiseless(gsl_matrix* angles, gsl_vector* location1,
-		gsl_vector* location2, gsl_matrix* solutionOut);
+/* Bearings with |sin(a2 - a1)| below this are treated as parallel. With more
+ * sensors, the bound applies to the root of sum_{s < t} sin^2(a_t - a_s). */
+#define NOISELESS_MIN_SIN 1e-6 /* double */
 
-#endif /* C_INTERFACE_H_ */
+int noiseless(const gsl_matrix *angles, const gsl_matrix *sensors,
+		int nThreads, gsl_matrix *solutionOut, gsl_vector *parallelOut);
+int noiseless_step(const double *ak, const model_param *param,
+		double *solutionOut);
+
+#endif /* C_NOISELESS_H_ */
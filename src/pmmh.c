@@ -0,0 +1,190 @@
+/**
+ * @file pmmh.c
+ * @authors Luis Damiano
+ * @version 0.1
+ * @details
+ *
+ * Particle marginal Metropolis-Hastings (PMMH) for the parameters sr, q1
+ * and q2 (Andrieu, Doucet & Holenstein 2010).
+ *
+ * The chain is a Gaussian random walk on the log of the parameters, so
+ * they stay positive, with independent normal priors on the same scale (or
+ * flat ones). The intractable likelihood in the acceptance ratio is replaced
+ * by the particle filter estimate of p(y_{1:T} | sr, q1, q2), which keeps the
+ * exact posterior as the target because the estimate is unbiased. That needs
+ * weights that match the draws, so the legacy proposal (see proposal.c) is
+ * rejected.
+ *
+ * One filter is allocated up front and restarted for every iteration (see
+ * `pf_reset`), with a fresh seed each time. The random walk draws come from
+ * the counter-based generator keyed by the same seed (see rng.c), so a run
+ * is reproducible regardless of the number of threads.
+ */
+
+#include "main.h"
+
+/**
+ * Evaluate the log-prior density (up to a constant) of a state.
+ *
+ * @param theta Array of size PMMH_NPARAM with the log of the parameters.
+ * @param mopts The sampler settings.
+ * @return The log-prior density.
+ */
+static double log_prior(const double *theta, const pmmh_opt *mopts) {
+	double lp = 0;
+
+	for (int j = 0; j < PMMH_NPARAM; j++) {
+		double sd = mopts->priorSd[j];
+		if (sd > 0 && isfinite(sd)) {
+			double u = (theta[j] - mopts->priorMean[j]) / sd;
+			lp -= 0.5 * u * u;
+		}
+	}
+
+	return lp;
+}
+
+/**
+ * Write a state into the model parameters and refresh their constants.
+ *
+ * @param theta Array of size PMMH_NPARAM with the log of the parameters.
+ * @param param The model parameters.
+ * @return GSL_SUCCESS, or the error of a factor that isn't positive definite
+ * (a parameter that underflowed to zero).
+ */
+static int set_params(const double *theta, model_param *param) {
+	int status;
+
+	param->sr = exp(theta[PMMH_SR]);
+	param->q1 = exp(theta[PMMH_Q1]);
+	param->q2 = exp(theta[PMMH_Q2]);
+
+	status = state_set(param);
+	if (status != GSL_SUCCESS)
+		return status;
+	return measurement_set(param);
+}
+
+/**
+ * Allocate the output of a PMMH run.
+ *
+ * @param nIter The number of iterations.
+ * @return Pointer to the new result. Free with `pmmh_result_free`.
+ */
+pmmh_result *pmmh_result_alloc(int nIter) {
+	pmmh_result *res = (pmmh_result *)malloc(sizeof(pmmh_result));
+	if (res == NULL)
+		fatal("couldn't allocate PMMH results");
+
+	res->chain = gsl_matrix_alloc(nIter, PMMH_NPARAM);
+	res->logLik = gsl_vector_alloc(nIter);
+	res->accepted = gsl_vector_alloc(nIter);
+	res->nAccepted = 0;
+
+	return res;
+}
+
+/**
+ * Free the output of a PMMH run.
+ *
+ * @param res The result.
+ */
+void pmmh_result_free(pmmh_result *res) {
+	gsl_vector_free(res->accepted);
+	gsl_vector_free(res->logLik);
+	gsl_matrix_free(res->chain);
+	free(res);
+}
+
+/**
+ * Sample from the posterior of sr, q1 and q2 by PMMH.
+ *
+ * @param y The measurements.
+ * @param nParticles The number of particles (MC samples) to use.
+ * @param init The model parameters. The chain starts at its sr, q1 and q2,
+ * the rest stay fixed. Read-only.
+ * @param opts The filter settings (seed, number of threads, resampling,
+ * proposal, any but the legacy one). Only summaries are computed.
+ * @param mopts The sampler settings.
+ * @param out The result where the chain will be stored (see
+ * `pmmh_result_alloc`).
+ */
+void pmmh(const gsl_matrix *y, int nParticles, const model_param *init,
+		const filter_opt *opts, const pmmh_opt *mopts,
+		pmmh_result *out) {
+	model_param param = *init;
+	filter_opt filterOpts = *opts;
+	double theta[PMMH_NPARAM], cand[PMMH_NPARAM], z[STATE_DIM], u;
+	double logLik, logPost, candLogLik, candLogPost;
+	int nVanished;
+
+	if (opts->proposal == PROPOSAL_LEGACY)
+		fatal("PMMH needs the bootstrap, baseline or optimal proposal");
+
+	filterOpts.output = OUTPUT_SUMMARY;
+
+	/* Own copies of the factors, refreshed at every iteration */
+	importance_init(&param);
+	state_init(&param);
+	measurement_init(&param);
+
+	pf_state *pf = pf_create(nParticles, &param, &filterOpts);
+	gsl_error_handler_t *handler = gsl_set_error_handler_off();
+
+	/* Initial state */
+	theta[PMMH_SR] = log(init->sr);
+	theta[PMMH_Q1] = log(init->q1);
+	theta[PMMH_Q2] = log(init->q2);
+
+	logLik = pf_run_quiet(pf, y, NULL);
+	nVanished = pf->nVanished;
+	logPost = logLik + log_prior(theta, mopts);
+	if (!isfinite(logLik))
+		warning("the log-likelihood of the initial state is not finite");
+
+	out->nAccepted = 0;
+	for (int it = 0; it < mopts->nIter; it++) {
+		int accept;
+
+		/* Propose */
+		rng_normals(opts->seed, RNG_PMMH_STEP, it, 0, 1, z);
+		rng_uniforms(opts->seed, RNG_PMMH_ACCEPT, it, 0, 1, &u);
+
+		for (int j = 0; j < PMMH_NPARAM; j++)
+			cand[j] = theta[j] + mopts->stepSd[j] * z[j];
+
+		/* Estimate the likelihood with fresh particles. A candidate
+		 * that underflowed has zero likelihood. */
+		candLogLik = -INFINITY;
+		if (set_params(cand, &param) == GSL_SUCCESS) {
+			pf_reset(pf, &param, opts->seed + it + 1);
+			candLogLik = pf_run_quiet(pf, y, NULL);
+			nVanished += pf->nVanished;
+		}
+		candLogPost = candLogLik + log_prior(cand, mopts);
+
+		/* Accept or reject. The random walk is symmetric on the log
+		 * scale, where the prior is defined, so there's no proposal
+		 * or Jacobian term. */
+		accept = isfinite(candLogPost) &&
+					log(u) < candLogPost - logPost;
+		if (accept) {
+			memcpy(theta, cand, sizeof(theta));
+			logLik = candLogLik;
+			logPost = candLogPost;
+			out->nAccepted++;
+		}
+
+		for (int j = 0; j < PMMH_NPARAM; j++)
+			gsl_matrix_set(out->chain, it, j, exp(theta[j]));
+		gsl_vector_set(out->logLik, it, logLik);
+		gsl_vector_set(out->accepted, it, accept);
+	}
+
+	gsl_set_error_handler(handler);
+	pf_warn_vanished(nVanished);
+	pf_destroy(pf);
+	importance_free(&param);
+	state_free(&param);
+	measurement_free(&param);
+}
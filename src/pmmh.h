@@ -0,0 +1,44 @@
+/**
+ * @file pmmh.h
+ * @authors Luis Damiano
+ * @version 0.1
+ * @details
+ *
+ * Header for the particle marginal Metropolis-Hastings sampler.
+ */
+
+#ifndef C_PMMH_H_
+#define C_PMMH_H_
+
+/* Sampled parameters, in this order (columns of the chain) */
+typedef enum pmmh_params {
+	PMMH_SR = 0, /**< Measurement error */
+	PMMH_Q1, /**< First diffusion constant */
+	PMMH_Q2, /**< Second diffusion constant */
+	PMMH_NPARAM /**< Number of sampled parameters */
+} pmmh_param;
+
+typedef struct pmmh_options {
+	int nIter; /**< Number of iterations */
+	double stepSd[PMMH_NPARAM]; /**< Random walk step on the log scale */
+	double priorMean[PMMH_NPARAM]; /**< Normal prior on the log scale */
+	double priorSd[PMMH_NPARAM]; /**< Prior sd, <= 0 or inf means flat */
+} pmmh_opt;
+
+/**
+ * The output of a run. One row per iteration.
+ */
+typedef struct pmmh_results {
+	gsl_matrix *chain; /**< nIter x PMMH_NPARAM states of the chain */
+	gsl_vector *logLik; /**< nIter log-likelihood estimates of the states */
+	gsl_vector *accepted; /**< nIter indicators, 1 if the move was taken */
+	int nAccepted; /**< Number of accepted moves */
+} pmmh_result;
+
+pmmh_result *pmmh_result_alloc(int nIter);
+void pmmh_result_free(pmmh_result *res);
+void pmmh(const gsl_matrix *y, int nParticles, const model_param *init,
+		const filter_opt *opts, const pmmh_opt *mopts,
+		pmmh_result *out);
+
+#endif /* C_PMMH_H_ */
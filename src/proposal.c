@@ -0,0 +1,226 @@
+/**
+ * @file proposal.c
+ * @authors Luis Damiano
+ * @version 0.1
+ * @details
+ *
+ * Proposal distributions: where the particles of a step are drawn from. Each
+ * proposal q draws a whole generation from the standard normals of the step
+ * and returns the log-density of every draw, so that the filter weighs them
+ * by
+ *
+ *   w_k = w_{k-1} p(y_k | x_k) f(x_k | x_{k-1}) / q(x_k | x_{k-1}, y_k)
+ *
+ * with f the state model centered at F x_{k-1} (see `batch_transition_lpdf`).
+ *
+ *   PROPOSAL	q(x_k | x_{k-1}, y_k)
+ *   bootstrap	f(x_k | x_{k-1}), so the weights are the likelihoods.
+ *   baseline	Position around the noiseless solution (importance factor),
+ *		velocity from f given that position and x_{k-1}, so the
+ *		velocity follows the particle instead of restarting at zero.
+ *   optimal	f(x_k | x_{k-1}) p(y_k | x_k) with the bearings linearized
+ *		at F x_{k-1}: a Gaussian per particle (Doucet et al., 2000).
+ *   legacy	Position around the noiseless solution, zero velocity.
+ *
+ * The legacy proposal is the default and keeps the results of earlier
+ * releases. Its draws and densities don't match: the filter weighs it with
+ * an importance density centered at x_{k-1} and a state model centered at
+ * the first noiseless solution (see `pf_phase_propagate`), so its weights
+ * are not those of a proper importance sampler.
+ *
+ * The baseline and optimal proposals read the densities of their draws off
+ * the standard normals, -0.5 |z|^2 plus the log-normalizing constant, which
+ * is exact and saves evaluating them again.
+ */
+
+#include "main.h"
+
+#define LOG_2PI 1.83787706640934548356 /* log(2 pi) */
+
+/**
+ * Draw a whole generation from the baseline proposal.
+ *
+ * The state model is independent across axes, so for each axis the velocity
+ * given the position is Gaussian with mean v_{k-1} + (Q_pv / Q_pp) (p_k -
+ * p_{k-1} - dt v_{k-1}) and variance Q_vv - Q_pv^2 / Q_pp.
+ */
+static void baseline_r(const double *z, const double *baselinek,
+		const particle_gen *xkm1, const model_param *param,
+		particle_gen *xOut, double *lpdf) {
+	const int n = xOut->n;
+	const double *l = param->stateLFactor;
+	const double dt = param->dt;
+	const double sx = param->importanceSd[0], sy = param->importanceSd[1];
+	const double bx = baselinek[0], by = baselinek[1];
+	/* Q = L L', lower triangle of L stored by rows */
+	const double qxx = l[0] * l[0];
+	const double qxv = l[3] * l[0];
+	const double qvv = l[3] * l[3] + l[4] * l[4] + l[5] * l[5];
+	const double qyy = l[1] * l[1] + l[2] * l[2];
+	const double qyv = l[6] * l[1] + l[7] * l[2];
+	const double qww = l[6] * l[6] + l[7] * l[7] + l[8] * l[8] +
+								l[9] * l[9];
+	const double gx = qxv / qxx, gy = qyv / qyy;
+	const double svx = sqrt(qvv - qxv * gx), svy = sqrt(qww - qyv * gy);
+	const double c = -2 * LOG_2PI - log(sx) - log(sy) - log(svx) -
+								log(svy);
+	const double *restrict z0 = z;
+	const double *restrict z1 = z + n;
+	const double *restrict z2 = z + 2 * n;
+	const double *restrict z3 = z + 3 * n;
+	const double *restrict cx = xkm1->px;
+	const double *restrict cy = xkm1->py;
+	const double *restrict cvx = xkm1->vx;
+	const double *restrict cvy = xkm1->vy;
+	double *restrict px = xOut->px;
+	double *restrict py = xOut->py;
+	double *restrict vx = xOut->vx;
+	double *restrict vy = xOut->vy;
+	double *restrict out = lpdf;
+
+	for (int i = 0; i < n; i++) {
+		px[i] = bx + sx * z0[i];
+		py[i] = by + sy * z1[i];
+		vx[i] = cvx[i] + gx * (px[i] - cx[i] - dt * cvx[i]) +
+								svx * z2[i];
+		vy[i] = cvy[i] + gy * (py[i] - cy[i] - dt * cvy[i]) +
+								svy * z3[i];
+		out[i] = c - 0.5 * (z0[i] * z0[i] + z1[i] * z1[i] +
+					z2[i] * z2[i] + z3[i] * z3[i]);
+	}
+}
+
+/**
+ * Draw a whole generation from the locally linearized optimal proposal.
+ *
+ * For each particle, the bearings are linearized at the predicted state
+ * m = F x_{k-1}, y_k ~ h(m) + H (x_k - m), which only involves the position.
+ * Conditioning the state model on them gives a Gaussian with precision
+ * J = Q^-1 + H' R^-1 H and mean m + J^-1 H' R^-1 (y_k - h(m)), the bearing
+ * errors wrapped. With J = U U' (Cholesky), a draw is its mean plus U'^-1 z.
+ */
+static void optimal_r(const double *z, const double *yk,
+		const particle_gen *xkm1, const model_param *param,
+		particle_gen *xOut, double *lpdf) {
+	const int n = xOut->n, nSensors = param->nSensors;
+	const double *m = param->stateLInv;
+	const double dt = param->dt;
+	double qInv[STATE_DIM][STATE_DIM];
+
+	/* Q^-1 = L^-1' L^-1, inverse stored by rows */
+	for (int r = 0; r < STATE_DIM; r++)
+		for (int c = 0; c <= r; c++) {
+			double s = 0;
+			for (int j = r; j < STATE_DIM; j++)
+				s += m[j * (j + 1) / 2 + r] *
+						m[j * (j + 1) / 2 + c];
+			qInv[r][c] = s;
+		}
+
+	for (int i = 0; i < n; i++) {
+		double mu[STATE_DIM], U[STATE_DIM][STATE_DIM];
+		double g[STATE_DIM] = {0, 0, 0, 0}, e[STATE_DIM], zz = 0;
+		double logDet = 0;
+
+		mu[0] = xkm1->px[i] + dt * xkm1->vx[i];
+		mu[1] = xkm1->py[i] + dt * xkm1->vy[i];
+		mu[2] = xkm1->vx[i];
+		mu[3] = xkm1->vy[i];
+
+		for (int r = 0; r < STATE_DIM; r++)
+			for (int c = 0; c <= r; c++)
+				U[r][c] = qInv[r][c];
+
+		/* H' R^-1 H and H' R^-1 (y - h(m)), position block only */
+		for (int s = 0; s < nSensors; s++) {
+			double dx = mu[0] - param->sensorX[s];
+			double dy = mu[1] - param->sensorY[s];
+			double r2 = dx * dx + dy * dy;
+			double is2 = param->measurementInvSd[s] *
+					param->measurementInvSd[s];
+			double h0, h1, u;
+
+			if (r2 == 0)
+				continue; /* The bearing isn't defined */
+
+			h0 = -dy / r2;
+			h1 = dx / r2;
+			u = yk[s] - atan2(dy, dx);
+			u = WRAP_ANGLE(u);
+
+			U[0][0] += is2 * h0 * h0;
+			U[1][0] += is2 * h1 * h0;
+			U[1][1] += is2 * h1 * h1;
+			g[0] += is2 * h0 * u;
+			g[1] += is2 * h1 * u;
+		}
+
+		/* J = U U', in place over the lower triangle */
+		for (int c = 0; c < STATE_DIM; c++) {
+			for (int j = 0; j < c; j++)
+				U[c][c] -= U[c][j] * U[c][j];
+			U[c][c] = sqrt(U[c][c]);
+			logDet += log(U[c][c]);
+			for (int r = c + 1; r < STATE_DIM; r++) {
+				for (int j = 0; j < c; j++)
+					U[r][c] -= U[r][j] * U[c][j];
+				U[r][c] /= U[c][c];
+			}
+		}
+
+		/* Mean: solve U U' d = g, then add U'^-1 z */
+		for (int r = 0; r < STATE_DIM; r++) {
+			for (int j = 0; j < r; j++)
+				g[r] -= U[r][j] * g[j];
+			g[r] /= U[r][r];
+		}
+		for (int r = STATE_DIM - 1; r >= 0; r--) {
+			e[r] = g[r] + z[r * n + i];
+			for (int j = r + 1; j < STATE_DIM; j++)
+				e[r] -= U[j][r] * e[j];
+			e[r] /= U[r][r];
+			zz += z[r * n + i] * z[r * n + i];
+		}
+
+		xOut->px[i] = mu[0] + e[0];
+		xOut->py[i] = mu[1] + e[1];
+		xOut->vx[i] = mu[2] + e[2];
+		xOut->vy[i] = mu[3] + e[3];
+		lpdf[i] = -0.5 * STATE_DIM * LOG_2PI + logDet - 0.5 * zz;
+	}
+}
+
+/**
+ * Draw a whole generation from a proposal and evaluate its log-density.
+ *
+ * @param type The proposal.
+ * @param z Array of size STATE_DIM * n with standard normals (see
+ * `rng_normals`).
+ * @param yk Array of size nSensors with the current measurement.
+ * @param baselinek Two-element array with the noiseless solution for the
+ * current time step.
+ * @param xkm1 The previous generation.
+ * @param param The model parameters.
+ * @param xOut Generation where the draws will be stored.
+ * @param lpdf Array of size n where the log-densities of the draws will be
+ * stored.
+ */
+void proposal_r(proposal_type type, const double *z, const double *yk,
+		const double *baselinek, const particle_gen *xkm1,
+		const model_param *param, particle_gen *xOut, double *lpdf) {
+	switch (type) {
+	case PROPOSAL_BOOTSTRAP:
+		batch_transition_r(z, xkm1, param, xOut);
+		batch_transition_lpdf(xOut, xkm1, param, lpdf);
+		break;
+	case PROPOSAL_BASELINE:
+		baseline_r(z, baselinek, xkm1, param, xOut, lpdf);
+		break;
+	case PROPOSAL_OPTIMAL:
+		optimal_r(z, yk, xkm1, param, xOut, lpdf);
+		break;
+	default:
+		batch_importance_r(z, baselinek, param, xOut);
+		batch_importance_lpdf(xOut, xkm1, param, lpdf);
+	}
+}
@@ -0,0 +1,25 @@
+/**
+ * @file proposal.h
+ * @authors Luis Damiano
+ * @version 0.1
+ * @details
+ *
+ * Proposal distributions for the Sequential Importance Resampling filter.
+ */
+
+#ifndef C_PROPOSAL_H_
+#define C_PROPOSAL_H_
+
+/* NOTE: Keep the order in sync with PROPOSALS in R/. */
+typedef enum proposal_types {
+	PROPOSAL_LEGACY = 0, /**< Noiseless solution with zero velocity */
+	PROPOSAL_BOOTSTRAP, /**< The state model */
+	PROPOSAL_BASELINE, /**< Noiseless position, state model velocity */
+	PROPOSAL_OPTIMAL /**< State model given the linearized bearings */
+} proposal_type;
+
+void proposal_r(proposal_type type, const double *z, const double *yk,
+		const double *baselinek, const particle_gen *xkm1,
+		const model_param *param, particle_gen *xOut, double *lpdf);
+
+#endif /* C_PROPOSAL_H_ */
@@ -0,0 +1,223 @@
+/**
+ * @file rbpf.c
+ * @authors Luis Damiano
+ * @version 0.1
+ * @details
+ *
+ * Rao-Blackwellized particle filter. The state model is linear-Gaussian and
+ * the bearings only depend on the position, so given the path of positions
+ * of a particle its velocity is Gaussian and follows a Kalman filter. The
+ * particles only sample the position, in two dimensions instead of four,
+ * and carry the mean of their velocity in the `vx` and `vy` arrays of their
+ * generation. The weighted mean of those is the estimate of the velocity,
+ * with less variance than the mean of sampled velocities.
+ *
+ * The axes are independent in the state model, so the Kalman filter runs
+ * per axis on scalars. Its variances and gains don't depend on the data:
+ * they are the same for every particle and live once in `rbpf_velocity`.
+ * Per axis, with velocity mean m and variance P after step k - 1:
+ *
+ *   p_k | p_{0:k-1}	~ N(p_{k-1} + dt m, S),	S = dt^2 P + Q_pp
+ *   m'		= m + K (p_k - p_{k-1} - dt m),	K = (dt P + Q_pv) / S
+ *   P'		= P + Q_vv - (dt P + Q_pv)^2 / S
+ *
+ * The positions are drawn by one of the proposals of proposal.c, in their
+ * two-dimensional form, and weighed with the predictive density above as
+ * the state model. The legacy proposal has no such form. FFBSi needs the
+ * transition density of the whole state and isn't available either; the
+ * fixed-lag smoother works on the velocity means.
+ */
+
+#include "main.h"
+
+#define LOG_2PI 1.83787706640934548356 /* log(2 pi) */
+
+/**
+ * Set the shared part of the velocity filter to the state prior.
+ *
+ * @param param The model parameters.
+ * @param rv The shared part of the velocity filter.
+ */
+void rbpf_init(const model_param *param, rbpf_velocity *rv) {
+	for (int a = 0; a < POSITION_DIM; a++) {
+		rv->var[a] = param->statepriorSd[2 + a] *
+						param->statepriorSd[2 + a];
+		rv->predVar[a] = 0;
+		rv->gain[a] = 0;
+	}
+}
+
+/**
+ * Start a step of the shared part of the velocity filter: compute the
+ * predictive variance and the gain of this step, then the variance after it.
+ *
+ * @param param The model parameters.
+ * @param rv The shared part of the velocity filter.
+ */
+void rbpf_advance(const model_param *param, rbpf_velocity *rv) {
+	const double dt = param->dt;
+	const double q[POSITION_DIM] = {param->q1, param->q2};
+
+	/* Same covariance as state_set */
+	for (int a = 0; a < POSITION_DIM; a++) {
+		double qpp = q[a] * dt * dt * dt / 3;
+		double qpv = q[a] * dt * dt / 2;
+		double qvv = q[a] * dt;
+		double P = rv->var[a];
+		double S = dt * dt * P + qpp, C = dt * P + qpv;
+
+		rv->predVar[a] = S;
+		rv->gain[a] = C / S;
+		rv->var[a] = P + qvv - C * C / S;
+	}
+}
+
+/**
+ * Draw the positions of one particle from the locally linearized optimal
+ * proposal (see `optimal_r` in proposal.c), centered at the predicted
+ * position pHat with variances S.
+ *
+ * @return The log-density of the draw.
+ */
+static double optimal_position(const double *pHat, const double *S,
+		const double *z, const double *yk, const model_param *param,
+		double *pOut) {
+	double j00 = 1 / S[0], j10 = 0, j11 = 1 / S[1];
+	double g0 = 0, g1 = 0, u00, u10, u11, w0, w1, e0, e1;
+
+	/* J = S^-1 + H' R^-1 H, g = H' R^-1 (y - h(pHat)) */
+	for (int s = 0; s < param->nSensors; s++) {
+		double dx = pHat[0] - param->sensorX[s];
+		double dy = pHat[1] - param->sensorY[s];
+		double r2 = dx * dx + dy * dy;
+		double is2 = param->measurementInvSd[s] *
+				param->measurementInvSd[s];
+		double h0, h1, u;
+
+		if (r2 == 0)
+			continue; /* The bearing isn't defined */
+
+		h0 = -dy / r2;
+		h1 = dx / r2;
+		u = yk[s] - atan2(dy, dx);
+		u = WRAP_ANGLE(u);
+
+		j00 += is2 * h0 * h0;
+		j10 += is2 * h1 * h0;
+		j11 += is2 * h1 * h1;
+		g0 += is2 * h0 * u;
+		g1 += is2 * h1 * u;
+	}
+
+	/* J = U U', solve U w = g, then U' e = w + z */
+	u00 = sqrt(j00);
+	u10 = j10 / u00;
+	u11 = sqrt(j11 - u10 * u10);
+	w0 = g0 / u00;
+	w1 = (g1 - u10 * w0) / u11;
+	e1 = (w1 + z[1]) / u11;
+	e0 = (w0 + z[0] - u10 * e1) / u00;
+
+	pOut[0] = pHat[0] + e0;
+	pOut[1] = pHat[1] + e1;
+
+	return -LOG_2PI + log(u00) + log(u11) -
+					0.5 * (z[0] * z[0] + z[1] * z[1]);
+}
+
+/**
+ * Draw the positions of a whole generation, evaluate their densities and
+ * update the velocity means.
+ *
+ * @param type The proposal of the positions, any but PROPOSAL_LEGACY.
+ * @param rv The shared part of the velocity filter, advanced to this step
+ * (see `rbpf_advance`).
+ * @param z Array of size STATE_DIM * n with standard normals (see
+ * `rng_normals`). Only the first two n are used.
+ * @param yk Array of size nSensors with the current measurement.
+ * @param baselinek Two-element array with the noiseless solution for the
+ * current time step.
+ * @param xkm1 The previous generation, with velocity means.
+ * @param param The model parameters.
+ * @param xOut Generation where the positions and the velocity means will be
+ * stored.
+ * @param lpdfState Array of size n where the predictive log-densities of the
+ * positions will be stored.
+ * @param lpdfProposal Array of size n where the log-densities of the draws
+ * will be stored.
+ */
+void rbpf_r(proposal_type type, const rbpf_velocity *rv, const double *z,
+		const double *yk, const double *baselinek,
+		const particle_gen *xkm1, const model_param *param,
+		particle_gen *xOut, double *lpdfState, double *lpdfProposal) {
+	const int n = xOut->n;
+	const double dt = param->dt;
+	const double sx = sqrt(rv->predVar[0]), sy = sqrt(rv->predVar[1]);
+	const double kx = rv->gain[0], ky = rv->gain[1];
+	const double c = -LOG_2PI - log(sx) - log(sy);
+	const double *restrict z0 = z;
+	const double *restrict z1 = z + n;
+	const double *restrict cx = xkm1->px;
+	const double *restrict cy = xkm1->py;
+	const double *restrict cvx = xkm1->vx;
+	const double *restrict cvy = xkm1->vy;
+	double *restrict px = xOut->px;
+	double *restrict py = xOut->py;
+	double *restrict vx = xOut->vx;
+	double *restrict vy = xOut->vy;
+	double *restrict lpdf2 = lpdfState;
+	double *restrict lpdf3 = lpdfProposal;
+
+	switch (type) {
+	case PROPOSAL_BASELINE: {
+		const double isx = param->importanceSd[0];
+		const double isy = param->importanceSd[1];
+		const double ci = -LOG_2PI - log(isx) - log(isy);
+
+		for (int i = 0; i < n; i++) {
+			px[i] = baselinek[0] + isx * z0[i];
+			py[i] = baselinek[1] + isy * z1[i];
+			lpdf3[i] = ci - 0.5 * (z0[i] * z0[i] + z1[i] * z1[i]);
+		}
+		break;
+	}
+	case PROPOSAL_OPTIMAL: {
+		const double S[POSITION_DIM] = {rv->predVar[0], rv->predVar[1]};
+
+		for (int i = 0; i < n; i++) {
+			double pHat[POSITION_DIM], p[POSITION_DIM];
+			double zi[POSITION_DIM];
+
+			pHat[0] = cx[i] + dt * cvx[i];
+			pHat[1] = cy[i] + dt * cvy[i];
+			zi[0] = z0[i];
+			zi[1] = z1[i];
+			lpdf3[i] = optimal_position(pHat, S, zi, yk, param, p);
+			px[i] = p[0];
+			py[i] = p[1];
+		}
+		break;
+	}
+	default: /* PROPOSAL_BOOTSTRAP (pf_reset rules out the legacy one) */
+		for (int i = 0; i < n; i++) {
+			px[i] = cx[i] + dt * cvx[i] + sx * z0[i];
+			py[i] = cy[i] + dt * cvy[i] + sy * z1[i];
+		}
+	}
+
+	/* Predictive density of the positions, then the Kalman update */
+	for (int i = 0; i < n; i++) {
+		double ex = px[i] - (cx[i] + dt * cvx[i]);
+		double ey = py[i] - (cy[i] + dt * cvy[i]);
+		double ux = ex / sx, uy = ey / sy;
+
+		lpdf2[i] = c - 0.5 * (ux * ux + uy * uy);
+		vx[i] = cvx[i] + kx * ex;
+		vy[i] = cvy[i] + ky * ey;
+	}
+
+	/* The bootstrap weights are the likelihoods */
+	if (type != PROPOSAL_BASELINE && type != PROPOSAL_OPTIMAL)
+		for (int i = 0; i < n; i++)
+			lpdf3[i] = lpdf2[i];
+}
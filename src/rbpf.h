@@ -0,0 +1,34 @@
+/**
+ * @file rbpf.h
+ * @authors Luis Damiano
+ * @version 0.1
+ * @details
+ *
+ * Rao-Blackwellized particle filter: particles over the position, a Kalman
+ * filter over the velocity.
+ */
+
+#ifndef C_RBPF_H_
+#define C_RBPF_H_
+
+/**
+ * The part of the velocity Kalman filter shared by all particles, per axis
+ * (x first). The velocity means are per particle (see rbpf.c).
+ */
+typedef struct rbpf_velocities {
+	double var[POSITION_DIM]; /**< Variance of the velocity given the
+			positions, after the last step */
+	double predVar[POSITION_DIM]; /**< Variance of the predicted
+			position of the step in progress */
+	double gain[POSITION_DIM]; /**< Gain of the velocity mean on the
+			position innovation of the step in progress */
+} rbpf_velocity;
+
+void rbpf_init(const model_param *param, rbpf_velocity *rv);
+void rbpf_advance(const model_param *param, rbpf_velocity *rv);
+void rbpf_r(proposal_type type, const rbpf_velocity *rv, const double *z,
+		const double *yk, const double *baselinek,
+		const particle_gen *xkm1, const model_param *param,
+		particle_gen *xOut, double *lpdfState, double *lpdfProposal);
+
+#endif /* C_RBPF_H_ */
@@ -0,0 +1,148 @@
+/**
+ * @file resample.c
+ * @authors Luis Damiano
+ * @version 0.1
+ * @details
+ *
+ * Resampling schemes for the Sequential Importance Resampling filter.
+ *
+ * Every scheme draws a sorted sequence of points in [0, 1) and walks it
+ * together with the cumulative weights, so each one runs in O(N) time and
+ * never sorts. The result is a vector of ancestor indices: new particle j is
+ * a copy of old particle ancestor[j]. See Douc, Cappe & Moulines (2005),
+ * "Comparison of resampling schemes for particle filtering".
+ */
+
+#include "main.h"
+
+/**
+ * Map sorted points in [0, wTotal) to ancestor indices.
+ *
+ * @param w The weights (need not be normalized).
+ * @param n The number of weights.
+ * @param u The m sorted points.
+ * @param m The number of points.
+ * @param ancestorOut Array of size m where the indices will be stored.
+ */
+static void inverse_cdf(const double *w, int n, const double *u, int m,
+		int *ancestorOut) {
+	double c = w[0];
+	int i = 0;
+
+	for (int j = 0; j < m; j++) {
+		/* NOTE: i < n - 1 guards against round-off in the cumulative
+		 * sum falling short of the last point. */
+		while (u[j] >= c && i < n - 1)
+			c += w[++i];
+		ancestorOut[j] = i;
+	}
+}
+
+/**
+ * Turn m + 1 uniforms into m sorted uniforms on [0, wTotal) via normalized
+ * exponential spacings.
+ *
+ * @param wTotal The upper bound of the interval.
+ * @param m The number of points.
+ * @param u Array of size m + 1 with uniforms in (0, 1). Overwritten with the
+ * points.
+ */
+static void sorted_uniforms(double wTotal, int m, double *u) {
+	double s = 0;
+
+	for (int j = 0; j < m + 1; j++) {
+		s += -log(u[j]);
+		u[j] = s;
+	}
+
+	for (int j = 0; j < m; j++)
+		u[j] *= wTotal / s;
+}
+
+/**
+ * Draw ancestor indices for a set of normalized weights.
+ *
+ * @param scheme The resampling scheme.
+ * @param w The n normalized weights.
+ * @param n The number of particles.
+ * @param work Work array of size RESAMPLE_WORK_SIZE(n). The first n + 1
+ * entries must hold uniforms in (0, 1) (see `rng_uniforms`); each scheme uses
+ * as many as it needs.
+ * @param ancestorOut Array of size n where the ancestor indices will be
+ * stored.
+ */
+void resample(resample_scheme scheme, const double *w, int n, double *work,
+		int *ancestorOut) {
+	int j, m;
+	double *u = work;
+
+	switch (scheme) {
+	case RESAMPLE_NONE:
+		for (j = 0; j < n; j++)
+			ancestorOut[j] = j;
+		break;
+
+	case RESAMPLE_SYSTEMATIC: {
+		double u0 = u[0];
+		for (j = 0; j < n; j++)
+			u[j] = (j + u0) / n;
+		inverse_cdf(w, n, u, n, ancestorOut);
+		break;
+	}
+
+	case RESAMPLE_STRATIFIED:
+		for (j = 0; j < n; j++)
+			u[j] = (j + u[j]) / n;
+		inverse_cdf(w, n, u, n, ancestorOut);
+		break;
+
+	case RESAMPLE_MULTINOMIAL:
+		sorted_uniforms(1.0, n, u);
+		inverse_cdf(w, n, u, n, ancestorOut);
+		break;
+
+	case RESAMPLE_RESIDUAL: {
+		/* (1) Deterministic part: floor(n w[i]) copies of i */
+		double *wResidual = work + n + 1;
+		double wTotal = 0;
+
+		m = 0;
+		for (int i = 0; i < n; i++) {
+			int copies = (int)floor(n * w[i]);
+			for (j = 0; j < copies && m < n; j++)
+				ancestorOut[m++] = i;
+			wResidual[i] = n * w[i] - copies;
+			wTotal += wResidual[i];
+		}
+
+		/* (2) Random part: multinomial on the residual weights */
+		if (m < n) {
+			sorted_uniforms(wTotal, n - m, u);
+			inverse_cdf(wResidual, n, u, n - m, ancestorOut + m);
+		}
+		break;
+	}
+
+	default:
+		fatal("unknown resampling scheme");
+	}
+}
+
+/**
+ * Copy the ancestors of each particle into another generation.
+ *
+ * @param from The generation to resample.
+ * @param ancestor Array of size n with the ancestor indices.
+ * @param to The generation where the copies will be stored. It must not
+ * overlap with `from`.
+ */
+void resample_gen(const particle_gen *from, const int *ancestor,
+		particle_gen *to) {
+	for (int j = 0; j < to->n; j++) {
+		int a = ancestor[j];
+		to->px[j] = from->px[a];
+		to->py[j] = from->py[a];
+		to->vx[j] = from->vx[a];
+		to->vy[j] = from->vy[a];
+	}
+}
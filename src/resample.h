@@ -0,0 +1,29 @@
+/**
+ * @file resample.h
+ * @authors Luis Damiano
+ * @version 0.1
+ * @details
+ *
+ * Resampling schemes for the Sequential Importance Resampling filter.
+ */
+
+#ifndef C_RESAMPLE_H_
+#define C_RESAMPLE_H_
+
+/* NOTE: Keep the order in sync with RESAMPLING_SCHEMES in R/. */
+typedef enum resample_schemes {
+	RESAMPLE_NONE = 0, /**< Never resample */
+	RESAMPLE_SYSTEMATIC, /**< One uniform shared by all strata */
+	RESAMPLE_STRATIFIED, /**< One uniform per stratum */
+	RESAMPLE_RESIDUAL, /**< Deterministic copies + multinomial residual */
+	RESAMPLE_MULTINOMIAL /**< N independent draws */
+} resample_scheme;
+
+#define RESAMPLE_WORK_SIZE(n) (2 * (n) + 1) /* doubles */
+
+void resample(resample_scheme scheme, const double *w, int n, double *work,
+		int *ancestorOut);
+void resample_gen(const particle_gen *from, const int *ancestor,
+		particle_gen *to);
+
+#endif /* C_RESAMPLE_H_ */
@@ -0,0 +1,145 @@
+/**
+ * @file rng.c
+ * @authors Luis Damiano
+ * @version 0.1
+ * @details
+ *
+ * Counter-based random number generation for the particle filter.
+ *
+ * Draws come from Philox4x32-10 (Salmon et al. 2011, "Parallel random
+ * numbers: as easy as 1, 2, 3"), a keyed bijection of a 128-bit counter. The
+ * key is the seed and the counter is (index, step, purpose, 0), so the draws
+ * for any particle at any step can be generated on their own, in any order,
+ * on any thread. There's no generator state to carry, split or seed per
+ * block.
+ *
+ * One Philox call yields four 32-bit words, which become four uniforms and,
+ * via Box-Muller, four standard normals: exactly STATE_DIM per particle.
+ * Counters are independent of each other, so the loops below carry no
+ * dependency between particles and the compiler is free to vectorize them.
+ *
+ * NOTE: Uniforms have 32-bit resolution and lie in (0, 1), so Box-Muller
+ * normals are bounded by sqrt(-2 log(2^-33)) ~ 6.8 in absolute value.
+ */
+
+#include "main.h"
+
+#define PHILOX_M0 0xD2511F53U
+#define PHILOX_M1 0xCD9E8D57U
+#define PHILOX_W0 0x9E3779B9U
+#define PHILOX_W1 0xBB67AE85U
+
+#define TWO_POW_M32 2.3283064365386962890625e-10 /* 2^-32 */
+
+/**
+ * Apply Philox4x32-10 to a counter.
+ *
+ * @param c The counter. Overwritten with the four output words.
+ * @param k0 The low half of the key.
+ * @param k1 The high half of the key.
+ */
+static inline void philox4x32(uint32_t *c, uint32_t k0, uint32_t k1) {
+	for (int round = 0; round < 10; round++) {
+		uint64_t p0 = (uint64_t)PHILOX_M0 * c[0];
+		uint64_t p1 = (uint64_t)PHILOX_M1 * c[2];
+		uint32_t c1 = c[1], c3 = c[3];
+
+		c[0] = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+		c[1] = (uint32_t)p1;
+		c[2] = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+		c[3] = (uint32_t)p0;
+
+		k0 += PHILOX_W0;
+		k1 += PHILOX_W1;
+	}
+}
+
+/**
+ * Draw four uniforms in (0, 1) per index, component-major.
+ *
+ * @param seed The seed of the run.
+ * @param purpose What the draws are for.
+ * @param step The time step.
+ * @param i0 The first index.
+ * @param n The number of indices.
+ * @param uOut Array of size 4 * n. Word j of index i0 + i is stored at
+ * uOut[j * n + i].
+ */
+static void philox_block(unsigned long seed, rng_purpose purpose, int step,
+		int i0, int n, double *uOut) {
+	const uint32_t k0 = (uint32_t)seed;
+	const uint32_t k1 = (uint32_t)((unsigned long long)seed >> 32);
+	double *restrict u0 = uOut;
+	double *restrict u1 = uOut + n;
+	double *restrict u2 = uOut + 2 * n;
+	double *restrict u3 = uOut + 3 * n;
+
+	for (int i = 0; i < n; i++) {
+		uint32_t c[4] = {
+			(uint32_t)(i0 + i), (uint32_t)step, (uint32_t)purpose, 0
+		};
+		philox4x32(c, k0, k1);
+
+		u0[i] = (c[0] + 0.5) * TWO_POW_M32;
+		u1[i] = (c[1] + 0.5) * TWO_POW_M32;
+		u2[i] = (c[2] + 0.5) * TWO_POW_M32;
+		u3[i] = (c[3] + 0.5) * TWO_POW_M32;
+	}
+}
+
+/**
+ * Draw STATE_DIM standard normals for each of a range of particles.
+ *
+ * @param seed The seed of the run.
+ * @param purpose What the draws are for.
+ * @param step The time step.
+ * @param i0 The index of the first particle.
+ * @param n The number of particles.
+ * @param zOut Array of size STATE_DIM * n. Component j of particle i0 + i is
+ * stored at zOut[j * n + i].
+ */
+void rng_normals(unsigned long seed, rng_purpose purpose, int step, int i0,
+		int n, double *zOut) {
+	double *restrict z0 = zOut;
+	double *restrict z1 = zOut + n;
+	double *restrict z2 = zOut + 2 * n;
+	double *restrict z3 = zOut + 3 * n;
+
+	philox_block(seed, purpose, step, i0, n, zOut);
+
+	/* Box-Muller: (u0, u1) -> (z0, z1) and (u2, u3) -> (z2, z3) */
+	for (int i = 0; i < n; i++) {
+		double r0 = sqrt(-2 * log(z0[i])), t0 = 2 * M_PI * z1[i];
+		double r1 = sqrt(-2 * log(z2[i])), t1 = 2 * M_PI * z3[i];
+
+		z0[i] = r0 * cos(t0);
+		z1[i] = r0 * sin(t0);
+		z2[i] = r1 * cos(t1);
+		z3[i] = r1 * sin(t1);
+	}
+}
+
+/**
+ * Draw uniforms in (0, 1).
+ *
+ * @param seed The seed of the run.
+ * @param purpose What the draws are for.
+ * @param step The time step.
+ * @param i0 The index of the first uniform.
+ * @param n The number of uniforms.
+ * @param uOut Array of size n where the uniforms will be stored.
+ */
+void rng_uniforms(unsigned long seed, rng_purpose purpose, int step, int i0,
+		int n, double *uOut) {
+	const uint32_t k0 = (uint32_t)seed;
+	const uint32_t k1 = (uint32_t)((unsigned long long)seed >> 32);
+
+	/* Uniform j is word j % 4 of counter j / 4 */
+	for (int j = i0; j < i0 + n; ) {
+		uint32_t c[4] = {(uint32_t)(j / 4), (uint32_t)step,
+						(uint32_t)purpose, 0};
+		philox4x32(c, k0, k1);
+		for (int w = j % 4; w < 4 && j < i0 + n; w++, j++)
+			uOut[j - i0] = (c[w] + 0.5) * TWO_POW_M32;
+	}
+}
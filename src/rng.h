@@ -0,0 +1,28 @@
+/**
+ * @file rng.h
+ * @authors Luis Damiano
+ * @version 0.1
+ * @details
+ *
+ * Counter-based random number generation (Philox4x32-10).
+ */
+
+#ifndef C_RNG_H_
+#define C_RNG_H_
+
+/* NOTE: The purpose is part of the counter, so draws made for different
+ * purposes at the same (step, index) never overlap. */
+typedef enum rng_purposes {
+	RNG_PROPOSAL = 0, /**< Normals for the prior and importance draws */
+	RNG_RESAMPLE, /**< Uniforms for resampling */
+	RNG_PMMH_STEP, /**< Normals for the PMMH random walk */
+	RNG_PMMH_ACCEPT, /**< Uniforms for the PMMH acceptance test */
+	RNG_BACKWARD /**< Uniforms for backward simulation (FFBSi) */
+} rng_purpose;
+
+void rng_normals(unsigned long seed, rng_purpose purpose, int step, int i0,
+		int n, double *zOut);
+void rng_uniforms(unsigned long seed, rng_purpose purpose, int step, int i0,
+		int n, double *uOut);
+
+#endif /* C_RNG_H_ */
@@ -0,0 +1,433 @@
+/**
+ * @file smoother.c
+ * @authors Luis Damiano
+ * @version 0.1
+ * @details
+ *
+ * Particle smoothers run along the filter (see `pf_run`).
+ *
+ * Fixed-lag smoother: the estimate of x_s is taken at step s + lag, from the
+ * weighted particles of that step traced back along their ancestry. Only the
+ * last lag + 1 generations and their ancestor indices are kept, in a circular
+ * window, so memory is O(N lag) instead of O(N T).
+ *
+ * FFBSi (forward filtering, backward simulation, Godsill, Doucet & West
+ * 2004): the filter streams every weighted generation to a temporary file.
+ * At the end, M trajectories are drawn backwards in time: x_T from the last
+ * filtering weights, then each x_k from the generation of step k reweighted
+ * by the transition density towards the x_{k+1} already drawn. Time is
+ * O(M N T), memory O(N + M T) plus the file.
+ *
+ * Positions are shifted by a reference particle before averaging, as in
+ * `pf_step`, to avoid cancellation against the large coordinates.
+ */
+
+#include "main.h"
+
+/** FIRST PART: FIXED-LAG SMOOTHER ----------------------------------------- */
+
+/**
+ * Window slot of a time step.
+ */
+static int slot(const smoother_state *sm, int k) {
+	return (k - 1) % sm->nSlots;
+}
+
+/**
+ * Compute the smoothed mean of x_s from the weights of step k >= s.
+ *
+ * @param sm The smoother.
+ * @param w The normalized weights of step k.
+ * @param k The step the weights belong to.
+ * @param s The step to estimate, with k - s <= lag.
+ * @param out The result where the mean will be stored, row s - 1 of
+ * `xSmooth`.
+ */
+static void lag_mean(smoother_state *sm, const double *w, int k, int s,
+		filter_result *out) {
+	const int n = sm->nParticles;
+	int *lineage = sm->lineage;
+	const particle_gen *x = sm->window[slot(sm, s)];
+	double ref[STATE_DIM] = {0, 0, 0, 0};
+	double mean[STATE_DIM] = {0, 0, 0, 0};
+
+	/* Trace the particles of step k back to step s */
+	for (int i = 0; i < n; i++)
+		lineage[i] = i;
+
+	for (int m = k - 1; m >= s; m--) {
+		const int *a = sm->ancestor[slot(sm, m)];
+		for (int i = 0; i < n; i++)
+			lineage[i] = a[lineage[i]];
+	}
+
+	/* Shift by a particle with weight: the state of those without (e.g.
+	 * dropped for a NaN log-weight, see filter.c) may not be finite */
+	for (int i = 0; i < n; i++)
+		if (w[i] != 0) {
+			ref[0] = x->px[lineage[i]];
+			ref[1] = x->py[lineage[i]];
+			break;
+		}
+
+	for (int i = 0; i < n; i++) {
+		int j = lineage[i];
+		if (w[i] == 0)
+			continue;
+		mean[0] += w[i] * (x->px[j] - ref[0]);
+		mean[1] += w[i] * (x->py[j] - ref[1]);
+		mean[2] += w[i] * x->vx[j];
+		mean[3] += w[i] * x->vy[j];
+	}
+
+	for (int j = 0; j < STATE_DIM; j++)
+		filter_result_set(out, out->xSmooth, s - 1, j,
+						ref[j] + mean[j]);
+}
+
+/**
+ * Store the last step in the window and emit the estimate that became
+ * available.
+ */
+static void lag_update(smoother_state *sm, const pf_state *pf,
+		filter_result *out) {
+	const int n = sm->nParticles, k = pf->k;
+	const particle_gen *xk = pf_generation(pf);
+	particle_gen *x = sm->window[slot(sm, k)];
+	int *a = sm->ancestor[slot(sm, k)];
+
+	memcpy(x->px, xk->px, n * sizeof(double));
+	memcpy(x->py, xk->py, n * sizeof(double));
+	memcpy(x->vx, xk->vx, n * sizeof(double));
+	memcpy(x->vy, xk->vy, n * sizeof(double));
+
+	if (pf->resampled)
+		memcpy(a, pf->ancestor, n * sizeof(int));
+	else
+		for (int i = 0; i < n; i++)
+			a[i] = i;
+
+	if (k > sm->lag)
+		lag_mean(sm, pf->w, k, k - sm->lag, out);
+}
+
+/**
+ * Emit the estimates of the last lag steps from the final weights.
+ */
+static void lag_finish(smoother_state *sm, const pf_state *pf,
+		filter_result *out) {
+	const int T = pf->k;
+
+	for (int s = T - sm->lag + 1 > 1 ? T - sm->lag + 1 : 1; s <= T; s++)
+		lag_mean(sm, pf->w, T, s, out);
+}
+
+/** SECOND PART: BACKWARD SIMULATION (FFBSi) ------------------------------- */
+
+/**
+ * Evaluate the transition log-density from particle i of a generation to a
+ * given state, up to a constant.
+ *
+ * NOTE: Under the legacy proposal the state model used by `pf_step` is
+ * centered at `stateMu` whatever the previous state, so this kernel is flat
+ * in i and the backward weights reduce to the filtering weights. The other
+ * proposals weigh with the state model centered at F x_{k-1} (see
+ * proposal.c), and so does this kernel.
+ *
+ * @param pf The filter (for the model and the location of the state model).
+ * @param x The generation of step k.
+ * @param i The particle index.
+ * @param xNext Array of size STATE_DIM with the state at step k + 1.
+ * @return The log-density.
+ */
+static double transition_lpdf(const pf_state *pf, const particle_gen *x,
+		int i, const double *xNext) {
+	const double *m = pf->param->stateLInv;
+	const double dt = pf->param->dt;
+	double mu[STATE_DIM], d[STATE_DIM], u[STATE_DIM];
+
+	if (pf->opts.proposal == PROPOSAL_LEGACY) {
+		for (int j = 0; j < STATE_DIM; j++)
+			mu[j] = pf->stateMu[j];
+	} else {
+		mu[0] = x->px[i] + dt * x->vx[i];
+		mu[1] = x->py[i] + dt * x->vy[i];
+		mu[2] = x->vx[i];
+		mu[3] = x->vy[i];
+	}
+
+	for (int j = 0; j < STATE_DIM; j++)
+		d[j] = xNext[j] - mu[j];
+
+	/* u = L^-1 (x - mu), lower triangle stored by rows */
+	u[0] = m[0] * d[0];
+	u[1] = m[1] * d[0] + m[2] * d[1];
+	u[2] = m[3] * d[0] + m[4] * d[1] + m[5] * d[2];
+	u[3] = m[6] * d[0] + m[7] * d[1] + m[8] * d[2] + m[9] * d[3];
+
+	return -0.5 * (u[0] * u[0] + u[1] * u[1] + u[2] * u[2] + u[3] * u[3]);
+}
+
+/**
+ * Draw an index from unnormalized weights by inversion.
+ *
+ * @param w Array of size n with the weights.
+ * @param n The number of weights.
+ * @param total The sum of the weights.
+ * @param u A uniform in (0, 1).
+ * @return The index.
+ */
+static int draw_index(const double *w, int n, double total, double u) {
+	double c = 0, target = u * total;
+	int i = 0;
+
+	/* NOTE: i < n - 1 guards against round-off in the cumulative sum */
+	while (i < n - 1 && c + w[i] < target)
+		c += w[i++];
+
+	return i;
+}
+
+/**
+ * Read the record of step k from the temporary file.
+ */
+static void read_record(smoother_state *sm, int k, particle_gen *x,
+		double *w) {
+	const size_t n = sm->nParticles;
+
+	if (fseek(sm->fp, (k - 1) * sm->recordSize, SEEK_SET) != 0 ||
+			fread(x->px, sizeof(double), n, sm->fp) != n ||
+			fread(x->py, sizeof(double), n, sm->fp) != n ||
+			fread(x->vx, sizeof(double), n, sm->fp) != n ||
+			fread(x->vy, sizeof(double), n, sm->fp) != n ||
+			fread(w, sizeof(double), n, sm->fp) != n)
+		fatal("couldn't read the smoother temporary file");
+}
+
+/**
+ * Append the last step to the temporary file.
+ */
+static void backward_update(smoother_state *sm, const pf_state *pf) {
+	const size_t n = sm->nParticles;
+	const particle_gen *xk = pf_generation(pf);
+
+	if (fwrite(xk->px, sizeof(double), n, sm->fp) != n ||
+			fwrite(xk->py, sizeof(double), n, sm->fp) != n ||
+			fwrite(xk->vx, sizeof(double), n, sm->fp) != n ||
+			fwrite(xk->vy, sizeof(double), n, sm->fp) != n ||
+			fwrite(pf->w, sizeof(double), n, sm->fp) != n)
+		fatal("couldn't write the smoother temporary file");
+}
+
+/**
+ * Draw the trajectories backwards in time.
+ */
+static void backward_finish(smoother_state *sm, const pf_state *pf,
+		filter_result *out) {
+	const int n = sm->nParticles, M = sm->nTrajectories, T = pf->k;
+	particle_gen *x = particle_gen_alloc(n);
+	double *w = (double *)malloc(n * sizeof(double));
+	double *bw = (double *)malloc(n * sizeof(double));
+	double *u = (double *)malloc(M * sizeof(double));
+	double *cur = (double *)malloc(M * STATE_DIM * sizeof(double));
+
+	if (w == NULL || bw == NULL || u == NULL || cur == NULL)
+		fatal("couldn't allocate smoother work arrays");
+
+	fflush(sm->fp);
+
+	for (int k = T; k >= 1; k--) {
+		read_record(sm, k, x, w);
+		rng_uniforms(pf->opts.seed, RNG_BACKWARD, k, 0, M, u);
+
+		for (int m = 0; m < M; m++) {
+			double *xm = cur + m * STATE_DIM;
+			double total = 0, lbwMax = -INFINITY;
+			const double *bwk = w;
+			int i;
+
+			/* Backward weights w_k^i f(x_{k+1} | x_k^i), none
+			 * for particles without weight */
+			if (k < T) {
+				for (i = 0; i < n; i++) {
+					bw[i] = w[i] == 0 ? -INFINITY :
+						log(w[i]) + transition_lpdf(pf,
+								x, i, xm);
+					if (bw[i] > lbwMax)
+						lbwMax = bw[i];
+				}
+				for (i = 0; i < n; i++)
+					bw[i] = w[i] == 0 ? 0 :
+						exp(bw[i] - lbwMax);
+				bwk = bw;
+			}
+
+			for (i = 0; i < n; i++)
+				total += bwk[i];
+
+			i = draw_index(bwk, n, total, u[m]);
+			xm[0] = x->px[i];
+			xm[1] = x->py[i];
+			xm[2] = x->vx[i];
+			xm[3] = x->vy[i];
+		}
+
+		/* Store the trajectories and their mean */
+		double mean[STATE_DIM] = {0, 0, 0, 0};
+		for (int m = 0; m < M; m++)
+			for (int j = 0; j < STATE_DIM; j++) {
+				double v = cur[m * STATE_DIM + j];
+				mean[j] += v - cur[j];
+				if (out->trajectories != NULL)
+					filter_result_set(out,
+						out->trajectories, k - 1,
+						m * STATE_DIM + j, v);
+			}
+
+		for (int j = 0; j < STATE_DIM; j++)
+			filter_result_set(out, out->xSmooth, k - 1, j,
+						cur[j] + mean[j] / M);
+	}
+
+	free(cur);
+	free(u);
+	free(bw);
+	free(w);
+	particle_gen_free(x);
+}
+
+/** THIRD PART: INTERFACE -------------------------------------------------- */
+
+/**
+ * Create the smoother set in the filter options.
+ *
+ * @param pf The filter, at k = 0.
+ * @param T The number of time steps.
+ * @return Pointer to the new smoother. Free with `smoother_destroy`.
+ */
+smoother_state *smoother_create(const pf_state *pf, int T) {
+	const int n = pf->nParticles;
+	smoother_state *sm = (smoother_state *)malloc(sizeof(smoother_state));
+	if (sm == NULL)
+		fatal("couldn't allocate the smoother");
+
+	sm->type = pf->opts.smoother;
+	sm->nParticles = n;
+	sm->T = T;
+	sm->lag = 0;
+	sm->nSlots = 0;
+	sm->window = NULL;
+	sm->ancestor = NULL;
+	sm->lineage = NULL;
+	sm->fp = NULL;
+	sm->recordSize = 0;
+	sm->nTrajectories = 0;
+
+	switch (sm->type) {
+	case SMOOTHER_FIXED_LAG:
+		if (pf->opts.lag < 1)
+			fatal("the lag of the smoother must be positive");
+
+		/* No point in a window longer than the series */
+		sm->lag = pf->opts.lag < T ? pf->opts.lag : T;
+		sm->nSlots = sm->lag + 1;
+		sm->window = (particle_gen **)malloc(sm->nSlots *
+						sizeof(particle_gen *));
+		sm->ancestor = (int **)malloc(sm->nSlots * sizeof(int *));
+		sm->lineage = (int *)malloc(n * sizeof(int));
+		if (sm->window == NULL || sm->ancestor == NULL ||
+						sm->lineage == NULL)
+			fatal("couldn't allocate the smoother window");
+
+		for (int j = 0; j < sm->nSlots; j++) {
+			sm->window[j] = particle_gen_alloc(n);
+			sm->ancestor[j] = (int *)malloc(n * sizeof(int));
+			if (sm->ancestor[j] == NULL)
+				fatal("couldn't allocate the smoother window");
+		}
+		break;
+
+	case SMOOTHER_FFBSI:
+		if (pf->opts.nTrajectories < 1)
+			fatal("the number of trajectories must be positive");
+
+		sm->nTrajectories = pf->opts.nTrajectories;
+		sm->recordSize = (long)(STATE_DIM + 1) * n * sizeof(double);
+		sm->fp = tmpfile();
+		if (sm->fp == NULL)
+			fatal("couldn't create the smoother temporary file");
+		break;
+
+	default:
+		break;
+	}
+
+	return sm;
+}
+
+/**
+ * Feed the last step of the filter to the smoother.
+ *
+ * @param sm The smoother.
+ * @param pf The filter, right after `pf_step`.
+ * @param out The result where the smoothed means are stored in `xSmooth` as
+ * they become available.
+ */
+void smoother_update(smoother_state *sm, const pf_state *pf,
+		filter_result *out) {
+	switch (sm->type) {
+	case SMOOTHER_FIXED_LAG:
+		lag_update(sm, pf, out);
+		break;
+	case SMOOTHER_FFBSI:
+		backward_update(sm, pf);
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * Compute the remaining estimates after the last step.
+ *
+ * @param sm The smoother.
+ * @param pf The filter, after the last step.
+ * @param out The result where the smoothed means are stored in `xSmooth`,
+ * and the trajectories in `trajectories` (FFBSi only, may be NULL).
+ */
+void smoother_finish(smoother_state *sm, const pf_state *pf,
+		filter_result *out) {
+	if (pf->k < 1)
+		return;
+
+	switch (sm->type) {
+	case SMOOTHER_FIXED_LAG:
+		lag_finish(sm, pf, out);
+		break;
+	case SMOOTHER_FFBSI:
+		backward_finish(sm, pf, out);
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * Free a smoother (and remove its temporary file).
+ *
+ * @param sm The smoother.
+ */
+void smoother_destroy(smoother_state *sm) {
+	if (sm->window != NULL) {
+		for (int j = 0; j < sm->nSlots; j++) {
+			particle_gen_free(sm->window[j]);
+			free(sm->ancestor[j]);
+		}
+		free(sm->window);
+		free(sm->ancestor);
+	}
+	free(sm->lineage);
+	if (sm->fp != NULL)
+		fclose(sm->fp);
+	free(sm);
+}
@@ -0,0 +1,39 @@
+/**
+ * @file smoother.h
+ * @authors Luis Damiano
+ * @version 0.1
+ * @details
+ *
+ * Header for the particle smoothers.
+ */
+
+#ifndef C_SMOOTHER_H_
+#define C_SMOOTHER_H_
+
+typedef struct smoother_states {
+	smoother_type type; /**< Which smoother */
+	int nParticles; /**< Number of particles */
+	int T; /**< Number of time steps */
+
+	/* Fixed-lag: circular window of the last lag + 1 steps */
+	int lag; /**< Lag */
+	int nSlots; /**< Size of the window, lag + 1 */
+	particle_gen **window; /**< Weighted generation of each step */
+	int **ancestor; /**< Index of the parent of each particle of the
+		next step, in the generation of this step */
+	int *lineage; /**< Work array, ancestors of the current particles */
+
+	/* FFBSi: generations and weights streamed to a temporary file */
+	FILE *fp; /**< Temporary file, one record per step */
+	long recordSize; /**< Size of a record in bytes */
+	int nTrajectories; /**< Number of trajectories */
+} smoother_state;
+
+smoother_state *smoother_create(const pf_state *pf, int T);
+void smoother_update(smoother_state *sm, const pf_state *pf,
+		filter_result *out);
+void smoother_finish(smoother_state *sm, const pf_state *pf,
+		filter_result *out);
+void smoother_destroy(smoother_state *sm);
+
+#endif /* C_SMOOTHER_H_ */
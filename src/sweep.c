@@ -0,0 +1,209 @@
+/**
+ * @file sweep.c
+ * @authors Luis Damiano
+ * @version 0.1
+ * @details
+ *
+ * Run the particle filter over many parameter sets on the same measurements.
+ *
+ * The measurements, the noiseless solution and the model constants are set
+ * up once by the caller and shared read-only. Parameter sets are handed out
+ * dynamically to a pool of workers (OpenMP threads). Each worker gets a
+ * filter and a copy of the model parameters, allocated once up front, then
+ * for every set it refreshes the precomputed constants in place (`*_set`)
+ * and restarts the filter (`pf_reset`), with no allocation in between.
+ *
+ * The workers never call `fatal` or `warning`, which under R may only run
+ * on the main thread: sets with a variance that isn't positive get NaN, and
+ * the warnings are raised after the workers are done.
+ *
+ * Since the draws depend only on the seed, the step and the particle index
+ * (see rng.c), giving all sets the same seed yields common random numbers,
+ * and the results don't depend on the number of workers.
+ */
+
+#include "main.h"
+
+/**
+ * Allocate the output of a sweep.
+ *
+ * @param nSets The number of parameter sets.
+ * @param T The number of time steps.
+ * @param keepMean If non-zero, keep the posterior mean of every step.
+ * @return Pointer to the new result. Free with `sweep_result_free`.
+ */
+sweep_result *sweep_result_alloc(int nSets, int T, int keepMean) {
+	sweep_result *res = (sweep_result *)malloc(sizeof(sweep_result));
+	if (res == NULL)
+		fatal("couldn't allocate sweep results");
+
+	res->nSets = nSets;
+	res->T = T;
+	res->logLik = gsl_vector_alloc(nSets);
+	res->logLikInc = gsl_vector_alloc(nSets * T);
+	res->ess = gsl_vector_alloc(nSets * T);
+	res->xMean = keepMean ? gsl_matrix_alloc(nSets * T, STATE_DIM) : NULL;
+
+	return res;
+}
+
+/**
+ * Free the output of a sweep.
+ *
+ * @param res The result.
+ */
+void sweep_result_free(sweep_result *res) {
+	if (res->xMean != NULL)
+		gsl_matrix_free(res->xMean);
+	gsl_vector_free(res->ess);
+	gsl_vector_free(res->logLikInc);
+	gsl_vector_free(res->logLik);
+	free(res);
+}
+
+/**
+ * Fill the output of a parameter set with NaN.
+ *
+ * @param s The parameter set.
+ * @param T The number of time steps.
+ * @param out The result of the sweep.
+ */
+static void sweep_invalid(int s, int T, sweep_result *out) {
+	gsl_vector_set(out->logLik, s, NAN);
+	for (int k = 0; k < T; k++) {
+		gsl_vector_set(out->logLikInc, s * T + k, NAN);
+		gsl_vector_set(out->ess, s * T + k, NAN);
+		if (out->xMean != NULL)
+			for (int j = 0; j < STATE_DIM; j++)
+				gsl_matrix_set(out->xMean, s * T + k, j, NAN);
+	}
+}
+
+/**
+ * Run the particle filter for each parameter set.
+ *
+ * @param y The measurements.
+ * @param sets A matrix with one parameter set per row, columns as in
+ * `sweep_column`.
+ * @param nParticles The number of particles (MC samples) to use.
+ * @param base The model parameters shared by all sets (sensor locations,
+ * dt, state prior, baseline). Only the scalar members are read, the swept
+ * ones must hold valid values too (e.g. the first set). Read-only.
+ * @param opts The filter settings. `nThreads` is the number of workers, each
+ * filter runs single-threaded. Only summaries are kept.
+ * @param commonRandom If non-zero, all sets use `opts->seed` (common random
+ * numbers). Otherwise set s uses `opts->seed + s`.
+ * @param out The result where the output will be stored (see
+ * `sweep_result_alloc`).
+ */
+void sweep(const gsl_matrix *y, const gsl_matrix *sets, int nParticles,
+		const model_param *base, const filter_opt *opts,
+		int commonRandom, sweep_result *out) {
+	const int T = y->size1, nSets = sets->size1;
+	const int nWorkers = opts->nThreads > 0 ? opts->nThreads : 1;
+	filter_opt workerOpts = *opts;
+	model_param *param;
+	pf_state **pf;
+	gsl_error_handler_t *handler;
+	int nInvalid = 0, nVanished = 0;
+
+	if (sets->size2 != SWEEP_NCOLS)
+		fatal("wrong number of columns in the parameter sets");
+	if (y->size2 != base->sensors->size1)
+		fatal("the measurements need one column per sensor");
+
+	workerOpts.nThreads = 1;
+	workerOpts.output = OUTPUT_SUMMARY;
+
+	/* Per-worker model parameters and filters, allocated once on this
+	 * thread: the workers must not reach `fatal` or `warning` (see
+	 * interface.c) */
+	param = (model_param *)malloc(nWorkers * sizeof(model_param));
+	pf = (pf_state **)malloc(nWorkers * sizeof(pf_state *));
+	if (param == NULL || pf == NULL)
+		fatal("couldn't allocate the sweep");
+
+	for (int w = 0; w < nWorkers; w++) {
+		param[w] = *base;
+		importance_init(param + w);
+		state_init(param + w);
+		measurement_init(param + w);
+		pf[w] = pf_create(nParticles, param + w, &workerOpts);
+	}
+
+	/* A set with a variance that isn't positive gets NaN, not an abort */
+	handler = gsl_set_error_handler_off();
+
+#pragma omp parallel num_threads(nWorkers) reduction(+:nInvalid, nVanished)
+	{
+#ifdef _OPENMP
+		const int w = omp_get_thread_num();
+#else
+		const int w = 0;
+#endif
+		model_param *pw = param + w;
+		pf_summary sk;
+
+#pragma omp for schedule(dynamic)
+		for (int s = 0; s < nSets; s++) {
+			double logLik = 0;
+
+			pw->sr = gsl_matrix_get(sets, s, SWEEP_SR);
+			pw->q1 = gsl_matrix_get(sets, s, SWEEP_Q1);
+			pw->q2 = gsl_matrix_get(sets, s, SWEEP_Q2);
+			pw->importanceL00 = gsl_matrix_get(sets, s,
+							SWEEP_IMPORTANCE_L00);
+			pw->importanceL11 = gsl_matrix_get(sets, s,
+							SWEEP_IMPORTANCE_L11);
+			pw->importanceL22 = gsl_matrix_get(sets, s,
+							SWEEP_IMPORTANCE_L22);
+			pw->importanceL33 = gsl_matrix_get(sets, s,
+							SWEEP_IMPORTANCE_L33);
+
+			if (importance_set(pw) != GSL_SUCCESS ||
+					state_set(pw) != GSL_SUCCESS ||
+					measurement_set(pw) != GSL_SUCCESS) {
+				sweep_invalid(s, T, out);
+				nInvalid++;
+				continue;
+			}
+
+			pf_reset(pf[w], pw, commonRandom ? opts->seed :
+							opts->seed + s);
+
+			for (int k = 0; k < T; k++) {
+				int row = s * T + k;
+
+				pf_step(pf[w], y->data + k * y->tda, &sk);
+				logLik += sk.logLik;
+
+				gsl_vector_set(out->logLikInc, row, sk.logLik);
+				gsl_vector_set(out->ess, row, sk.ess);
+				if (out->xMean != NULL)
+					for (int j = 0; j < STATE_DIM; j++)
+						gsl_matrix_set(out->xMean, row,
+							j, sk.xMean[j]);
+			}
+
+			gsl_vector_set(out->logLik, s, logLik);
+			nVanished += pf[w]->nVanished;
+		}
+	}
+
+	gsl_set_error_handler(handler);
+
+	/* Warn on this thread only */
+	if (nInvalid > 0)
+		warning("some parameter sets have a variance that isn't "
+					"positive, their output is NaN");
+	pf_warn_vanished(nVanished);
+
+	for (int w = 0; w < nWorkers; w++) {
+		pf_destroy(pf[w]);
+		importance_free(param + w);
+		state_free(param + w);
+		measurement_free(param + w);
+	}
+	free(pf);
+	free(param);
+}
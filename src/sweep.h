@@ -0,0 +1,45 @@
+/**
+ * @file sweep.h
+ * @authors Luis Damiano
+ * @version 0.1
+ * @details
+ *
+ * Header for the parameter sweep.
+ */
+
+#ifndef C_SWEEP_H_
+#define C_SWEEP_H_
+
+/* NOTE: Keep the order in sync with SWEEP_COLUMNS in R/. */
+typedef enum sweep_columns {
+	SWEEP_SR = 0, /**< Measurement error */
+	SWEEP_Q1, /**< First diffusion constant */
+	SWEEP_Q2, /**< Second diffusion constant */
+	SWEEP_IMPORTANCE_L00, /**< Diagonal of the importance factor */
+	SWEEP_IMPORTANCE_L11,
+	SWEEP_IMPORTANCE_L22,
+	SWEEP_IMPORTANCE_L33,
+	SWEEP_NCOLS /**< Number of columns of a parameter set */
+} sweep_column;
+
+/**
+ * The output of a sweep. Per-step outputs of all parameter sets are stacked:
+ * set s takes rows s * T, ..., s * T + T - 1.
+ */
+typedef struct sweep_results {
+	int nSets; /**< Number of parameter sets */
+	int T; /**< Number of time steps */
+	gsl_vector *logLik; /**< Total log-likelihood of each set */
+	gsl_vector *logLikInc; /**< (nSets * T) log-likelihood increments */
+	gsl_vector *ess; /**< (nSets * T) effective sample sizes */
+	gsl_matrix *xMean; /**< (nSets * T) x STATE_DIM posterior means, may be
+									NULL */
+} sweep_result;
+
+sweep_result *sweep_result_alloc(int nSets, int T, int keepMean);
+void sweep_result_free(sweep_result *res);
+void sweep(const gsl_matrix *y, const gsl_matrix *sets, int nParticles,
+		const model_param *base, const filter_opt *opts,
+		int commonRandom, sweep_result *out);
+
+#endif /* C_SWEEP_H_ */
@@ -0,0 +1,274 @@
+/**
+ * @file trace.c
+ * @authors Luis Damiano
+ * @version 0.1
+ * @details
+ *
+ * Per-particle tracing to a binary file.
+ *
+ * Tracing is set at runtime (see `trace_opt`) and samples steps (every k-th
+ * one) and particles (a list of indices). Each traced particle-step becomes
+ * one fixed-size `trace_record`. Records go to rings with a single producer
+ * each: one ring per block of particles, since a block is only ever worked
+ * on by one thread at a time. This holds under any parallel region (the
+ * particle loop, a fleet or a sweep) without looking up thread ids. A
+ * writer thread drains the rings to the file in the background, so the
+ * filter only pays for copying the record. When a ring is full, its
+ * producer waits for the writer, so no record is lost.
+ *
+ * File layout: TRACE_MAGIC (8 bytes), the version and the size of a record
+ * (uint32 each), then the records. Records of different rings interleave,
+ * see tools/tracedump.c to decode them.
+ */
+
+#include "main.h"
+
+#define TRACE_IDLE_NS 1000000L /* long, writer nap when all rings are empty */
+
+/**
+ * Order integers (for qsort).
+ */
+static int int_cmp(const void *a, const void *b) {
+	int x = *(const int *)a, y = *(const int *)b;
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * Write the records available in a ring to the file.
+ *
+ * @param tr The trace.
+ * @param ring The ring.
+ * @return The number of records drained.
+ */
+static uint64_t trace_drain(trace_state *tr, trace_ring *ring) {
+	uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	uint64_t tail = ring->tail, n = head - tail;
+
+	while (tail < head) {
+		/* Contiguous run up to the end of the buffer */
+		uint64_t at = tail & (TRACE_RING_SIZE - 1);
+		uint64_t m = head - tail < TRACE_RING_SIZE - at ?
+					head - tail : TRACE_RING_SIZE - at;
+
+		/* NOTE: On failure the records are dropped all the same, or
+		 * the producers would wait forever. */
+		if (!tr->failed &&
+				fwrite(ring->buf + at, sizeof(trace_record), m,
+					tr->fp) != m)
+			__atomic_store_n(&tr->failed, 1, __ATOMIC_RELAXED);
+
+		tail += m;
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+	}
+
+	return n;
+}
+
+/**
+ * Drain every ring until asked to stop (writer thread).
+ *
+ * @param arg The trace.
+ * @return NULL.
+ */
+static void *trace_writer(void *arg) {
+	trace_state *tr = (trace_state *)arg;
+	struct timespec nap = {0, TRACE_IDLE_NS};
+
+	for (;;) {
+		/* Producers are done once stop is set: a pass after that
+		 * which finds nothing means everything was written */
+		int stop = __atomic_load_n(&tr->stop, __ATOMIC_ACQUIRE);
+		uint64_t n = 0;
+
+		for (trace_ring *ring = __atomic_load_n(&tr->rings,
+					__ATOMIC_ACQUIRE);
+				ring != NULL; ring = ring->next)
+			n += trace_drain(tr, ring);
+
+		if (n == 0) {
+			if (stop)
+				break;
+			nanosleep(&nap, NULL);
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Open a trace and start its writer thread.
+ *
+ * @param opts The trace settings. The indices are copied.
+ * @return Pointer to the new trace. Close with `trace_close`.
+ */
+trace_state *trace_open(const trace_opt *opts) {
+	trace_state *tr;
+	uint32_t head[2] = {TRACE_VERSION, sizeof(trace_record)};
+
+	if (opts->every < 1)
+		fatal("the trace must sample every k >= 1 steps");
+
+	tr = (trace_state *)malloc(sizeof(trace_state));
+	if (tr == NULL)
+		fatal("couldn't allocate the trace");
+
+	tr->every = opts->every;
+	tr->nIndices = opts->nIndices > 0 ? opts->nIndices : 0;
+	tr->indices = NULL;
+	if (tr->nIndices > 0) {
+		tr->indices = (int *)malloc(tr->nIndices * sizeof(int));
+		if (tr->indices == NULL)
+			fatal("couldn't allocate the trace");
+		memcpy(tr->indices, opts->indices, tr->nIndices * sizeof(int));
+		qsort(tr->indices, tr->nIndices, sizeof(int), int_cmp);
+	}
+
+	tr->fp = fopen(opts->filename, "wb");
+	if (tr->fp == NULL) {
+		free(tr->indices);
+		free(tr);
+		fatal("couldn't create the trace file");
+	}
+	if (fwrite(TRACE_MAGIC, 1, 8, tr->fp) != 8 ||
+			fwrite(head, sizeof(uint32_t), 2, tr->fp) != 2) {
+		fclose(tr->fp);
+		free(tr->indices);
+		free(tr);
+		fatal("couldn't write the trace file");
+	}
+
+	tr->rings = NULL;
+	tr->stop = 0;
+	tr->failed = 0;
+	pthread_mutex_init(&tr->lock, NULL);
+	if (pthread_create(&tr->writer, NULL, trace_writer, tr) != 0)
+		fatal("couldn't start the trace writer");
+
+	return tr;
+}
+
+/**
+ * Add a ring to a trace.
+ *
+ * @param tr The trace.
+ * @return Pointer to the new ring, owned by the trace.
+ */
+trace_ring *trace_ring_open(trace_state *tr) {
+	trace_ring *ring = (trace_ring *)malloc(sizeof(trace_ring));
+
+	if (ring == NULL)
+		fatal("couldn't allocate a trace ring");
+	ring->buf = (trace_record *)malloc(TRACE_RING_SIZE *
+						sizeof(trace_record));
+	if (ring->buf == NULL)
+		fatal("couldn't allocate a trace ring");
+	ring->head = 0;
+	ring->tail = 0;
+
+	/* The writer walks the list without the lock: publish the ring only
+	 * once it's complete */
+	pthread_mutex_lock(&tr->lock);
+	ring->next = tr->rings;
+	__atomic_store_n(&tr->rings, ring, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&tr->lock);
+
+	return ring;
+}
+
+/**
+ * Whether a step is traced.
+ *
+ * @param tr The trace.
+ * @param k The time step.
+ * @return 1 if traced, 0 otherwise.
+ */
+int trace_step(const trace_state *tr, int k) {
+	return k % tr->every == 0;
+}
+
+/**
+ * Find the traced particles in a range.
+ *
+ * @param tr The trace.
+ * @param i0 The index of the first particle in the range.
+ * @param n The number of particles in the range.
+ * @param j0Out Pointer where the position in `tr->indices` of the first
+ * traced particle will be stored, or -1 if every particle is traced (the
+ * traced particles are then i0, ..., i0 + n - 1).
+ * @return The number of traced particles in the range.
+ */
+int trace_particles(const trace_state *tr, int i0, int n, int *j0Out) {
+	int lo = 0, hi = tr->nIndices, j0;
+
+	if (tr->nIndices == 0) {
+		*j0Out = -1;
+		return n;
+	}
+
+	/* First index >= i0 */
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (tr->indices[mid] < i0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	j0 = lo;
+	while (lo < tr->nIndices && tr->indices[lo] < i0 + n)
+		lo++;
+
+	*j0Out = j0;
+	return lo - j0;
+}
+
+/**
+ * Append a record to a ring, waiting for the writer if it's full. Records
+ * are dropped once a write to the file failed, as the writer would drop
+ * them anyway.
+ *
+ * @param tr The trace.
+ * @param ring The ring. Only one thread may write to it at a time.
+ * @param rec The record.
+ */
+void trace_write(trace_state *tr, trace_ring *ring, const trace_record *rec) {
+	uint64_t head = ring->head;
+
+	if (__atomic_load_n(&tr->failed, __ATOMIC_RELAXED))
+		return;
+
+	while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >=
+							TRACE_RING_SIZE)
+		sched_yield();
+
+	ring->buf[head & (TRACE_RING_SIZE - 1)] = *rec;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Drain what's left, stop the writer and close a trace.
+ *
+ * @param tr The trace. No ring may be written to after the call.
+ */
+void trace_close(trace_state *tr) {
+	trace_ring *ring = tr->rings, *next;
+	int failed;
+
+	__atomic_store_n(&tr->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(tr->writer, NULL);
+	pthread_mutex_destroy(&tr->lock);
+
+	failed = fclose(tr->fp) != 0 || tr->failed;
+
+	for (; ring != NULL; ring = next) {
+		next = ring->next;
+		free(ring->buf);
+		free(ring);
+	}
+	free(tr->indices);
+	free(tr);
+
+	if (failed)
+		warning("couldn't write the whole trace");
+}
@@ -0,0 +1,76 @@
+/**
+ * @file trace.h
+ * @authors Luis Damiano
+ * @version 0.1
+ * @details
+ *
+ * Header for per-particle tracing.
+ */
+
+#ifndef C_TRACE_H_
+#define C_TRACE_H_
+
+#define TRACE_MAGIC "TPTRACE1" /* 8 bytes, no terminator on disk */
+#define TRACE_VERSION 1 /* uint32 */
+#define TRACE_RING_SIZE 1024 /* records, a power of two */
+
+/**
+ * What a particle went through at one step. Fixed size, written to disk as
+ * is (native byte order).
+ */
+typedef struct trace_records {
+	int32_t tag; /**< Filter that wrote it (target of a fleet) */
+	int32_t block; /**< Block of the particle */
+	int32_t k; /**< Time step */
+	int32_t i; /**< Particle */
+	double x[STATE_DIM]; /**< State drawn at this step */
+	double lpdfMeasurement; /**< Measurement log-density */
+	double lpdfState; /**< State model log-density */
+	double lpdfImportance; /**< Importance log-density */
+	double lwPrev; /**< Log-weight before the step */
+	double lw; /**< Log-weight after the step, before normalizing */
+} trace_record;
+
+typedef struct trace_options {
+	const char *filename; /**< Output file */
+	int every; /**< Trace the steps k that are multiples of it */
+	int nIndices; /**< Number of traced particles, 0 for all of them */
+	const int *indices; /**< Array of size nIndices with the traced
+			particles, in any order */
+} trace_opt;
+
+/**
+ * Single-producer, single-consumer ring of records. Only the thread that
+ * works on the block writes to it and only the writer thread drains it.
+ */
+typedef struct trace_rings {
+	trace_record *buf; /**< TRACE_RING_SIZE records */
+	uint64_t head; /**< Records written so far */
+	uint64_t tail; /**< Records drained so far */
+	struct trace_rings *next; /**< Next ring of the same trace */
+} trace_ring;
+
+/**
+ * An open trace: the file, the sampling settings, every ring and the
+ * thread that drains them.
+ */
+typedef struct trace_states {
+	FILE *fp; /**< Output file */
+	int every; /**< Trace the steps k that are multiples of it */
+	int nIndices; /**< Number of traced particles, 0 for all of them */
+	int *indices; /**< Traced particles, sorted */
+	trace_ring *rings; /**< List of rings */
+	pthread_mutex_t lock; /**< Serializes adding rings */
+	pthread_t writer; /**< Thread that drains the rings */
+	int stop; /**< Asks the writer to drain and exit */
+	int failed; /**< Whether a write failed */
+} trace_state;
+
+trace_state *trace_open(const trace_opt *opts);
+trace_ring *trace_ring_open(trace_state *tr);
+int trace_step(const trace_state *tr, int k);
+int trace_particles(const trace_state *tr, int i0, int n, int *j0Out);
+void trace_write(trace_state *tr, trace_ring *ring, const trace_record *rec);
+void trace_close(trace_state *tr);
+
+#endif /* C_TRACE_H_ */
@@ -4,8 +4,11 @@
  * @version 0.1
  * @details
  *
- * Density function and random number generation for the densities involved in
- * the particle filter for the bearing-only tracking problem.
+ * Model setup for the bearing-only tracking problem: the `*_init`, `*_set`
+ * and `*_free` functions fill model_param with the covariance factors and the
+ * constants read by the kernels. The kernels themselves (random generation
+ * and densities) work on whole generations of particles, see batch.c,
+ * proposal.c and rbpf.c.
  *
  * Naming convention for mathematical variables:
  *   `y` refers to measurements and `x` to states.
@@ -19,84 +22,102 @@
  *   x1tok	x_{1:k}		Matrix 	From start up to k included.
  *   x1tokm1	x_{1:(k-1)}	Matrix 	From start up to k-1 included.
  *
- * Design convention for functions:
- *
- *   Expect gsl_vector* and gsl_matrix* as arguments -- don't ask for views.
- *   Write results directly -- avoid returns to avoid excessive copying.
+ * The covariance factors are fixed once the `*_init` functions return, so the
+ * kernels don't go through the generic multivariate Gaussian routines. The
+ * init functions precompute the normalizing constants and the inverse factors
+ * into model_param. The `*_set` functions redo this after the scalar
+ * parameters change (e.g. in a sweep) without allocating, also over storage
+ * placed by the caller instead of the `*_init` functions (see workspace.c).
+ * They return the status of the Cholesky factorization, which fails when a
+ * variance isn't positive. GSL's default error handler aborts before that,
+ * so callers that recover from it (see sweep.c) turn the handler off.
+ * The importance, measurement and state prior covariances are diagonal and
+ * use unrolled per-component paths.
  */
 
 #include "main.h"
 
-/** FIRST PART: RANDOM GENERATION AND DENSITY FUNCTIONS --------------------- */
-
-void stateprior_r(const gsl_rng *r, model_param *param, gsl_vector *xOut) {
-	gsl_ran_multivariate_gaussian(r, param->statepriorMu,
-			param->statepriorL, xOut);
-	VOUT(param->statepriorMu)
-	MOUT(param->statepriorL)
-	VOUT(xOut)
-}
+#define LOG_2PI 1.83787706640934548356 /* log(2 pi) */
 
-void importance_r(const gsl_rng *r, gsl_vector *xkm1, gsl_matrix *y1tok,
-		model_param *param, gsl_vector *xOut) {
-	gsl_vector_view mu = gsl_matrix_row(param->baseline, y1tok->size1);
-	double padded[] = {
-			gsl_vector_get(&mu.vector, 0),
-			gsl_vector_get(&mu.vector, 1),
-			0,
-			0
-	};
-
-	gsl_vector_view center = gsl_vector_view_array(padded, 4);
-	gsl_ran_multivariate_gaussian(r, &center.vector, param->importanceL,
-			xOut);
-	VOUT(&center.vector)
-	MOUT(param->importanceL)
-	VOUT(xOut)
+/**
+ * Invert a STATE_DIM x STATE_DIM lower-triangular Cholesky factor.
+ *
+ * @param L The Cholesky factor.
+ * @param lInvOut Array of size 10 where the lower triangle of the inverse
+ * will be stored by rows.
+ * @return The log-normalizing constant of a Gaussian with covariance L L'.
+ */
+static double lower_inverse(const gsl_matrix *L, double *lInvOut) {
+	double logNorm = -0.5 * STATE_DIM * LOG_2PI;
+
+	/* Forward substitution, one column of the inverse at a time */
+	for (int c = 0; c < STATE_DIM; c++) {
+		for (int r = c; r < STATE_DIM; r++) {
+			double s = r == c ? 1 : 0;
+			for (int j = c; j < r; j++)
+				s -= gsl_matrix_get(L, r, j) *
+						lInvOut[j * (j + 1) / 2 + c];
+			lInvOut[r * (r + 1) / 2 + c] = s /
+						gsl_matrix_get(L, r, r);
+		}
+	}
+
+	for (int r = 0; r < STATE_DIM; r++)
+		logNorm -= log(gsl_matrix_get(L, r, r));
+
+	return logNorm;
 }
 
-void importance_lpdf(gsl_vector *xk, gsl_vector *xkm1, gsl_matrix *y1tok,
-		model_param *param, double *lpdf) {
-	gsl_ran_multivariate_gaussian_log_pdf(xk, xkm1, param->importanceL,
-			lpdf, param->stateWork);
-	VOUT(xk)
-	VOUT(xkm1)
-	MOUT(param->importanceL)
-	DOUT(*lpdf)
+/**
+ * Read the diagonal of a diagonal Cholesky factor.
+ *
+ * @param L The Cholesky factor.
+ * @param sdOut Array where the diagonal will be stored, or NULL.
+ * @param invSdOut Array where its inverse will be stored, or NULL.
+ * @return The log-normalizing constant of a Gaussian with covariance L L'.
+ */
+static double diagonal_factor(const gsl_matrix *L, double *sdOut,
+		double *invSdOut) {
+	double logNorm = -0.5 * L->size1 * LOG_2PI;
+
+	for (int j = 0; j < (int)L->size1; j++) {
+		double sd = gsl_matrix_get(L, j, j);
+		if (sdOut != NULL)
+			sdOut[j] = sd;
+		if (invSdOut != NULL)
+			invSdOut[j] = 1 / sd;
+		logNorm -= log(sd);
+	}
+
+	return logNorm;
 }
 
-void measurement_lpdf(gsl_vector *yk, gsl_vector *xk, model_param *param,
-		double *lpdf) {
-	gsl_ran_multivariate_gaussian_log_pdf(yk, param->measurementMu,
-			param->measurementL, lpdf, param->measurementWork);
-	VOUT(yk)
-	VOUT(param->measurementMu)
-	MOUT(param->measurementL)
-	DOUT(*lpdf)
-}
+/** PARAMETER UPDATING FUNCTIONS ------------------------------------------- */
 
-void state_lpdf(gsl_vector *xk, gsl_vector *xkm1, model_param *param,
-		double *lpdf) {
-	gsl_ran_multivariate_gaussian_log_pdf(xk, param->stateMu,
-			param->stateL, lpdf, param->stateWork);
-	VOUT(xk)
-	VOUT(param->stateMu)
-	MOUT(param->stateL)
-	DOUT(*lpdf)
+void importance_init(model_param *param) {
+	param->importanceL = gsl_matrix_alloc(STATE_DIM, STATE_DIM);
+	if (importance_set(param) != GSL_SUCCESS)
+		fatal("the importance variances must be positive");
 }
 
-/** SECOND PART: PARAMETER UPDATING FUNCTIONS ------------------------------- */
-
-void importance_init(model_param *param) {
-	/* Allocate & populate importance covariance matrix */
-	param->importanceL = gsl_matrix_calloc(STATE_DIM, STATE_DIM);
+int importance_set(model_param *param) {
+	int status;
 
+	/* Populate importance covariance matrix */
+	gsl_matrix_set_zero(param->importanceL);
 	gsl_matrix_set(param->importanceL, 0, 0, param->importanceL00);
 	gsl_matrix_set(param->importanceL, 1, 1, param->importanceL11);
 	gsl_matrix_set(param->importanceL, 2, 2, param->importanceL22);
 	gsl_matrix_set(param->importanceL, 3, 3, param->importanceL33);
 
-	gsl_linalg_cholesky_decomp(param->importanceL);
+	status = gsl_linalg_cholesky_decomp(param->importanceL);
+	if (status != GSL_SUCCESS)
+		return status;
+
+	param->importanceLogNorm = diagonal_factor(param->importanceL,
+			param->importanceSd, param->importanceInvSd);
+
+	return GSL_SUCCESS;
 }
 
 void importance_free(model_param *param) {
@@ -104,68 +125,83 @@ void importance_free(model_param *param) {
 }
 
 void measurement_init(model_param *param) {
-	/* Allocate mean vector */
-	param->measurementMu = gsl_vector_calloc(MEASUREMENT_DIM);
+	const int nSensors = param->sensors->size1;
+
+	if (nSensors < 2 || param->sensors->size2 != POSITION_DIM)
+		fatal("the sensor locations must be a matrix with two columns "
+						"and at least two rows");
+
+	param->nSensors = nSensors;
+	param->measurementL = gsl_matrix_alloc(nSensors, nSensors);
+	param->measurementInvSd = (double *)malloc(nSensors * sizeof(double));
+	param->sensorX = (double *)malloc(nSensors * sizeof(double));
+	param->sensorY = (double *)malloc(nSensors * sizeof(double));
+	if (param->measurementInvSd == NULL || param->sensorX == NULL ||
+			param->sensorY == NULL)
+		fatal("couldn't allocate the measurement model");
+
+	if (measurement_set(param) != GSL_SUCCESS)
+		fatal("the measurement error must be positive");
+}
 
-	/* Allocate & populate covariance matrix */
-	param->measurementL = gsl_matrix_alloc(MEASUREMENT_DIM,
-							MEASUREMENT_DIM);
+int measurement_set(model_param *param) {
+	int status;
 
-	gsl_matrix_set(param->measurementL, 0, 0, param->sr);
-	gsl_matrix_set(param->measurementL, 0, 1, 0);
-	gsl_matrix_set(param->measurementL, 1, 0, 0);
-	gsl_matrix_set(param->measurementL, 1, 1, param->sr);
-	gsl_linalg_cholesky_decomp(param->measurementL);
+	/* Sensor locations, which may move between runs (see workspace.c) */
+	for (int s = 0; s < param->nSensors; s++) {
+		param->sensorX[s] = gsl_matrix_get(param->sensors, s, 0);
+		param->sensorY[s] = gsl_matrix_get(param->sensors, s, 1);
+	}
 
-	/* Allocate work vector */
-	param->measurementWork = gsl_vector_alloc(MEASUREMENT_DIM);
+	/* Populate covariance matrix: independent errors, same variance */
+	gsl_matrix_set_zero(param->measurementL);
+	for (int s = 0; s < param->nSensors; s++)
+		gsl_matrix_set(param->measurementL, s, s, param->sr);
+	status = gsl_linalg_cholesky_decomp(param->measurementL);
+	if (status != GSL_SUCCESS)
+		return status;
+
+	param->measurementLogNorm = diagonal_factor(param->measurementL,
+			NULL, param->measurementInvSd);
+
+	return GSL_SUCCESS;
 }
 
 void measurement_free(model_param *param) {
-	gsl_vector_free(param->measurementWork);
+	free(param->sensorY);
+	free(param->sensorX);
+	free(param->measurementInvSd);
 	gsl_matrix_free(param->measurementL);
-	gsl_vector_free(param->measurementMu);
-}
-
-void measurement_update(gsl_vector *yk, gsl_vector *xk, model_param *param) {
-	/* RECALL:
-	 * Observation vector = (angle1, angle2)
-	 * State vector       = (x-coord, y-coord, x-velocity, y-velocity)
-	 */
-
-	/* Update mean vector: the accuracy transformation was verified. */
-	double xkXCoord = gsl_vector_get(xk, 0); /**< x-coord at k from
-								state model */
-	double xkYCoord = gsl_vector_get(xk, 1); /**< y-coord at k from
-								state model */
-	double mean1 = atan2(xkYCoord - param->l1y, xkXCoord - param->l1x);
-	double mean2 = atan2(xkYCoord - param->l2y, xkXCoord - param->l2x);
-
-	gsl_vector_set(param->measurementMu, 0, mean1);
-	gsl_vector_set(param->measurementMu, 1, mean2);
-
-	/* Update covariance matrix */
-	/* We make no update here as the covariance matrix is fixed
-	 * in our case. Yet, we leave this comment as a "placeholder"
-	 * remainder in case the model is to be extended in the future.
-	 */
 }
 
 void state_init(model_param *param) {
-	/* Allocate mean vector and set to baseline */
 	param->stateMu = gsl_vector_alloc(STATE_DIM);
-	gsl_vector_view baseline1 = gsl_matrix_row(param->baseline, 0);
+	param->stateL = gsl_matrix_alloc(STATE_DIM, STATE_DIM);
+	param->stateTransition = gsl_matrix_alloc(STATE_DIM, STATE_DIM);
+	param->statepriorMu = gsl_vector_alloc(STATE_DIM);
+	param->statepriorL = gsl_matrix_alloc(STATE_DIM, STATE_DIM);
+	if (state_set(param) != GSL_SUCCESS)
+		fatal("the diffusion coefficients and dt must be positive");
+}
 
-	gsl_vector_set(param->stateMu, 0,
-			gsl_vector_get(&baseline1.vector, 0));
-	gsl_vector_set(param->stateMu, 1,
-			gsl_vector_get(&baseline1.vector, 1));
-	gsl_vector_set(param->stateMu, 2, 0);
-	gsl_vector_set(param->stateMu, 3, 0);
+int state_set(model_param *param) {
+	int status;
 
-	/* Allocate & populate covariance matrix */
-	param->stateL = gsl_matrix_alloc(STATE_DIM, STATE_DIM);
 
+	/* Set mean vector to baseline */
+	/* NOTE: The baseline may not be known yet when filtering a live
+	 * stream (see pf_step), in which case the mean is left at zero. */
+	gsl_vector_set_zero(param->stateMu);
+	if (param->baseline != NULL) {
+		gsl_vector_view baseline1 = gsl_matrix_row(param->baseline, 0);
+
+		gsl_vector_set(param->stateMu, 0,
+				gsl_vector_get(&baseline1.vector, 0));
+		gsl_vector_set(param->stateMu, 1,
+				gsl_vector_get(&baseline1.vector, 1));
+	}
+
+	/* Populate covariance matrix */
 	double dt3 = param->dt * param->dt * param->dt / 3;
 	double q1dt3 = param->q1 * dt3;
 	double q2dt3 = param->q2 * dt3;
@@ -188,56 +224,43 @@ void state_init(model_param *param) {
 	gsl_matrix_set(param->stateL, 1, 3, q2dt2);
 	gsl_matrix_set(param->stateL, 3, 3, param->q2 * param->dt);
 
-	gsl_linalg_cholesky_decomp(param->stateL);
+	status = gsl_linalg_cholesky_decomp(param->stateL);
+	if (status != GSL_SUCCESS)
+		return status;
 
-	/* Allocate & populate transition matrix */
-	param->stateTransition = gsl_matrix_alloc(STATE_DIM, STATE_DIM);
+	for (int r = 0; r < STATE_DIM; r++)
+		for (int c = 0; c <= r; c++)
+			param->stateLFactor[r * (r + 1) / 2 + c] =
+					gsl_matrix_get(param->stateL, r, c);
+
+	param->stateLogNorm = lower_inverse(param->stateL, param->stateLInv);
 
+	/* Populate transition matrix */
 	gsl_matrix_set_identity(param->stateTransition);
 	gsl_matrix_set(param->stateTransition, 0, 2, param->dt);
 	gsl_matrix_set(param->stateTransition, 1, 3, param->dt);
 
-	/* Allocate & populate state prior mean vector */
-	param->statepriorMu = gsl_vector_calloc(STATE_DIM);
+	/* Populate state prior mean vector */
+	gsl_vector_set_zero(param->statepriorMu);
 	gsl_vector_set(param->statepriorMu, 0, param->statepriorMuX);
 	gsl_vector_set(param->statepriorMu, 1, param->statepriorMuY);
 
-	/* Allocate & populate state prior covariance matrix */
-	param->statepriorL = gsl_matrix_calloc(STATE_DIM, STATE_DIM);
+	/* Populate state prior covariance matrix */
+	gsl_matrix_set_zero(param->statepriorL);
 	gsl_matrix_set(param->statepriorL, 0, 0, param->statepriorL00);
 	gsl_matrix_set(param->statepriorL, 1, 1, param->statepriorL11);
 	gsl_matrix_set(param->statepriorL, 2, 2, param->statepriorL22);
 	gsl_matrix_set(param->statepriorL, 3, 3, param->statepriorL33);
 
-	/* Allocate work vector */
-	param->stateWork = gsl_vector_alloc(STATE_DIM);
+	diagonal_factor(param->statepriorL, param->statepriorSd, NULL);
+
+	return GSL_SUCCESS;
 }
 
 void state_free(model_param *param) {
-	gsl_vector_free(param->stateWork);
 	gsl_matrix_free(param->statepriorL);
 	gsl_vector_free(param->statepriorMu);
 	gsl_matrix_free(param->stateTransition);
 	gsl_matrix_free(param->stateL);
 	gsl_vector_free(param->stateMu);
 }
-
-#if FALSE
-void state_update(gsl_vector *xk, gsl_vector *xkm1, model_param *param) {
-	/* Update mean vector
-	 *
-	 * NOTE: Transition equation (p. 93) is a matrix-vector operation.
-	 * Level 2 Matrix-vector operations
-	 * D	Double precision
-	 * GE	General matrix
-	 * MV	Matrix-vector product A*x
-	 */
-	gsl_blas_dgemv(CblasNoTrans, 1, param->stateTransition, xkm1, 0, xk);
-
-	/* Update covariance matrix */
-	/* We make no update here as the covariance matrix is fixed
-	 * in our case. Yet, we leave this comment as a "placeholder"
-	 * remainder in case the model is to be extended in the future.
-	 */
-}
-#endif
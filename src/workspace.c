@@ -0,0 +1,259 @@
+/**
+ * @file workspace.c
+ * @authors Luis Damiano
+ * @version 0.1
+ * @details
+ *
+ * Reusable filter workspace, for callers that run the filter many times
+ * (e.g. an optimizer calling it from R tens of thousands of times).
+ *
+ * `pf_workspace_create` allocates a filter and one arena for the
+ * measurements, the noiseless solution and the model parameters, sized for
+ * the largest series. `pf_workspace_data` arms it with a series (only the
+ * noiseless solver allocates, a flag per step, and not at all when the
+ * series is the one already armed) and `pf_workspace_run` with a parameter
+ * set, then runs the filter. Runs don't allocate: the model factors
+ * are recomputed in place by the `*_set` functions and the filter restarts
+ * with `pf_reset`. Only what a run keeps beyond the workspace (the result, a
+ * smoother, a trace) is allocated.
+ */
+
+#include "main.h"
+
+/**
+ * View part of the arena as a matrix.
+ */
+static gsl_matrix arena_matrix(double **at, int n1, int n2) {
+	gsl_matrix m = gsl_matrix_view_array(*at, n1, n2).matrix;
+
+	*at += n1 * n2;
+	return m;
+}
+
+/**
+ * View part of the arena as a vector.
+ */
+static gsl_vector arena_vector(double **at, int n) {
+	gsl_vector v = gsl_vector_view_array(*at, n).vector;
+
+	*at += n;
+	return v;
+}
+
+/**
+ * Create a workspace.
+ *
+ * @param nParticles The number of particles.
+ * @param maxT The length of the longest series it will hold.
+ * @param nSensors The number of sensors.
+ * @param opts The settings it is sized for: runs may keep as much output
+ * (output level, number of quantiles, statistics) or less.
+ * @return Pointer to the new workspace. Free with `pf_workspace_destroy`.
+ */
+pf_workspace *pf_workspace_create(int nParticles, int maxT, int nSensors,
+		const filter_opt *opts) {
+	const int S = nSensors;
+	pf_workspace *ws = (pf_workspace *)malloc(sizeof(pf_workspace));
+	double *at;
+
+	if (ws == NULL)
+		fatal("couldn't allocate the workspace");
+	if (nParticles < 1 || maxT < 1 || nSensors < 2)
+		fatal("the workspace needs one particle, one step and two "
+								"sensors");
+
+	/* Data, then model: measurements, noiseless solution, flags, sensor
+	 * locations, four STATE_DIM^2 factors, two means, the measurement
+	 * factor and the per-sensor arrays */
+	ws->arena = (double *)malloc(((size_t)maxT * (S + POSITION_DIM + 1) +
+			S * POSITION_DIM + 4 * STATE_DIM * STATE_DIM +
+			2 * STATE_DIM + S * S + 3 * S) * sizeof(double));
+	if (ws->arena == NULL)
+		fatal("couldn't allocate the workspace");
+
+	ws->nParticles = nParticles;
+	ws->maxT = maxT;
+	ws->nSensors = nSensors;
+	ws->T = 0;
+	ws->opts = *opts;
+	ws->opts.trace = NULL;
+	ws->trace = NULL;
+
+	at = ws->arena;
+	ws->y = arena_matrix(&at, maxT, S);
+	ws->baseline = arena_matrix(&at, maxT, POSITION_DIM);
+	ws->parallel = arena_vector(&at, maxT);
+	ws->sensors = arena_matrix(&at, S, POSITION_DIM);
+	ws->importanceL = arena_matrix(&at, STATE_DIM, STATE_DIM);
+	ws->stateL = arena_matrix(&at, STATE_DIM, STATE_DIM);
+	ws->stateTransition = arena_matrix(&at, STATE_DIM, STATE_DIM);
+	ws->statepriorL = arena_matrix(&at, STATE_DIM, STATE_DIM);
+	ws->stateMu = arena_vector(&at, STATE_DIM);
+	ws->statepriorMu = arena_vector(&at, STATE_DIM);
+	ws->measurementL = arena_matrix(&at, S, S);
+	ws->param.measurementInvSd = at;
+	ws->param.sensorX = at + S;
+	ws->param.sensorY = at + 2 * S;
+
+	/* Drawn from the prior at the first run */
+	ws->pf = pf_create(nParticles, NULL, &ws->opts);
+	ws->stats = ws->pf->stats;
+	ws->blockStats = ws->pf->blockStats;
+
+	return ws;
+}
+
+/**
+ * Stop tracing the filter and close the trace of the last run, if one is
+ * left open (e.g. by a run that failed).
+ */
+static void workspace_untrace(pf_workspace *ws) {
+	pf_trace(ws->pf, NULL, 0);
+	if (ws->trace == NULL)
+		return;
+
+	trace_close(ws->trace);
+	ws->trace = NULL;
+}
+
+/**
+ * Arm a workspace with a series and compute its noiseless solution. A series
+ * equal to the one armed (same length, sensors and bearings, compared bit by
+ * bit) keeps its noiseless solution.
+ *
+ * @param ws The workspace.
+ * @param T The length of the series, at most `maxT`.
+ * @param y Array of nSensors pointers, each to the T bearings of a sensor
+ * (e.g. the columns of an R matrix or data frame).
+ * @param sensorX Array of size nSensors with the x-coordinates of the
+ * sensors.
+ * @param sensorY Array of size nSensors with the y-coordinates of the
+ * sensors.
+ */
+void pf_workspace_data(pf_workspace *ws, int T, const double *const *y,
+		const double *sensorX, const double *sensorY) {
+	int changed = T != ws->T;
+
+	if (T < 1 || T > ws->maxT)
+		fatal("the series doesn't fit in the workspace");
+
+	ws->y.size1 = T;
+	ws->baseline.size1 = T;
+	ws->parallel.size = T;
+
+	/* Copy over what differs, NaN included */
+	for (int s = 0; s < ws->nSensors; s++) {
+		const double *src[POSITION_DIM] = {sensorX + s, sensorY + s};
+
+		for (int k = 0; k < T; k++) {
+			double *dst = gsl_matrix_ptr(&ws->y, k, s);
+
+			if (memcmp(dst, &y[s][k], sizeof(double)) != 0) {
+				*dst = y[s][k];
+				changed = 1;
+			}
+		}
+		for (int j = 0; j < POSITION_DIM; j++) {
+			double *dst = gsl_matrix_ptr(&ws->sensors, s, j);
+
+			if (memcmp(dst, src[j], sizeof(double)) != 0) {
+				*dst = *src[j];
+				changed = 1;
+			}
+		}
+	}
+
+	if (!changed)
+		return;
+
+	/* Unarmed until solved, in case the solver fails */
+	ws->T = 0;
+	noiseless(&ws->y, &ws->sensors, ws->opts.nThreads, &ws->baseline,
+							&ws->parallel);
+	ws->T = T;
+}
+
+/**
+ * Arm a workspace with a parameter set and run the filter over its series.
+ *
+ * @param ws The workspace, armed with a series (see `pf_workspace_data`).
+ * @param scalars The model parameters. Only the scalar members are read
+ * (dt, sr, q1, q2, state prior and importance factors).
+ * @param opts The filter settings. They may keep as much output as the
+ * workspace was sized for, or less.
+ * @param out The result where the output of each step will be stored (see
+ * `filter_result_alloc` and `filter_result_wrap`), or NULL to only compute
+ * the log-likelihood.
+ * @return The estimate of the log marginal likelihood log p(y_{1:T}).
+ */
+double pf_workspace_run(pf_workspace *ws, const model_param *scalars,
+		const filter_opt *opts, filter_result *out) {
+	model_param *param = &ws->param;
+	double *invSd = param->measurementInvSd;
+	double *sensorX = param->sensorX, *sensorY = param->sensorY;
+	pf_state *pf = ws->pf;
+	double logLik;
+
+	if (ws->T == 0)
+		fatal("the workspace has no data");
+	if (opts->output > ws->opts.output || (opts->output >= OUTPUT_QUANTILES
+			&& opts->nQuantiles > ws->opts.nQuantiles) ||
+			(opts->stats && !ws->opts.stats))
+		fatal("the workspace is too small for this output");
+
+	/* Model: the scalars, over the storage of the workspace */
+	*param = *scalars;
+	param->baseline = &ws->baseline;
+	param->sensors = &ws->sensors;
+	param->nSensors = ws->nSensors;
+	param->importanceL = &ws->importanceL;
+	param->stateL = &ws->stateL;
+	param->stateTransition = &ws->stateTransition;
+	param->statepriorL = &ws->statepriorL;
+	param->stateMu = &ws->stateMu;
+	param->statepriorMu = &ws->statepriorMu;
+	param->measurementL = &ws->measurementL;
+	param->measurementInvSd = invSd;
+	param->sensorX = sensorX;
+	param->sensorY = sensorY;
+
+	if (importance_set(param) != GSL_SUCCESS ||
+			state_set(param) != GSL_SUCCESS ||
+			measurement_set(param) != GSL_SUCCESS)
+		fatal("the variances of the model must be positive");
+
+	/* Filter: the settings of this run, over the memory of the workspace.
+	 * Keep what the arena was laid out for; statistics only on request. */
+	pf->opts = *opts;
+	pf->opts.nQuantiles = opts->output >= OUTPUT_QUANTILES ?
+						opts->nQuantiles : 0;
+	pf->stats = opts->stats ? ws->stats : NULL;
+	pf->blockStats = opts->stats ? ws->blockStats : NULL;
+	pf->nThreads = opts->nThreads > 0 ? opts->nThreads : 1;
+	pf_reset(pf, param, opts->seed);
+
+	/* The trace is kept by the workspace until closed, so that the next
+	 * run or `pf_workspace_destroy` closes it if this run fails */
+	workspace_untrace(ws);
+	if (opts->trace != NULL) {
+		ws->trace = trace_open(opts->trace);
+		pf_trace(pf, ws->trace, 0);
+	}
+
+	logLik = pf_run(pf, &ws->y, out);
+	workspace_untrace(ws);
+
+	return logLik;
+}
+
+/**
+ * Free a workspace.
+ *
+ * @param ws The workspace.
+ */
+void pf_workspace_destroy(pf_workspace *ws) {
+	workspace_untrace(ws);
+	pf_destroy(ws->pf);
+	free(ws->arena);
+	free(ws);
+}
@@ -0,0 +1,52 @@
+/**
+ * @file workspace.h
+ * @authors Luis Damiano
+ * @version 0.1
+ * @details
+ *
+ * Header for the reusable filter workspace.
+ */
+
+#ifndef C_WORKSPACE_H_
+#define C_WORKSPACE_H_
+
+/**
+ * Everything a run needs, sized once for (N, T_max, nSensors): the filter,
+ * the measurements, the noiseless solution and the model parameters. Runs
+ * re-arm it with new data or parameters and never allocate; a series equal
+ * to the one armed is kept as it is.
+ */
+typedef struct pf_workspaces {
+	int nParticles; /**< Number of particles */
+	int maxT; /**< Largest series it can hold */
+	int nSensors; /**< Number of sensors */
+	int T; /**< Length of the series armed, 0 for none */
+	filter_opt opts; /**< Settings it was sized for */
+	pf_state *pf; /**< The filter */
+	filter_stats *stats, *blockStats; /**< Statistics memory of the filter,
+			NULL unless sized for them. Runs without lend none */
+	model_param param; /**< Model parameters, over the arena */
+	trace_state *trace; /**< Trace of the run in progress, or of one that
+			failed, NULL for none */
+
+	/* Views over the arena, T rows long once armed */
+	gsl_matrix y; /**< T x nSensors measurements */
+	gsl_matrix sensors; /**< nSensors x POSITION_DIM sensor locations */
+	gsl_matrix baseline; /**< T x POSITION_DIM noiseless solution */
+	gsl_vector parallel; /**< T flags of near-parallel bearings */
+	gsl_matrix importanceL, stateL, stateTransition, statepriorL;
+	gsl_matrix measurementL;
+	gsl_vector stateMu, statepriorMu;
+
+	double *arena; /**< Memory of all the views and arrays above */
+} pf_workspace;
+
+pf_workspace *pf_workspace_create(int nParticles, int maxT, int nSensors,
+		const filter_opt *opts);
+void pf_workspace_data(pf_workspace *ws, int T, const double *const *y,
+		const double *sensorX, const double *sensorY);
+double pf_workspace_run(pf_workspace *ws, const model_param *scalars,
+		const filter_opt *opts, filter_result *out);
+void pf_workspace_destroy(pf_workspace *ws);
+
+#endif /* C_WORKSPACE_H_ */
@@ -0,0 +1,892 @@
+/**
+ * @file bench.c
+ * @authors Luis Damiano
+ * @version 0.1
+ * @details
+ *
+ * Benchmarks for the hot paths of the filter, built from the same sources
+ * as the package (see tools/Makefile).
+ *
+ * The measurements are synthetic: bearings of a known trajectory (a loop
+ * south of the sensors, as in the vehicle dataset) plus Gaussian noise, so
+ * the series can be as long as needed. The filter is swept over particle
+ * counts, series lengths and thread counts, and each run reports the time
+ * per particle-step, the throughput, a breakdown over the phases of a step
+ * (see the pf_phase_* functions in filter.c), the distance to the true
+ * trajectory and the peak resident set size of the process so far. The same
+ * runs are repeated with each proposal (see proposal.c), with and without
+ * Rao-Blackwellizing the velocity (see rbpf.c), on the first thread count,
+ * to weigh the accuracy of each against its time. `noiseless`, `load_data`
+ * and the batch kernels are timed on their own. The polynomial atan2 kernels
+ * (see `batch_atan2`) are timed and checked against libm over the geometry
+ * of the vehicle dataset; the exit status is EXIT_FAILURE if one of them is
+ * off by more than its bound. The output is a JSON document, so runs of
+ * different releases can be compared by a script.
+ *
+ * Usage:
+ *	./bench [-n particles] [-T steps] [-t threads] [-S sensors]
+ *		[-q diffusion] [-r reps] [-m seconds] [-d dir] [-o file]
+ *
+ *	-n, -T and -t take comma-separated lists, e.g. -n 1000,10000.
+ *	-S is the number of sensors (2 or 3), -q the diffusion coefficient
+ *	of the state model on both axes (by default that of src/main.c, far
+ *	above the 1e-11 or so that fits the synthetic trajectory), -r the
+ *	number of repetitions of each filter run (the best one is
+ *	reported), -m the least time spent on each microbenchmark, -d the
+ *	directory for the temporary files of the `load_data` benchmark and
+ *	-o the output file (stdout by default).
+ *
+ * Compile:
+ *	make -C tools
+ *
+ * Troubleshooting:
+ *	The peak resident set size of a filter run (processPeakRssKb) is
+ *	that of the whole process so far, not of the run alone: it only
+ *	tracks the run while particle counts and series lengths are listed
+ *	in increasing order.
+ */
+
+#include "main.h"
+
+#include <time.h> /* clock_gettime */
+#ifndef _WIN32
+#include <sys/resource.h> /* getrusage */
+#endif
+#ifdef _OPENMP
+#include <omp.h> /* omp_get_max_threads */
+#endif
+
+#define BENCH_VERSION 5 /* int, bump when the output changes */
+#define BENCH_MAX_LIST 32 /* int */
+#define BENCH_DATA_SEED 20190601 /* unsigned long, synthetic bearings */
+#define BENCH_LOAD_MIN_ROWS 100000 /* int */
+#define BENCH_BEARING_GRID 1000 /* int, grid points per side */
+
+/* Measurement model constants (as in src/main.c) */
+#define DT 1.0
+#define MEASUREMENT_ERROR_1 0.01
+
+/* One row per sensor. The third one is only used with -S 3. */
+static const double SENSORS[][POSITION_DIM] = {
+	{-93.2494663765932, 41.5563518606521},
+	{-93.2475338232000, 41.5576632356000},
+	{-93.2512000000000, 41.5571000000000}
+};
+
+/* State model, changed by -q */
+static double stateDiffusion = 0.0005;
+
+/* State prior */
+#define STATEPRIOR_MU_X -93.24952047
+#define STATEPRIOR_MU_Y 41.55575337
+#define STATEPRIOR_L_00 5.0E-09
+#define STATEPRIOR_L_11 3.5E-08
+#define STATEPRIOR_L_22 5.0E-04
+#define STATEPRIOR_L_33 5.0E-04
+
+/* Importance distribution */
+#define IMPORTANCE_L_00 3 * 5.00E-10
+#define IMPORTANCE_L_11 3 * 1.75E-08
+#define IMPORTANCE_L_22 3 * 5.00E-05
+#define IMPORTANCE_L_33 3 * 5.00E-05
+
+/* Synthetic trajectory: a loop of this radius and period (steps) */
+#define TRUTH_RADIUS 2.0E-04
+#define TRUTH_PERIOD 600.0
+
+/* Phases of a step, in order */
+typedef enum bench_phases {
+	PHASE_BEGIN = 0,
+	PHASE_PROPAGATE,
+	PHASE_MAX,
+	PHASE_WEIGHTS,
+	PHASE_NORMALIZE,
+	PHASE_MOMENTS,
+	PHASE_SUMMARIZE,
+	PHASE_GATHER,
+	PHASE_END,
+	N_PHASES
+} bench_phase;
+
+static const char *const PHASE_NAMES[N_PHASES] = {
+	"begin", "propagate", "max", "weights", "normalize", "moments",
+	"summarize", "gather", "end"
+};
+
+/* In the order of proposal_type */
+static const char *const PROPOSAL_NAMES[] = {
+	"legacy", "bootstrap", "baseline", "optimal"
+};
+
+/**
+ * Read a monotonic clock.
+ *
+ * @return The time in seconds since an arbitrary origin.
+ */
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+/**
+ * Read the peak resident set size of the process.
+ *
+ * @return The peak in kilobytes, or -1 where it isn't available.
+ */
+static long peak_rss_kb(void) {
+#ifdef _WIN32
+	return -1;
+#else
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) != 0)
+		return -1;
+#ifdef __APPLE__
+	return ru.ru_maxrss / 1024; /* bytes on macOS */
+#else
+	return ru.ru_maxrss;
+#endif
+#endif
+}
+
+/**
+ * Print an error in the command line and the usage, and exit with failure.
+ * (`fatal` would print the usage of the filter.)
+ *
+ * @param message Error message.
+ */
+static void usage_error(const char *message) {
+	fprintf(stderr, "FATAL: %s.\n", message);
+	fprintf(stderr, "\nUsage:\n\t./bench [-n particles] [-T steps] "
+			"[-t threads] [-S sensors]\n\t\t[-q diffusion] "
+			"[-r reps] [-m seconds] [-d dir] [-o file]\n");
+
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * Parse a comma-separated list of positive integers.
+ *
+ * @param s The list.
+ * @param out Array of size BENCH_MAX_LIST where the values will be stored.
+ * @return The number of values.
+ */
+static int parse_list(const char *s, int *out) {
+	int n = 0;
+	char *end;
+
+	while (*s != '\0') {
+		long v = strtol(s, &end, 10);
+
+		if (end == s || v < 1 || n == BENCH_MAX_LIST)
+			usage_error("lists must be up to 32 "
+					"comma-separated positive integers");
+		out[n++] = (int)v;
+		s = *end == ',' ? end + 1 : end;
+		if (*end != ',' && *end != '\0')
+			usage_error("lists must be up to 32 "
+					"comma-separated positive integers");
+	}
+
+	return n;
+}
+
+/**
+ * Simulate noisy bearings of a known trajectory.
+ *
+ * @param sensors The nSensors x POSITION_DIM sensor locations.
+ * @param sr The variance of the bearing noise.
+ * @param yOut The T x nSensors matrix where the bearings will be stored.
+ */
+static void synthetic_bearings(const gsl_matrix *sensors, double sr,
+		gsl_matrix *yOut) {
+	const int T = yOut->size1, nSensors = yOut->size2;
+	const double sd = sqrt(sr);
+	double *z = (double *)malloc(STATE_DIM * T * sizeof(double));
+
+	if (z == NULL)
+		fatal("couldn't allocate the synthetic bearings");
+	if (nSensors > STATE_DIM)
+		fatal("the synthetic bearings support up to 4 sensors");
+
+	/* Draws come in fours, one per step: one for each sensor */
+	rng_normals(BENCH_DATA_SEED, RNG_PROPOSAL, 0, 0, T, z);
+
+	for (int k = 0; k < T; k++) {
+		double phase = TWO_PI * k / TRUTH_PERIOD;
+		double px = STATEPRIOR_MU_X + TRUTH_RADIUS * sin(phase);
+		double py = STATEPRIOR_MU_Y - TRUTH_RADIUS * (1 - cos(phase));
+
+		for (int s = 0; s < nSensors; s++) {
+			double a = atan2(py - gsl_matrix_get(sensors, s, 1),
+					px - gsl_matrix_get(sensors, s, 0));
+			a += sd * z[s * T + k];
+			gsl_matrix_set(yOut, k, s, WRAP_ANGLE(a));
+		}
+	}
+
+	free(z);
+}
+
+/**
+ * Set up the model parameters used by every benchmark.
+ *
+ * @param sensors The nSensors x POSITION_DIM sensor locations.
+ * @param baseline The noiseless solution, or NULL to solve it on the fly.
+ * @param param Pointer to the parameters. Free with `param_free`.
+ */
+static void param_init(const gsl_matrix *sensors, gsl_matrix *baseline,
+		model_param *param) {
+	param->baseline = baseline;
+	param->dt = DT;
+	param->sensors = sensors;
+	param->sr = MEASUREMENT_ERROR_1;
+
+	param->q1 = stateDiffusion;
+	param->q2 = stateDiffusion;
+
+	param->statepriorMuX = STATEPRIOR_MU_X;
+	param->statepriorMuY = STATEPRIOR_MU_Y;
+	param->statepriorL00 = STATEPRIOR_L_00;
+	param->statepriorL11 = STATEPRIOR_L_11;
+	param->statepriorL22 = STATEPRIOR_L_22;
+	param->statepriorL33 = STATEPRIOR_L_33;
+
+	param->importanceL00 = IMPORTANCE_L_00;
+	param->importanceL11 = IMPORTANCE_L_11;
+	param->importanceL22 = IMPORTANCE_L_22;
+	param->importanceL33 = IMPORTANCE_L_33;
+
+	importance_init(param);
+	state_init(param);
+	measurement_init(param);
+}
+
+static void param_free(model_param *param) {
+	importance_free(param);
+	state_free(param);
+	measurement_free(param);
+}
+
+/**
+ * Advance the filter by one time step, as `pf_step` does, adding the time
+ * spent in each phase to `phaseTime`.
+ *
+ * @param pf The filter.
+ * @param yk Array of size nSensors with the measurement at this step.
+ * @param out Pointer where the summaries of this step will be stored.
+ * @param phaseTime Array of size N_PHASES with the cumulative times.
+ */
+static void timed_step(pf_state *pf, const double *yk, pf_summary *out,
+		double *phaseTime) {
+	const int nBlocks = pf->nBlocks;
+	double t0 = now(), t1;
+
+#define LAP(phase) do { t1 = now(); phaseTime[phase] += t1 - t0; \
+	t0 = t1; } while (0)
+
+	pf_phase_begin(pf, yk);
+	LAP(PHASE_BEGIN);
+
+#pragma omp parallel for num_threads(pf->nThreads) schedule(static)
+	for (int b = 0; b < nBlocks; b++)
+		pf_phase_propagate(pf, yk, b);
+	LAP(PHASE_PROPAGATE);
+
+	pf_phase_max(pf);
+	LAP(PHASE_MAX);
+
+#pragma omp parallel for num_threads(pf->nThreads) schedule(static)
+	for (int b = 0; b < nBlocks; b++)
+		pf_phase_weights(pf, b);
+	LAP(PHASE_WEIGHTS);
+
+	pf_phase_normalize(pf, out);
+	LAP(PHASE_NORMALIZE);
+
+#pragma omp parallel for num_threads(pf->nThreads) schedule(static)
+	for (int b = 0; b < nBlocks; b++)
+		pf_phase_moments(pf, b);
+	LAP(PHASE_MOMENTS);
+
+	pf_phase_summarize(pf, out);
+	LAP(PHASE_SUMMARIZE);
+
+	if (pf->resampled) {
+#pragma omp parallel for num_threads(pf->nThreads) schedule(static)
+		for (int b = 0; b < nBlocks; b++)
+			pf_phase_gather(pf, b);
+	}
+	LAP(PHASE_GATHER);
+
+	pf_phase_end(pf);
+	LAP(PHASE_END);
+
+#undef LAP
+}
+
+/**
+ * Benchmark whole filter runs for one configuration and write a JSON object.
+ *
+ * The best of `reps` runs through `pf_run` gives the headline numbers. One
+ * more run steps through the phases by hand to break the time down.
+ *
+ * @param fp The output.
+ * @param y The measurements.
+ * @param sensors The nSensors x POSITION_DIM sensor locations.
+ * @param nParticles The number of particles.
+ * @param nThreads The number of threads.
+ * @param reps The number of repetitions.
+ * @param proposal The proposal.
+ * @param raoBlackwell Whether to marginalize the velocity.
+ */
+static void bench_filter(FILE *fp, const gsl_matrix *y,
+		const gsl_matrix *sensors, int nParticles, int nThreads,
+		int reps, proposal_type proposal, int raoBlackwell) {
+	const int T = y->size1;
+	const double particleSteps = (double)nParticles * T;
+	double best = INFINITY, total = 0, timed, logLik = 0, sse = 0;
+	double phaseTime[N_PHASES] = {0};
+	gsl_matrix *baseline = gsl_matrix_alloc(T, POSITION_DIM);
+	model_param param;
+	filter_opt opts;
+	filter_result *res;
+	pf_summary sk;
+	pf_state *pf;
+
+	noiseless(y, sensors, nThreads, baseline, NULL);
+	param_init(sensors, baseline, &param);
+
+	opts.seed = 0;
+	opts.nThreads = nThreads;
+	opts.resampleScheme = RESAMPLE_SYSTEMATIC;
+	opts.essThreshold = 0.5;
+	opts.output = OUTPUT_SUMMARY;
+	opts.nQuantiles = 0;
+	opts.quantileProbs = NULL;
+	opts.smoother = SMOOTHER_NONE;
+	opts.lag = 0;
+	opts.nTrajectories = 0;
+	opts.proposal = proposal;
+	opts.raoBlackwell = raoBlackwell;
+	opts.bearingTol = 0;
+	opts.stats = 0;
+	opts.trace = NULL;
+
+	res = filter_result_alloc(T, nParticles, &opts);
+	pf = pf_create(nParticles, &param, &opts);
+
+	for (int r = 0; r < reps; r++) {
+		double t0 = now(), dt;
+
+		pf_reset(pf, &param, opts.seed);
+		logLik = pf_run(pf, y, res);
+		dt = now() - t0;
+
+		total += dt;
+		if (dt < best)
+			best = dt;
+	}
+
+	/* Distance between the posterior mean and the true position */
+	for (int k = 0; k < T; k++) {
+		double phase = TWO_PI * k / TRUTH_PERIOD;
+		double ex = gsl_matrix_get(res->xMean, k, 0) -
+			(STATEPRIOR_MU_X + TRUTH_RADIUS * sin(phase));
+		double ey = gsl_matrix_get(res->xMean, k, 1) -
+			(STATEPRIOR_MU_Y - TRUTH_RADIUS * (1 - cos(phase)));
+		sse += ex * ex + ey * ey;
+	}
+
+	pf_reset(pf, &param, opts.seed);
+	timed = now();
+	for (int k = 0; k < T; k++)
+		timed_step(pf, y->data + k * y->tda, &sk, phaseTime);
+	timed = now() - timed;
+
+	fprintf(fp, "    {\"proposal\": \"%s\", \"raoBlackwell\": %s, "
+			"\"particles\": %d, \"steps\": %d, \"threads\": %d, "
+			"\"reps\": %d,\n", PROPOSAL_NAMES[proposal],
+			raoBlackwell ? "true" : "false", nParticles, T,
+			nThreads, reps);
+	fprintf(fp, "     \"seconds\": %.6e, \"meanSeconds\": %.6e,\n",
+			best, total / reps);
+	fprintf(fp, "     \"nsPerParticleStep\": %.4f, "
+			"\"particleStepsPerSecond\": %.6e,\n",
+			1e9 * best / particleSteps, particleSteps / best);
+	fprintf(fp, "     \"phaseNsPerParticleStep\": {");
+	for (int j = 0; j < N_PHASES; j++)
+		fprintf(fp, "%s\"%s\": %.4f", j ? ", " : "", PHASE_NAMES[j],
+				1e9 * phaseTime[j] / particleSteps);
+	fprintf(fp, "},\n");
+	fprintf(fp, "     \"phaseSeconds\": %.6e, \"logLik\": %.10g, "
+			"\"positionRmse\": %.6e, \"processPeakRssKb\": %ld}",
+			timed, logLik, sqrt(sse / T), peak_rss_kb());
+
+	pf_destroy(pf);
+	filter_result_free(res);
+	param_free(&param);
+	gsl_matrix_free(baseline);
+}
+
+/**
+ * Time the batch kernels on one generation and write JSON objects.
+ *
+ * @param fp The output.
+ * @param y The measurements.
+ * @param sensors The nSensors x POSITION_DIM sensor locations.
+ * @param n The number of particles.
+ * @param minTime The least time spent on each kernel, in seconds.
+ * @param first Whether this is the first object of the array.
+ */
+static void bench_kernels(FILE *fp, const gsl_matrix *y,
+		const gsl_matrix *sensors, int n, double minTime, int first) {
+	enum {K_NORMALS = 0, K_UNIFORMS, K_STATEPRIOR_R, K_IMPORTANCE_R,
+		K_MEASUREMENT_LPDF, K_STATE_LPDF, K_IMPORTANCE_LPDF,
+		K_RESAMPLE, K_RESAMPLE_GEN, N_KERNELS};
+	static const char *const KERNEL_NAMES[N_KERNELS] = {
+		"rng_normals", "rng_uniforms", "batch_stateprior_r",
+		"batch_importance_r", "batch_measurement_lpdf",
+		"batch_state_lpdf", "batch_importance_lpdf", "resample",
+		"resample_gen"
+	};
+	const double mu[STATE_DIM] = {STATEPRIOR_MU_X, STATEPRIOR_MU_Y, 0, 0};
+	const double *yk = y->data;
+	particle_gen *x = particle_gen_alloc(n);
+	particle_gen *xPrev = particle_gen_alloc(n);
+	double *z = (double *)malloc(STATE_DIM * n * sizeof(double));
+	double *lpdf = (double *)malloc(n * sizeof(double));
+	double *w = (double *)malloc(n * sizeof(double));
+	double *work = (double *)malloc(RESAMPLE_WORK_SIZE(n) *
+							sizeof(double));
+	int *ancestor = (int *)malloc(n * sizeof(int));
+	model_param param;
+
+	if (z == NULL || lpdf == NULL || w == NULL || work == NULL ||
+			ancestor == NULL)
+		fatal("couldn't allocate the kernel benchmark");
+
+	param_init(sensors, NULL, &param);
+	rng_normals(0, RNG_PROPOSAL, 0, 0, n, z);
+	batch_stateprior_r(z, &param, xPrev);
+	batch_importance_r(z, mu, &param, x);
+	for (int i = 0; i < n; i++)
+		w[i] = 1.0 / n;
+
+	for (int j = 0; j < N_KERNELS; j++) {
+		long calls = 0;
+		double t0 = now(), elapsed;
+
+		do {
+			switch (j) {
+			case K_NORMALS:
+				rng_normals(0, RNG_PROPOSAL, 1 + calls, 0, n,
+						z);
+				break;
+			case K_UNIFORMS:
+				rng_uniforms(0, RNG_RESAMPLE, 1 + calls, 0, n,
+						work);
+				break;
+			case K_STATEPRIOR_R:
+				batch_stateprior_r(z, &param, x);
+				break;
+			case K_IMPORTANCE_R:
+				batch_importance_r(z, mu, &param, x);
+				break;
+			case K_MEASUREMENT_LPDF:
+				batch_measurement_lpdf(yk, x, &param, 0,
+								lpdf);
+				break;
+			case K_STATE_LPDF:
+				batch_state_lpdf(x, mu, &param, lpdf);
+				break;
+			case K_IMPORTANCE_LPDF:
+				batch_importance_lpdf(x, xPrev, &param, lpdf);
+				break;
+			case K_RESAMPLE:
+				rng_uniforms(0, RNG_RESAMPLE, 1, 0, n + 1,
+						work);
+				resample(RESAMPLE_SYSTEMATIC, w, n, work,
+						ancestor);
+				break;
+			case K_RESAMPLE_GEN:
+				resample_gen(x, ancestor, xPrev);
+				break;
+			}
+			calls++;
+			elapsed = now() - t0;
+		} while (elapsed < minTime);
+
+		fprintf(fp, "%s    {\"kernel\": \"%s\", \"particles\": %d, "
+				"\"calls\": %ld, \"nsPerParticle\": %.4f}",
+				first && j == 0 ? "" : ",\n", KERNEL_NAMES[j],
+				n, calls, 1e9 * elapsed / ((double)calls * n));
+	}
+
+	param_free(&param);
+	free(ancestor);
+	free(work);
+	free(w);
+	free(lpdf);
+	free(z);
+	particle_gen_free(xPrev);
+	particle_gen_free(x);
+}
+
+/**
+ * Check and time the atan2 kernels on the bearings of the sensors and write
+ * JSON objects.
+ *
+ * The points cover a square grid around the sensors and the trajectory,
+ * twice as wide as them, plus a full turn around each sensor through the
+ * axes and +-pi. Errors are wrapped, as in the measurement density.
+ *
+ * @param fp The output.
+ * @param sensors The nSensors x POSITION_DIM sensor locations.
+ * @param minTime The least time spent on each kernel, in seconds.
+ * @return The number of kernels off by more than their bound.
+ */
+static int bench_bearings(FILE *fp, const gsl_matrix *sensors,
+		double minTime) {
+	static const double TOLS[] = {0, 1e-4, 2e-6, 4e-8, 1e-9};
+	const int nTols = sizeof(TOLS) / sizeof(TOLS[0]);
+	const int nSensors = sensors->size1, G = BENCH_BEARING_GRID;
+	const int n = nSensors * (G * G + 4 * G + 1);
+	double x0 = STATEPRIOR_MU_X - TRUTH_RADIUS;
+	double x1 = STATEPRIOR_MU_X + TRUTH_RADIUS;
+	double y0 = STATEPRIOR_MU_Y - 2 * TRUTH_RADIUS, y1 = STATEPRIOR_MU_Y;
+	double *dx = (double *)malloc(n * sizeof(double));
+	double *dy = (double *)malloc(n * sizeof(double));
+	double *exact = (double *)malloc(n * sizeof(double));
+	double *fast = (double *)malloc(n * sizeof(double));
+	double w, h;
+	int nFailed = 0, i = 0;
+
+	if (dx == NULL || dy == NULL || exact == NULL || fast == NULL)
+		fatal("couldn't allocate the bearing benchmark");
+
+	/* Bounding box of the sensors and the trajectory, doubled */
+	for (int s = 0; s < nSensors; s++) {
+		x0 = fmin(x0, gsl_matrix_get(sensors, s, 0));
+		x1 = fmax(x1, gsl_matrix_get(sensors, s, 0));
+		y0 = fmin(y0, gsl_matrix_get(sensors, s, 1));
+		y1 = fmax(y1, gsl_matrix_get(sensors, s, 1));
+	}
+	w = x1 - x0;
+	h = y1 - y0;
+	x0 -= w / 2;
+	x1 += w / 2;
+	y0 -= h / 2;
+	y1 += h / 2;
+
+	for (int s = 0; s < nSensors; s++) {
+		const double lx = gsl_matrix_get(sensors, s, 0);
+		const double ly = gsl_matrix_get(sensors, s, 1);
+		const double r = fmax(x1 - x0, y1 - y0) / 2;
+
+		for (int a = 0; a < G; a++)
+			for (int b = 0; b < G; b++, i++) {
+				dx[i] = x0 + (x1 - x0) * a / (G - 1) - lx;
+				dy[i] = y0 + (y1 - y0) * b / (G - 1) - ly;
+			}
+
+		/* A full turn, from -pi to pi, through the axes exactly */
+		for (int a = 0; a <= 4 * G; a++, i++) {
+			double phase = TWO_PI * a / (4 * G) - TWO_PI / 2;
+
+			dx[i] = r * cos(phase);
+			dy[i] = r * sin(phase);
+			if (a % G == 0 && (a / G) % 2 == 0)
+				dy[i] = copysign(0.0, dy[i]);
+			else if (a % G == 0)
+				dx[i] = 0.0;
+		}
+	}
+
+	batch_atan2(dy, dx, n, 0, exact);
+
+	for (int j = 0; j < nTols; j++) {
+		long calls = 0;
+		double t0 = now(), elapsed, bound, maxError = 0;
+
+		do {
+			bound = batch_atan2(dy, dx, n, TOLS[j], fast);
+			calls++;
+			elapsed = now() - t0;
+		} while (elapsed < minTime);
+
+		for (int k = 0; k < n; k++) {
+			double e = fast[k] - exact[k];
+
+			e = fabs(WRAP_ANGLE(e));
+			if (!(e <= maxError))
+				maxError = e;
+		}
+		if (!(maxError <= bound))
+			nFailed++;
+
+		fprintf(fp, "%s    {\"tolerance\": %.1e, \"bound\": %.1e, "
+				"\"points\": %d, \"maxError\": %.3e, "
+				"\"withinBound\": %s, \"nsPerBearing\": %.4f}",
+				j == 0 ? "" : ",\n", TOLS[j], bound, n,
+				maxError, maxError <= bound ? "true" : "false",
+				1e9 * elapsed / ((double)calls * n));
+	}
+
+	free(fast);
+	free(exact);
+	free(dy);
+	free(dx);
+
+	return nFailed;
+}
+
+/**
+ * Time the noiseless solution of a whole series and write a JSON object.
+ *
+ * @param fp The output.
+ * @param y The measurements.
+ * @param sensors The nSensors x POSITION_DIM sensor locations.
+ * @param nThreads The number of threads.
+ * @param minTime The least time spent, in seconds.
+ */
+static void bench_noiseless(FILE *fp, const gsl_matrix *y,
+		const gsl_matrix *sensors, int nThreads, double minTime) {
+	gsl_matrix *solution = gsl_matrix_alloc(y->size1, POSITION_DIM);
+	gsl_vector *parallel = gsl_vector_alloc(y->size1);
+	long calls = 0;
+	double t0 = now(), elapsed;
+
+	do {
+		noiseless(y, sensors, nThreads, solution, parallel);
+		calls++;
+		elapsed = now() - t0;
+	} while (elapsed < minTime);
+
+	fprintf(fp, "    {\"steps\": %d, \"sensors\": %d, \"threads\": %d, "
+			"\"calls\": %ld, \"nsPerStep\": %.4f}",
+			(int)y->size1, (int)y->size2, nThreads, calls,
+			1e9 * elapsed / ((double)calls * y->size1));
+
+	gsl_vector_free(parallel);
+	gsl_matrix_free(solution);
+}
+
+/**
+ * Time `load_data` on one file and write a JSON object.
+ *
+ * @param fp The output.
+ * @param filename The file, holding `nRows` rows.
+ * @param format The name of the format, for the output.
+ * @param nRows The number of rows in the file.
+ * @param minTime The least time spent, in seconds.
+ */
+static void bench_load(FILE *fp, char *filename, const char *format,
+		int nRows, double minTime) {
+	gsl_matrix *y;
+	gsl_vector *timestamps;
+	long calls = 0, bytes;
+	double t0 = now(), elapsed;
+	FILE *f = fopen(filename, "rb");
+
+	if (f == NULL)
+		fatal("couldn't open the load benchmark file");
+	fseek(f, 0L, SEEK_END);
+	bytes = ftell(f);
+	fclose(f);
+
+	do {
+		load_data(filename, &y, &timestamps);
+		if ((int)y->size1 != nRows)
+			fatal("load_data read the wrong number of rows");
+		gsl_matrix_free(y);
+		if (timestamps != NULL)
+			gsl_vector_free(timestamps);
+		calls++;
+		elapsed = now() - t0;
+	} while (elapsed < minTime);
+
+	fprintf(fp, "    {\"format\": \"%s\", \"rows\": %d, \"bytes\": %ld, "
+			"\"calls\": %ld, \"nsPerRow\": %.4f, "
+			"\"megabytesPerSecond\": %.4f}",
+			format, nRows, bytes, calls,
+			1e9 * elapsed / ((double)calls * nRows),
+			1e-6 * bytes * calls / elapsed);
+}
+
+int main(int argc, char** argv)
+{
+	int particles[BENCH_MAX_LIST] = {1000, 10000, 100000};
+	int steps[BENCH_MAX_LIST] = {100, 500};
+	int threads[BENCH_MAX_LIST] = {1};
+	int nParticleList = 3, nStepList = 2, nThreadList = 1;
+	int nSensors = 2, reps = 3, maxT = 0, nFailed, opt;
+	double minTime = 0.2;
+	const char *dir = ".";
+	char textFile[FILENAME_MAX], binFile[FILENAME_MAX];
+	FILE *fp = stdout;
+
+#ifdef _OPENMP
+	/* Powers of two up to the available threads */
+	nThreadList = 0;
+	for (int t = 1; t < omp_get_max_threads(); t *= 2)
+		threads[nThreadList++] = t;
+	threads[nThreadList++] = omp_get_max_threads();
+#endif
+
+	while ((opt = getopt(argc, argv, "n:T:t:S:q:r:m:d:o:")) != -1) {
+		switch (opt) {
+		case 'n':
+			nParticleList = parse_list(optarg, particles);
+			break;
+		case 'T':
+			nStepList = parse_list(optarg, steps);
+			break;
+		case 't':
+			nThreadList = parse_list(optarg, threads);
+			break;
+		case 'S':
+			nSensors = atoi(optarg);
+			break;
+		case 'q':
+			stateDiffusion = atof(optarg);
+			break;
+		case 'r':
+			reps = atoi(optarg);
+			break;
+		case 'm':
+			minTime = atof(optarg);
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		case 'o':
+			fp = fopen(optarg, "w");
+			if (fp == NULL)
+				usage_error("couldn't create the output file");
+			break;
+		default:
+			usage_error("unknown option");
+		}
+	}
+
+	if (nSensors < 2 || nSensors > (int)(sizeof(SENSORS) /
+							sizeof(SENSORS[0])))
+		usage_error("the number of sensors must be 2 or 3");
+	if (reps < 1)
+		usage_error("the number of repetitions must be positive");
+	if (!(stateDiffusion > 0))
+		usage_error("the diffusion coefficient must be positive");
+
+	gsl_matrix *sensors = gsl_matrix_alloc(nSensors, POSITION_DIM);
+	for (int s = 0; s < nSensors; s++) {
+		gsl_matrix_set(sensors, s, 0, SENSORS[s][0]);
+		gsl_matrix_set(sensors, s, 1, SENSORS[s][1]);
+	}
+
+	for (int j = 0; j < nStepList; j++)
+		if (steps[j] > maxT)
+			maxT = steps[j];
+	if (maxT < BENCH_LOAD_MIN_ROWS)
+		maxT = BENCH_LOAD_MIN_ROWS;
+
+	/* Every series is a prefix of the longest one */
+	gsl_matrix *yAll = gsl_matrix_alloc(maxT, nSensors);
+	synthetic_bearings(sensors, MEASUREMENT_ERROR_1, yAll);
+
+	fprintf(fp, "{\n  \"benchVersion\": %d,\n", BENCH_VERSION);
+#ifdef _OPENMP
+	fprintf(fp, "  \"openmp\": true, \"maxThreads\": %d,\n",
+			omp_get_max_threads());
+#else
+	fprintf(fp, "  \"openmp\": false, \"maxThreads\": 1,\n");
+#endif
+	fprintf(fp, "  \"blockSize\": %d, \"sensors\": %d, "
+			"\"diffusion\": %.6e,\n", FILTER_BLOCK_SIZE, nSensors,
+			stateDiffusion);
+
+	/* Whole filter runs */
+	fprintf(fp, "  \"filter\": [\n");
+	for (int a = 0, first = 1; a < nStepList; a++) {
+		gsl_matrix_const_view y = gsl_matrix_const_submatrix(yAll, 0, 0,
+							steps[a], nSensors);
+
+		for (int b = 0; b < nParticleList; b++)
+			for (int c = 0; c < nThreadList; c++, first = 0) {
+				fprintf(fp, first ? "" : ",\n");
+				bench_filter(fp, &y.matrix, sensors,
+						particles[b], threads[c], reps,
+						PROPOSAL_LEGACY, 0);
+				fflush(fp);
+			}
+	}
+	fprintf(fp, "\n  ],\n");
+
+	/* Accuracy against time of each proposal, Rao-Blackwellized or not
+	 * (the legacy one can't be) */
+	fprintf(fp, "  \"proposals\": [\n");
+	for (int p = 0, first = 1; p <= PROPOSAL_OPTIMAL; p++)
+	for (int rb = 0; rb <= (p != PROPOSAL_LEGACY); rb++)
+		for (int a = 0; a < nStepList; a++) {
+			gsl_matrix_const_view y = gsl_matrix_const_submatrix(
+					yAll, 0, 0, steps[a], nSensors);
+
+			for (int b = 0; b < nParticleList; b++, first = 0) {
+				fprintf(fp, first ? "" : ",\n");
+				bench_filter(fp, &y.matrix, sensors,
+						particles[b], threads[0], reps,
+						(proposal_type)p, rb);
+				fflush(fp);
+			}
+		}
+	fprintf(fp, "\n  ],\n");
+
+	/* Batch kernels, single-threaded */
+	fprintf(fp, "  \"kernels\": [\n");
+	for (int b = 0; b < nParticleList; b++)
+		bench_kernels(fp, yAll, sensors, particles[b], minTime, b == 0);
+	fprintf(fp, "\n  ],\n");
+
+	/* Polynomial atan2, single-threaded */
+	fprintf(fp, "  \"bearings\": [\n");
+	nFailed = bench_bearings(fp, sensors, minTime);
+	fprintf(fp, "\n  ],\n");
+
+	/* Noiseless solution */
+	fprintf(fp, "  \"noiseless\": [\n");
+	for (int c = 0; c < nThreadList; c++) {
+		fprintf(fp, c ? ",\n" : "");
+		bench_noiseless(fp, yAll, sensors, threads[c], minTime);
+	}
+	fprintf(fp, "\n  ],\n");
+
+	/* Reading the measurements, from text and columnar files */
+	snprintf(textFile, sizeof(textFile), "%s/bench_measurements.txt", dir);
+	snprintf(binFile, sizeof(binFile), "%s/bench_measurements.bin", dir);
+	GSL_MAT_TO_CSV(yAll, textFile);
+	columnar_write_matrix(binFile, yAll, NULL);
+
+	fprintf(fp, "  \"loadData\": [\n");
+	bench_load(fp, textFile, "text", maxT, minTime);
+	fprintf(fp, ",\n");
+	bench_load(fp, binFile, "columnar", maxT, minTime);
+	fprintf(fp, "\n  ],\n");
+
+	remove(textFile);
+	remove(binFile);
+
+	fprintf(fp, "  \"peakRssKb\": %ld\n}\n", peak_rss_kb());
+
+	/* Clean up */
+	if (fp != stdout)
+		fclose(fp);
+	gsl_matrix_free(yAll);
+	gsl_matrix_free(sensors);
+
+	if (nFailed > 0)
+		fatal("an atan2 kernel is off by more than its bound");
+
+	return EXIT_SUCCESS;
+}
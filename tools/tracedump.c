@@ -0,0 +1,110 @@
+/**
+ * @file tracedump.c
+ * @authors Luis Damiano
+ * @version 0.1
+ * @details
+ *
+ * Decode a particle trace (see src/trace.c) to CSV, one row per record.
+ *
+ * Records are written by many rings at once, so they come in no particular
+ * order. With -s, they are sorted by tag, step and particle (which needs the
+ * whole trace in memory).
+ *
+ * Usage:
+ *	./tracedump [-s] trace.bin > trace.csv
+ *
+ * Compile:
+ *	make -C tools
+ */
+
+#include "main.h"
+
+#define TRACE_HEADER "tag,block,k,i,px,py,vx,vy,lpdfMeasurement,lpdfState," \
+	"lpdfImportance,lwPrev,lw\n"
+
+/**
+ * Order records by tag, step and particle (for qsort).
+ */
+static int record_cmp(const void *a, const void *b) {
+	const trace_record *x = (const trace_record *)a;
+	const trace_record *y = (const trace_record *)b;
+
+	if (x->tag != y->tag)
+		return (x->tag > y->tag) - (x->tag < y->tag);
+	if (x->k != y->k)
+		return (x->k > y->k) - (x->k < y->k);
+	return (x->i > y->i) - (x->i < y->i);
+}
+
+/**
+ * Print a record as a CSV row.
+ *
+ * @param fp The output.
+ * @param rec The record.
+ */
+static void record_print(FILE *fp, const trace_record *rec) {
+	fprintf(fp, "%i,%i,%i,%i", (int)rec->tag, (int)rec->block,
+			(int)rec->k, (int)rec->i);
+	for (int j = 0; j < STATE_DIM; j++)
+		fprintf(fp, ",%.17g", rec->x[j]);
+	fprintf(fp, ",%.17g,%.17g,%.17g,%.17g,%.17g\n", rec->lpdfMeasurement,
+			rec->lpdfState, rec->lpdfImportance, rec->lwPrev,
+			rec->lw);
+}
+
+int main(int argc, char** argv)
+{
+	char magic[8];
+	uint32_t head[2];
+	trace_record rec, *all = NULL;
+	size_t n = 0, cap = 0;
+	int sorted = 0, opt;
+	FILE *fp;
+
+	while ((opt = getopt(argc, argv, "s")) != -1) {
+		if (opt != 's')
+			fatal("unknown option");
+		sorted = 1;
+	}
+
+	if (optind != argc - 1)
+		fatal("give one trace file");
+
+	fp = fopen(argv[optind], "rb");
+	if (fp == NULL)
+		fatal("cannot open file, is it accessible?");
+
+	if (fread(magic, 1, 8, fp) != 8 ||
+			memcmp(magic, TRACE_MAGIC, 8) != 0 ||
+			fread(head, sizeof(uint32_t), 2, fp) != 2)
+		fatal("not a trace file");
+	if (head[0] != TRACE_VERSION || head[1] != sizeof(trace_record))
+		fatal("the trace was written by another version");
+
+	printf(TRACE_HEADER);
+	while (fread(&rec, sizeof(trace_record), 1, fp) == 1) {
+		if (!sorted) {
+			record_print(stdout, &rec);
+			continue;
+		}
+
+		if (n == cap) {
+			cap = cap > 0 ? 2 * cap : 4096;
+			all = (trace_record *)realloc(all,
+						cap * sizeof(trace_record));
+			if (all == NULL)
+				fatal("couldn't hold the trace in memory");
+		}
+		all[n++] = rec;
+	}
+	fclose(fp);
+
+	if (sorted) {
+		qsort(all, n, sizeof(trace_record), record_cmp);
+		for (size_t j = 0; j < n; j++)
+			record_print(stdout, all + j);
+		free(all);
+	}
+
+	return EXIT_SUCCESS;
+}